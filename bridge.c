@@ -0,0 +1,850 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * The bridge between the VESC on the UART and the clients on BLE and USB.
+ *
+ * Requests from clients are answered by the bridge itself when it can, from
+ * the cache, from recent telemetry or by the upload pipeline, and forwarded
+ * to the VESC otherwise. Replies from the VESC go back to the client that
+ * asked, see router.c.
+ *
+ * Everything that depends on the hardware goes through hal.h, so that the
+ * same logic runs on the nRF52 and in the host simulation. The platform
+ * calls the functions in bridge.h from the contexts noted there, and the
+ * state that several of them share is protected with critical regions. The
+ * regions only cover that state. Packets are put together and queued outside
+ * of them, the UART and BLE queues take packets from any context.
+ */
+
+#include "bridge.h"
+#include "packet.h"
+#include "buffer.h"
+#include "datatypes.h"
+#include "crc.h"
+#include "router.h"
+#include "upload.h"
+#include "cache.h"
+#include "telemetry.h"
+#include "lz.h"
+#include "conn_adapt.h"
+#include "isr_stats.h"
+#include "trace.h"
+
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+// Settings
+#define BLE_COMPRESS_MIN_LEN			64		// Smaller payloads are never compressed
+#define BLE_COMPRESS_MIN_SAVING			10		// Percent of the payload compression has to save
+#define TRACE_DRAIN_RECORDS				32		// Trace records per COMM_EXT_NRF_TRACE packet
+#define TRACE_DRAIN_MS					10		// Shortest time between two COMM_EXT_NRF_TRACE packets
+
+// Private types
+typedef struct {
+	bool busy;					// Taken by a context that compresses for the link
+	LZ_STATE_t lz;
+	uint8_t buf[PACKET_MAX_PL_LEN];
+} BLE_LZ_TX_t;
+
+// Private variables
+static bool								m_is_enabled = true;
+static bool								m_ble_compress[BLE_LINKS];		// Enabled by the client with COMM_EXT_NRF_COMPRESSION
+static BLE_LZ_TX_t						m_ble_lz_tx[BLE_LINKS];
+static uint8_t							m_ble_lz_rx_buf[PACKET_MAX_PL_LEN];	// Only used from the BLE context
+
+static uint32_t							m_uart_baud = UART_BAUD_DEFAULT;
+static volatile uint32_t				m_uart_baud_req = 0;
+static volatile int						m_uart_baud_req_handler = PACKET_BLE;
+static volatile int						m_uart_baud_req_time = 0;
+static volatile int						m_uart_frame_age = 0;
+static volatile bool					m_uart_baud_ext = false;		// The VESC has answered COMM_EXT_NRF_SET_BAUD
+static int								m_present_time = 0;
+static volatile int						m_trace_handler = -1;			// Client that receives the trace, see bridge_process
+#if TRACE
+static volatile bool					m_trace_drain = false;
+static int								m_trace_drain_time = 0;
+#endif
+
+// Private functions
+static void uart_send_buffer(const packet_segment *segs, int seg_num, int handler_num);
+static void ble_send_buffer(const packet_segment *segs, int seg_num, int handler_num);
+static void usb_send_buffer(const packet_segment *segs, int seg_num, int handler_num);
+static void process_packet_vesc(unsigned char *data, unsigned int len, int handler_num);
+static void process_packet_ble(unsigned char *data, unsigned int len, int handler_num);
+static void process_packet_client(unsigned char *data, unsigned int len, int handler_num);
+static void process_bridge_cmd(unsigned char *data, unsigned int len, int handler_num);
+static void forward_to_vesc(unsigned char *data, unsigned int len, int handler_num);
+static void client_reset(int handler_num);
+
+/**
+ * Set up the packet handlers and the modules of the bridge. The platform
+ * has to be ready to send when this is called.
+ */
+void bridge_init(void) {
+	router_init();
+	upload_init(PACKET_VESC, forward_to_vesc);
+	telemetry_init(PACKET_VESC);
+	packet_init(uart_send_buffer, process_packet_vesc, PACKET_VESC);
+	for (int i = 0;i < BLE_LINKS;i++) {
+		packet_init(ble_send_buffer, process_packet_ble, PACKET_BLE + i);
+	}
+#if HAL_USB
+	packet_init(usb_send_buffer, process_packet_client, PACKET_USB);
+#else
+	(void)usb_send_buffer;
+#endif
+}
+
+/**
+ * Data received from the VESC. Called from the main loop.
+ */
+void bridge_uart_rx(const uint8_t *data, size_t len) {
+	packet_process_bytes(data, len, PACKET_VESC);
+}
+
+/**
+ * Received data from the VESC was lost, e.g. because of an overflow.
+ */
+void bridge_uart_rx_reset(void) {
+	packet_reset(PACKET_VESC);
+}
+
+/**
+ * Data received from a BLE link, over NUS or L2CAP. Called from BLE events.
+ */
+void bridge_ble_rx(int link, const uint8_t *data, size_t len) {
+	packet_process_bytes(data, len, PACKET_BLE + link);
+}
+
+void bridge_ble_connected(int link) {
+	m_ble_compress[link] = false;
+	CRITICAL_REGION_ENTER();
+	packet_reset(PACKET_BLE + link);
+	conn_adapt_reset(link);
+	CRITICAL_REGION_EXIT();
+}
+
+void bridge_ble_disconnected(int link) {
+	m_ble_compress[link] = false;
+	client_reset(PACKET_BLE + link);
+}
+
+/**
+ * Data received from USB. Called from the main loop.
+ */
+void bridge_usb_rx(const uint8_t *data, size_t len) {
+	packet_process_bytes(data, len, PACKET_USB);
+}
+
+void bridge_usb_connected(void) {
+	CRITICAL_REGION_ENTER();
+	packet_reset(PACKET_USB);
+	CRITICAL_REGION_EXIT();
+}
+
+void bridge_usb_disconnected(void) {
+	client_reset(PACKET_USB);
+}
+
+/**
+ * A packet received over ESB, which is passed on to the VESC.
+ */
+void bridge_esb_rx(const uint8_t *data, uint16_t len) {
+	if (!upload_active()) {
+		uint8_t buffer[len + 1];
+		buffer[0] = COMM_EXT_NRF_ESB_RX_DATA;
+		memcpy(buffer + 1, data, len);
+		packet_send_packet(buffer, len + 1, PACKET_VESC);
+	}
+}
+
+static void client_reset(int handler_num) {
+	CRITICAL_REGION_ENTER();
+	router_remove_handler(handler_num);
+	if (m_trace_handler == handler_num) {
+		m_trace_handler = -1;
+	}
+	CRITICAL_REGION_EXIT();
+
+	telemetry_remove_handler(handler_num);
+}
+
+static void set_enabled(bool en) {
+	m_is_enabled = en;
+	hal_uart_set_enabled(en);
+}
+
+/*
+ * Real-time control packets that should not wait behind bulk transfers such
+ * as firmware and configuration uploads.
+ */
+static bool is_control_packet(const unsigned char *data, unsigned int len) {
+	if (len == 0) {
+		return false;
+	}
+
+	int cmd = data[0];
+	if (cmd == COMM_FORWARD_CAN) {
+		if (len < 3) {
+			return false;
+		}
+		cmd = data[2];
+	}
+
+	switch (cmd) {
+	case COMM_EXT_NRF_ESB_RX_DATA:
+	case COMM_SET_DUTY:
+	case COMM_SET_CURRENT:
+	case COMM_SET_CURRENT_BRAKE:
+	case COMM_SET_RPM:
+	case COMM_SET_POS:
+	case COMM_SET_HANDBRAKE:
+	case COMM_SET_CHUCK_DATA:
+	case COMM_ALIVE:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static void uart_send_buffer(const packet_segment *segs, int seg_num, int handler_num) {
+	(void)handler_num;
+
+	// segs[1] is the payload, see packet_send_packet
+	bool control = seg_num > 1 && is_control_packet(segs[1].data, segs[1].len);
+	hal_uart_send(segs, seg_num, control ? HAL_UART_PRIO_HIGH : HAL_UART_PRIO_NORMAL);
+}
+
+static void uart_baud_apply(uint32_t baud) {
+	m_uart_baud = baud;
+	hal_uart_set_baud(baud);
+	m_uart_frame_age = 0;
+}
+
+static void uart_baud_send(uint32_t baud, int handler_num) {
+	uint8_t buffer[6];
+	int32_t ind = 0;
+	buffer[ind++] = COMM_EXT_NRF_BRIDGE;
+	buffer[ind++] = COMM_EXT_NRF_SET_BAUD;
+	buffer_append_uint32(buffer, baud, &ind);
+	packet_send_packet(buffer, ind, handler_num);
+}
+
+/*
+ * Ask the VESC to switch to baud. The request is sent at the current rate
+ * and everything queued for the VESC after it is held back until the VESC
+ * has answered, so that nothing is sent while the two sides disagree on the
+ * rate. The VESC answers with COMM_EXT_NRF_SET_BAUD and the rate it accepted,
+ * then switches once its reply has been sent. The place of the request in the
+ * UART queue is reserved before the pause, so it is sent after it.
+ */
+static bool uart_baud_negotiate(uint32_t baud, int handler_num) {
+	bool res = false;
+
+	CRITICAL_REGION_ENTER();
+	if (hal_uart_baud_supported(baud) && m_uart_baud_req == 0 &&
+			hal_uart_reserve(PACKET_FRAME_LEN(6), HAL_UART_PRIO_NORMAL)) {
+		m_uart_baud_req_handler = handler_num;
+		hal_uart_tx_pause(true);
+		m_uart_baud_req = baud;
+		m_uart_baud_req_time = UART_BAUD_ACK_TIMEOUT_MS;
+		res = true;
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (res) {
+		uart_baud_send(baud, PACKET_VESC);
+	}
+
+	return res;
+}
+
+static void uart_baud_req_done(uint32_t baud) {
+	int handler = -1;
+
+	CRITICAL_REGION_ENTER();
+	if (m_uart_baud_req) {
+		if (baud == m_uart_baud_req) {
+			uart_baud_apply(baud);
+		}
+		m_uart_baud_req = 0;
+		hal_uart_tx_pause(false);
+		handler = m_uart_baud_req_handler;
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (handler >= 0) {
+		uart_baud_send(m_uart_baud, handler);
+	}
+}
+
+void rfhelp_send_data_crc(uint8_t *data, unsigned int len) {
+	uint8_t buffer[len + 2];
+	unsigned short crc = crc16((unsigned char*)data, len);
+	memcpy(buffer, data, len);
+	buffer[len] = (char)(crc >> 8);
+	buffer[len + 1] = (char)(crc & 0xFF);
+	hal_esb_send(buffer, len + 2);
+}
+
+static void ble_send_buffer(const packet_segment *segs, int seg_num, int handler_num) {
+	int link = handler_num - PACKET_BLE;
+
+	if (!hal_ble_connected(link)) {
+		return;
+	}
+
+	// Large payloads are sent as [COMM_EXT_NRF_BRIDGE][COMM_EXT_NRF_COMPRESSED]
+	// [u16 length][LZ4 block] if the client supports it and that saves at
+	// least BLE_COMPRESS_MIN_SAVING percent. Smaller savings are not worth the
+	// encode time and the decode on the client. The payload is the middle
+	// segment from packet_send_packet.
+	if (m_ble_compress[link] && seg_num == 3 && segs[1].len >= BLE_COMPRESS_MIN_LEN &&
+			!(segs[1].data[0] == COMM_EXT_NRF_BRIDGE && segs[1].data[1] == COMM_EXT_NRF_COMPRESSED)) {
+		// Each link has its own buffer. While another context compresses for
+		// the same link the packet is sent as it is.
+		BLE_LZ_TX_t *tx = &m_ble_lz_tx[link];
+		bool taken = false;
+
+		CRITICAL_REGION_ENTER();
+		if (!tx->busy) {
+			tx->busy = true;
+			taken = true;
+		}
+		CRITICAL_REGION_EXIT();
+
+		if (taken) {
+			int32_t ind = 0;
+			tx->buf[ind++] = COMM_EXT_NRF_BRIDGE;
+			tx->buf[ind++] = COMM_EXT_NRF_COMPRESSED;
+			buffer_append_uint16(tx->buf, segs[1].len, &ind);
+
+			int res = lz_compress(&tx->lz, segs[1].data, segs[1].len, tx->buf + ind,
+					segs[1].len * (100 - BLE_COMPRESS_MIN_SAVING) / 100 - ind);
+			if (res > 0) {
+				packet_send_packet(tx->buf, ind + res, handler_num);
+			}
+
+			tx->busy = false;
+
+			if (res > 0) {
+				return;
+			}
+		}
+	}
+
+	if (hal_ble_send(link, segs, seg_num)) {
+		CRITICAL_REGION_ENTER();
+		conn_adapt_packet(link);
+		CRITICAL_REGION_EXIT();
+	}
+}
+
+static void usb_send_buffer(const packet_segment *segs, int seg_num, int handler_num) {
+	(void)handler_num;
+	hal_usb_send(segs, seg_num);
+}
+
+static void send_stats(int handler_num) {
+	uint8_t buffer[17 + HAL_UART_PRIO_NUM * (5 + 4 * HAL_UART_HIST_BINS) + BLE_LINKS * 30];
+	int32_t ind = 0;
+	HAL_BLE_STATS_t stats[BLE_LINKS];
+
+	// BLE TX queue of all links together
+	uint32_t depth = 0;
+	uint32_t depth_max = 0;
+	uint32_t drops = 0;
+	for (int i = 0;i < BLE_LINKS;i++) {
+		hal_ble_stats(i, &stats[i]);
+		depth += stats[i].tx_depth;
+		depth_max += stats[i].tx_depth_max;
+		drops += stats[i].tx_drops;
+	}
+
+	buffer[ind++] = COMM_EXT_NRF_BRIDGE;
+	buffer[ind++] = COMM_EXT_NRF_STATS;
+	buffer_append_uint32(buffer, depth, &ind);
+	buffer_append_uint32(buffer, depth_max, &ind);
+	buffer_append_uint32(buffer, drops, &ind);
+
+	// UART TX queueing latency histograms and dropped packets, highest
+	// priority first
+	buffer[ind++] = HAL_UART_PRIO_NUM;
+	for (int i = 0;i < HAL_UART_PRIO_NUM;i++) {
+		const uint32_t *hist = hal_uart_tx_hist(i);
+		buffer[ind++] = HAL_UART_HIST_BINS;
+		for (int j = 0;j < HAL_UART_HIST_BINS;j++) {
+			buffer_append_uint32(buffer, hist[j], &ind);
+		}
+		buffer_append_uint32(buffer, hal_uart_tx_drops(i), &ind);
+	}
+
+	// Every BLE link, with the parameters negotiated with its peer. Connection
+	// interval in 1.25 ms units, L2CAP MTU 0 while no channel is open.
+	buffer[ind++] = BLE_LINKS;
+	for (int i = 0;i < BLE_LINKS;i++) {
+		HAL_BLE_STATS_t *s = &stats[i];
+		buffer[ind++] = s->connected;
+		buffer_append_uint32(buffer, s->tx_depth, &ind);
+		buffer_append_uint32(buffer, s->tx_depth_max, &ind);
+		buffer_append_uint32(buffer, s->tx_drops, &ind);
+		buffer[ind++] = s->tx_phy;
+		buffer[ind++] = s->rx_phy;
+		buffer_append_uint16(buffer, s->tx_octets, &ind);
+		buffer_append_uint16(buffer, s->rx_octets, &ind);
+		buffer_append_uint16(buffer, s->att_mtu, &ind);
+		buffer_append_uint16(buffer, s->conn_interval, &ind);
+		buffer_append_uint16(buffer, s->slave_latency, &ind);
+		buffer[ind++] = conn_adapt_state(i);
+		buffer_append_uint16(buffer, s->l2cap_mtu, &ind);
+	}
+
+	packet_send_packet(buffer, ind, handler_num);
+}
+
+/*
+ * [COMM_EXT_NRF_BRIDGE][COMM_EXT_NRF_ISR_STATS][u8 probes, 0 if not compiled
+ * in]. If a valid probe was requested:
+ * [u8 probe][u8 shift][u8 bins][u32 count][u32 max latency][u32 max duration]
+ * [bins x u32 latency][bins x u32 duration], times in cycles. See isr_stats.c
+ * for the bins.
+ */
+static void send_isr_stats(int probe, bool reset, int handler_num) {
+	uint8_t buffer[19 + 8 * ISR_STATS_BINS];
+	int32_t ind = 0;
+
+	buffer[ind++] = COMM_EXT_NRF_BRIDGE;
+	buffer[ind++] = COMM_EXT_NRF_ISR_STATS;
+	buffer[ind++] = ISR_STATS ? ISR_STATS_PROBES : 0;
+
+	// The counters are read and reset together
+	CRITICAL_REGION_ENTER();
+	if (ISR_STATS && probe >= 0 && probe < ISR_STATS_PROBES) {
+		const uint32_t *lat = isr_stats_latency_hist(probe);
+		const uint32_t *dur = isr_stats_duration_hist(probe);
+
+		buffer[ind++] = probe;
+		buffer[ind++] = ISR_STATS_SHIFT;
+		buffer[ind++] = ISR_STATS_BINS;
+		buffer_append_uint32(buffer, isr_stats_count(probe), &ind);
+		buffer_append_uint32(buffer, isr_stats_max_latency(probe), &ind);
+		buffer_append_uint32(buffer, isr_stats_max_duration(probe), &ind);
+		for (int i = 0;i < ISR_STATS_BINS;i++) {
+			buffer_append_uint32(buffer, lat[i], &ind);
+		}
+		for (int i = 0;i < ISR_STATS_BINS;i++) {
+			buffer_append_uint32(buffer, dur[i], &ind);
+		}
+	}
+
+	if (reset) {
+		isr_stats_reset();
+	}
+	CRITICAL_REGION_EXIT();
+
+	packet_send_packet(buffer, ind, handler_num);
+}
+
+/*
+ * Packets from a client (VESC Tool over BLE or USB). Requests for the bridge
+ * itself are answered here, everything else is forwarded to the VESC.
+ */
+static void process_packet_client(unsigned char *data, unsigned int len, int handler_num) {
+	if (data[0] == COMM_EXT_NRF_BRIDGE) {
+		if (len >= 2) {
+			process_bridge_cmd(data + 1, len - 1, handler_num);
+		}
+		return;
+	}
+
+	if (cache_request(data, len, handler_num)) {
+		// Answered from the cache
+	} else if (telemetry_request(data, len, handler_num)) {
+		// Answered from recent values
+	} else if (!upload_process_client(data, len, handler_num)) {
+		forward_to_vesc(data, len, handler_num);
+	}
+}
+
+/*
+ * The request has to reach the UART in the same order as the routes are
+ * recorded. Only the route and the place in the UART queue are taken within
+ * the critical region, the packet is put together and queued after it.
+ */
+static void forward_to_vesc(unsigned char *data, unsigned int len, int handler_num) {
+	int prio = is_control_packet(data, len) ? HAL_UART_PRIO_HIGH : HAL_UART_PRIO_NORMAL;
+	bool reserved = false;
+
+	CRITICAL_REGION_ENTER();
+	reserved = hal_uart_reserve(PACKET_FRAME_LEN(len), prio);
+	if (reserved) {
+		router_add(data, len, handler_num, cache_generation());
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (reserved) {
+		packet_send_packet(data, len, PACKET_VESC);
+	}
+}
+
+/*
+ * Requests for the bridge itself. data starts with the COMM_EXT_NRF_CMD and
+ * the answers are sent as [COMM_EXT_NRF_BRIDGE][cmd][...].
+ */
+static void process_bridge_cmd(unsigned char *data, unsigned int len, int handler_num) {
+	if (data[0] == COMM_EXT_NRF_STATS) {
+		send_stats(handler_num);
+		return;
+	}
+
+	if (data[0] == COMM_EXT_NRF_ISR_STATS) {
+		// [u8 probe][u8 reset afterwards, optional]
+		send_isr_stats(len >= 2 ? data[1] : -1, len >= 3 && data[2], handler_num);
+		return;
+	}
+
+	if (data[0] == COMM_EXT_NRF_TRACE) {
+		// [u8 enable], answered with the new state. Always disabled when
+		// the firmware is built without TRACE. One client at a time.
+		if (TRACE && len >= 2) {
+			if (data[1]) {
+				m_trace_handler = handler_num;
+			} else if (m_trace_handler == handler_num) {
+				m_trace_handler = -1;
+			}
+		}
+
+		uint8_t buffer[3];
+		buffer[0] = COMM_EXT_NRF_BRIDGE;
+		buffer[1] = COMM_EXT_NRF_TRACE;
+		buffer[2] = m_trace_handler == handler_num;
+		packet_send_packet(buffer, 3, handler_num);
+		return;
+	}
+
+	if (data[0] == COMM_EXT_NRF_SET_BAUD) {
+		if (len >= 5) {
+			int32_t ind = 1;
+			uint32_t baud = buffer_get_uint32(data, &ind);
+			if (baud != m_uart_baud && uart_baud_negotiate(baud, handler_num)) {
+				return;
+			}
+		}
+
+		uart_baud_send(m_uart_baud, handler_num);
+		return;
+	}
+
+	if (data[0] == COMM_EXT_NRF_COMPRESSION) {
+		// [u8 enable], answered with the new state. Only BLE is compressed.
+		bool enabled = false;
+		if (IS_PACKET_BLE(handler_num)) {
+			int link = handler_num - PACKET_BLE;
+			if (len >= 2) {
+				m_ble_compress[link] = data[1];
+			}
+			enabled = m_ble_compress[link];
+		}
+
+		uint8_t buffer[3];
+		int32_t ind = 0;
+		buffer[ind++] = COMM_EXT_NRF_BRIDGE;
+		buffer[ind++] = COMM_EXT_NRF_COMPRESSION;
+		buffer[ind++] = enabled;
+
+		packet_send_packet(buffer, ind, handler_num);
+		return;
+	}
+
+	if (data[0] == COMM_EXT_NRF_TELEMETRY_SUBSCRIBE) {
+		// [u32 COMM_GET_VALUES_SELECTIVE mask][u16 period ms][u8 keyframe interval,
+		// optional, enables delta packets], mask 0 to stop
+		if (len >= 7) {
+			int32_t ind = 1;
+			uint32_t mask = buffer_get_uint32(data, &ind);
+			uint32_t period = buffer_get_uint16(data, &ind);
+			uint8_t keyframe = len >= 8 ? data[ind] : 0;
+
+			uint8_t buffer[6];
+			ind = 0;
+			buffer[ind++] = COMM_EXT_NRF_BRIDGE;
+			buffer[ind++] = COMM_EXT_NRF_TELEMETRY_SUBSCRIBE;
+
+			buffer_append_uint32(buffer, telemetry_subscribe(handler_num, mask, period, keyframe), &ind);
+			packet_send_packet(buffer, ind, handler_num);
+		}
+		return;
+	}
+}
+
+static void process_packet_ble(unsigned char *data, unsigned int len, int handler_num) {
+	if (data[0] == COMM_EXT_NRF_BRIDGE && len >= 2 && data[1] == COMM_EXT_NRF_COMPRESSED) {
+		// [u16 length][LZ4 block]
+		if (len < 5) {
+			return;
+		}
+
+		int32_t ind = 2;
+		unsigned int pl_len = buffer_get_uint16(data, &ind);
+
+		if (pl_len == 0 || pl_len > sizeof(m_ble_lz_rx_buf) ||
+				lz_decompress(data + ind, len - ind, m_ble_lz_rx_buf, pl_len) != (int)pl_len) {
+			return;
+		}
+
+		data = m_ble_lz_rx_buf;
+		len = pl_len;
+	}
+
+	CRITICAL_REGION_ENTER();
+	conn_adapt_packet(handler_num - PACKET_BLE);
+	CRITICAL_REGION_EXIT();
+
+	process_packet_client(data, len, handler_num);
+}
+
+/**
+ * Collect the handlers of all connected clients.
+ *
+ * @param handlers
+ * Room for BLE_LINKS + 1 handlers.
+ *
+ * @return
+ * Number of handlers.
+ */
+static int client_handlers(int *handlers) {
+	int cnt = 0;
+
+	for (int i = 0;i < BLE_LINKS;i++) {
+		if (hal_ble_connected(i)) {
+			handlers[cnt++] = PACKET_BLE + i;
+		}
+	}
+
+#if HAL_USB
+	if (hal_usb_connected()) {
+		handlers[cnt++] = PACKET_USB;
+	}
+#endif
+
+	return cnt;
+}
+
+static void process_packet_vesc(unsigned char *data, unsigned int len, int handler_num) {
+	(void)handler_num;
+	m_uart_frame_age = 0;
+
+	if (data[0] == COMM_EXT_NRF_ESB_SET_CH_ADDR) {
+		hal_esb_set_ch_addr(data[1], data[2], data[3], data[4]);
+	} else if (data[0] == COMM_EXT_NRF_ESB_SEND_DATA) {
+		rfhelp_send_data_crc(data + 1, len - 1);
+	} else if (data[0] == COMM_EXT_NRF_SET_ENABLED) {
+		set_enabled(data[1]);
+	} else if (data[0] == COMM_EXT_NRF_BRIDGE) {
+		// Also the answer to the keepalive sent from bridge_timerfunc
+		if (len >= 6 && data[1] == COMM_EXT_NRF_SET_BAUD) {
+			int32_t ind = 2;
+			m_uart_baud_ext = true;
+			uart_baud_req_done(buffer_get_uint32(data, &ind));
+		}
+	} else {
+		if (upload_process_vesc(data, len)) {
+			// Write result for the upload pipeline
+		} else if (telemetry_process_vesc(data, len)) {
+			// Answer to a telemetry poll, sent to the subscribers
+		} else if (m_is_enabled) {
+			// Replies go to the client that asked, everything else such as
+			// COMM_PRINT to all connected clients.
+			bool bare = false;
+			uint32_t generation = 0;
+			int client = -1;
+
+			CRITICAL_REGION_ENTER();
+			client = router_take(data, len, &bare, &generation);
+			CRITICAL_REGION_EXIT();
+
+			if (bare) {
+				cache_store(data, len, generation);
+			}
+
+			if (client >= 0) {
+				packet_send_packet(data, len, client);
+			} else {
+				int handlers[BLE_LINKS + 1];
+				packet_send_packet_multi(data, len, handlers, client_handlers(handlers));
+			}
+		}
+	}
+}
+
+void ble_printf(const char* format, ...) {
+	va_list arg;
+	va_start (arg, format);
+	int len;
+	static char print_buffer[255];
+
+	print_buffer[0] = COMM_PRINT;
+	len = vsnprintf(print_buffer + 1, 254, format, arg);
+	va_end (arg);
+
+	if(len > 0) {
+		int handlers[BLE_LINKS];
+		int cnt = 0;
+		for (int i = 0;i < BLE_LINKS;i++) {
+			if (hal_ble_connected(i)) {
+				handlers[cnt++] = PACKET_BLE + i;
+			}
+		}
+		packet_send_packet_multi((unsigned char*)print_buffer, (len < 254) ? len + 1 : 255, handlers, cnt);
+	}
+}
+
+void cdc_printf(const char* format, ...) {
+#if HAL_USB
+	va_list arg;
+	va_start (arg, format);
+	int len;
+	static char print_buffer[255];
+
+	print_buffer[0] = COMM_PRINT;
+	len = vsnprintf(print_buffer + 1, 254, format, arg);
+	va_end (arg);
+
+	if(len > 0) {
+		packet_send_packet((unsigned char*)print_buffer, (len < 254) ? len + 1 : 255, PACKET_USB);
+	}
+#else
+	(void)format;
+#endif
+}
+
+static void send_present(void) {
+	if (!upload_active()) {
+		uint8_t buffer[1];
+		buffer[0] = COMM_EXT_NRF_PRESENT;
+		packet_send_packet(buffer, 1, PACKET_VESC);
+
+		// Keep the link alive above the default rate, the VESC falls back
+		// to UART_BAUD_DEFAULT on its side as well when this stops. Only
+		// sent to a VESC that has shown that it knows the command.
+		if (m_uart_baud_ext && m_uart_baud != UART_BAUD_DEFAULT && m_uart_baud_req == 0) {
+			uart_baud_send(m_uart_baud, PACKET_VESC);
+		}
+	}
+}
+
+/**
+ * Call every millisecond, from the timer context.
+ */
+void bridge_timerfunc(void) {
+	packet_timerfunc();
+
+#if TRACE
+	trace_timerfunc();
+	if (++m_trace_drain_time >= TRACE_DRAIN_MS) {
+		m_trace_drain_time = 0;
+		m_trace_drain = true;
+	}
+#endif
+
+	CRITICAL_REGION_ENTER();
+	router_timerfunc();
+	conn_adapt_timerfunc();
+	CRITICAL_REGION_EXIT();
+
+	upload_timerfunc();
+	cache_timerfunc();
+	if (!upload_active()) {
+		telemetry_timerfunc();
+	}
+
+	if (m_uart_baud_req && --m_uart_baud_req_time <= 0) {
+		uart_baud_req_done(0);
+	}
+
+	// Flash operations during firmware uploads can keep the VESC silent for
+	// a while, so they do not count as a lost link.
+	if (m_uart_baud != UART_BAUD_DEFAULT && !upload_active()) {
+		if (++m_uart_frame_age >= UART_BAUD_FALLBACK_MS) {
+			// The VESC might have been restarted, possibly with a firmware
+			// that does not support the bridge commands.
+			cache_invalidate();
+			m_uart_baud_ext = false;
+			CRITICAL_REGION_ENTER();
+			uart_baud_apply(UART_BAUD_DEFAULT);
+			CRITICAL_REGION_EXIT();
+			if (m_uart_baud_req) {
+				uart_baud_req_done(0);
+			}
+		}
+	}
+
+	if (++m_present_time >= BRIDGE_PRESENT_MS) {
+		m_present_time = 0;
+		send_present();
+	}
+}
+
+/*
+ * Stream recorded trace events to hal_trace_write, and to the client that
+ * asked for them with COMM_EXT_NRF_TRACE as [COMM_EXT_NRF_BRIDGE][cmd]
+ * [records...]. Every packet is traced itself, so the client gets at most one
+ * packet every TRACE_DRAIN_MS.
+ */
+#if TRACE
+static void trace_drain(void) {
+	uint8_t buffer[2 + TRACE_DRAIN_RECORDS * TRACE_RECORD_LEN];
+	int handler = m_trace_handler;
+
+	if (handler >= 0) {
+		if (!m_trace_drain) {
+			return;
+		}
+		m_trace_drain = false;
+	}
+
+	for (;;) {
+		unsigned int len = trace_read(buffer + 2, sizeof(buffer) - 2);
+		if (len == 0) {
+			break;
+		}
+
+		hal_trace_write(buffer + 2, len);
+
+		if (handler >= 0) {
+			buffer[0] = COMM_EXT_NRF_BRIDGE;
+			buffer[1] = COMM_EXT_NRF_TRACE;
+			packet_send_packet(buffer, len + 2, handler);
+			break;
+		}
+	}
+}
+#endif
+
+/**
+ * Call from the main loop.
+ */
+void bridge_process(void) {
+	upload_process();
+
+#if TRACE
+	trace_drain();
+#endif
+}
@@ -0,0 +1,67 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef BRIDGE_H_
+#define BRIDGE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "hal.h"
+
+// Settings
+#define BLE_LINKS						NRF_SDH_BLE_PERIPHERAL_LINK_COUNT
+
+#define PACKET_VESC						0
+#define PACKET_BLE						1		// First BLE link, one handler per link
+#define PACKET_USB						(PACKET_BLE + BLE_LINKS)
+#define IS_PACKET_BLE(h)				((h) >= PACKET_BLE && (h) < PACKET_BLE + BLE_LINKS)
+
+#if HAL_USB
+#if PACKET_HANDLERS < PACKET_USB + 1
+#error "PACKET_HANDLERS must cover the VESC, every BLE link and USB"
+#endif
+#else
+#if PACKET_HANDLERS < PACKET_USB
+#error "PACKET_HANDLERS must cover the VESC and every BLE link"
+#endif
+#endif
+
+#ifndef UART_BAUD_DEFAULT
+#define UART_BAUD_DEFAULT				115200
+#endif
+#define UART_BAUD_ACK_TIMEOUT_MS		100		// Time to wait for the VESC to accept a new baud rate
+#define UART_BAUD_FALLBACK_MS			3000	// Go back to UART_BAUD_DEFAULT if no packet was decoded for this long
+#define BRIDGE_PRESENT_MS				1000	// Period of COMM_EXT_NRF_PRESENT to the VESC
+
+// Functions
+void bridge_init(void);
+void bridge_uart_rx(const uint8_t *data, size_t len);
+void bridge_uart_rx_reset(void);
+void bridge_ble_rx(int link, const uint8_t *data, size_t len);
+void bridge_ble_connected(int link);
+void bridge_ble_disconnected(int link);
+void bridge_usb_rx(const uint8_t *data, size_t len);
+void bridge_usb_connected(void);
+void bridge_usb_disconnected(void);
+void bridge_esb_rx(const uint8_t *data, uint16_t len);
+void bridge_timerfunc(void);
+void bridge_process(void);
+void ble_printf(const char* format, ...);
+void cdc_printf(const char* format, ...);
+
+#endif /* BRIDGE_H_ */
@@ -112,6 +112,27 @@ void buffer_append_float32_auto(uint8_t* buffer, float number, int32_t *index) {
 	buffer_append_uint32(buffer, res, index);
 }
 
+/*
+ * Regarding the var functions:
+ *
+ * Unsigned numbers are stored 7 bits at a time, least significant group first,
+ * with the top bit of each byte set when more bytes follow. Small numbers
+ * therefore take one byte and the largest ones five. Signed numbers are zig-zag
+ * mapped first (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...) so that small negative
+ * numbers are short as well.
+ */
+void buffer_append_var_uint32(uint8_t* buffer, uint32_t number, int32_t *index) {
+	while (number >= 0x80) {
+		buffer[(*index)++] = (number & 0x7F) | 0x80;
+		number >>= 7;
+	}
+	buffer[(*index)++] = number;
+}
+
+void buffer_append_var_int32(uint8_t* buffer, int32_t number, int32_t *index) {
+	buffer_append_var_uint32(buffer, ((uint32_t)number << 1) ^ (uint32_t)(number >> 31), index);
+}
+
 int16_t buffer_get_int16(const uint8_t *buffer, int32_t *index) {
 	int16_t res =	((uint16_t) buffer[*index]) << 8 |
 					((uint16_t) buffer[*index + 1]);
@@ -171,3 +192,20 @@ float buffer_get_float32_auto(const uint8_t *buffer, int32_t *index) {
 
 	return ldexpf(sig, e);
 }
+
+uint32_t buffer_get_var_uint32(const uint8_t *buffer, int32_t *index) {
+	uint32_t res = 0;
+	for (int shift = 0;shift < 35;shift += 7) {
+		uint8_t b = buffer[(*index)++];
+		res |= (uint32_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) {
+			break;
+		}
+	}
+	return res;
+}
+
+int32_t buffer_get_var_int32(const uint8_t *buffer, int32_t *index) {
+	uint32_t res = buffer_get_var_uint32(buffer, index);
+	return (int32_t)(res >> 1) ^ -(int32_t)(res & 1);
+}
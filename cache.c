@@ -0,0 +1,232 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Cache for the answers to requests that VESC Tool sends on every connect and
+ * that practically never change, such as the firmware version and the
+ * configurations. Only answers to requests that consist of the command ID
+ * alone are cached, and everything is dropped as soon as a command that can
+ * change any of them passes through the bridge. Answers to requests that were
+ * sent before that are not stored either, as they can be out of date.
+ *
+ * The functions can be called from any context, except cache_store which
+ * must always be called from the same one. They only mask interrupts to
+ * update the state of an entry. Answers are sent and stored outside of the
+ * critical regions: an entry that is being sent from is not overwritten, and
+ * one that is being stored is not valid.
+ */
+
+#include "cache.h"
+#include "packet.h"
+#include "datatypes.h"
+#include "hal.h"
+
+#include <string.h>
+
+// Private types
+typedef struct {
+	uint8_t cmd;
+	bool valid;
+	uint8_t readers;			// cache_request calls sending the answer
+	uint16_t len;
+	uint32_t age;
+	uint8_t data[PACKET_MAX_PL_LEN];
+} CACHE_ENTRY_t;
+
+// Private variables
+static CACHE_ENTRY_t m_entries[] = {
+		{.cmd = COMM_FW_VERSION},
+		{.cmd = COMM_GET_MCCONF},
+		{.cmd = COMM_GET_MCCONF_DEFAULT},
+		{.cmd = COMM_GET_APPCONF},
+		{.cmd = COMM_GET_APPCONF_DEFAULT}
+};
+
+#define ENTRY_NUM		(sizeof(m_entries) / sizeof(m_entries[0]))
+
+static volatile uint32_t m_generation = 0;
+
+// Private functions
+static CACHE_ENTRY_t *get_entry(uint8_t cmd);
+static bool invalidates(const unsigned char *data, unsigned int len);
+
+void cache_invalidate(void) {
+	CRITICAL_REGION_ENTER();
+	for (unsigned int i = 0;i < ENTRY_NUM;i++) {
+		m_entries[i].valid = false;
+	}
+	m_generation++;
+	CRITICAL_REGION_EXIT();
+}
+
+/**
+ * Get the number of times the cache was invalidated. Record it when a request
+ * is forwarded and pass it to cache_store with the answer.
+ */
+uint32_t cache_generation(void) {
+	return m_generation;
+}
+
+/**
+ * Process a request from a client before it is forwarded to the VESC.
+ *
+ * @param data
+ * The request payload.
+ *
+ * @param len
+ * Length of the payload.
+ *
+ * @param handler_num
+ * The packet handler the request came from. A cached answer is sent to it.
+ *
+ * @return
+ * true if the request was answered from the cache and should not be
+ * forwarded.
+ */
+bool cache_request(const unsigned char *data, unsigned int len, int handler_num) {
+	if (len == 0) {
+		return false;
+	}
+
+	if (invalidates(data, len)) {
+		cache_invalidate();
+		return false;
+	}
+
+	CACHE_ENTRY_t *e = get_entry(data[0]);
+	if (len != 1 || !e) {
+		return false;
+	}
+
+	bool hit = false;
+	CRITICAL_REGION_ENTER();
+	if (e->valid) {
+		e->readers++;
+		hit = true;
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (hit) {
+		packet_send_packet(e->data, e->len, handler_num);
+		CRITICAL_REGION_ENTER();
+		e->readers--;
+		CRITICAL_REGION_EXIT();
+	}
+
+	return hit;
+}
+
+/**
+ * Store the answer from the VESC to a request that consisted of the command
+ * ID only. Answers to other commands are ignored.
+ *
+ * @param generation
+ * cache_generation when the request was forwarded. If the cache was
+ * invalidated since, the answer can predate the change and is not stored.
+ */
+void cache_store(const unsigned char *data, unsigned int len, uint32_t generation) {
+	if (len == 0 || len > PACKET_MAX_PL_LEN) {
+		return;
+	}
+
+	CACHE_ENTRY_t *e = get_entry(data[0]);
+	if (!e) {
+		return;
+	}
+
+	// If the previous answer is still being sent, this one is dropped and
+	// the entry stays invalid until the next one.
+	bool store = false;
+	CRITICAL_REGION_ENTER();
+	e->valid = false;
+	store = generation == m_generation && e->readers == 0;
+	CRITICAL_REGION_EXIT();
+
+	if (!store) {
+		return;
+	}
+
+	memcpy(e->data, data, len);
+	e->len = len;
+
+	CRITICAL_REGION_ENTER();
+	if (generation == m_generation) {
+		e->age = 0;
+		e->valid = true;
+	}
+	CRITICAL_REGION_EXIT();
+}
+
+/**
+ * Call this function every millisecond. Answers expire after CACHE_TIMEOUT in
+ * case the configuration was changed over another interface of the VESC.
+ */
+void cache_timerfunc(void) {
+	CRITICAL_REGION_ENTER();
+	for (unsigned int i = 0;i < ENTRY_NUM;i++) {
+		if (m_entries[i].valid && ++m_entries[i].age >= CACHE_TIMEOUT) {
+			m_entries[i].valid = false;
+		}
+	}
+	CRITICAL_REGION_EXIT();
+}
+
+static CACHE_ENTRY_t *get_entry(uint8_t cmd) {
+	for (unsigned int i = 0;i < ENTRY_NUM;i++) {
+		if (m_entries[i].cmd == cmd) {
+			return &m_entries[i];
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Commands that can change the configuration, the firmware or the state of
+ * the VESC. To be on the safe side, forwarded commands are treated like the
+ * command they carry.
+ */
+static bool invalidates(const unsigned char *data, unsigned int len) {
+	int cmd = data[0];
+	if (cmd == COMM_FORWARD_CAN) {
+		if (len < 3) {
+			return false;
+		}
+		cmd = data[2];
+	}
+
+	switch (cmd) {
+	case COMM_JUMP_TO_BOOTLOADER:
+	case COMM_ERASE_NEW_APP:
+	case COMM_WRITE_NEW_APP_DATA:
+	case COMM_SET_MCCONF:
+	case COMM_SET_APPCONF:
+	case COMM_TERMINAL_CMD:
+	case COMM_TERMINAL_CMD_SYNC:
+	case COMM_REBOOT:
+	case COMM_SET_MCCONF_TEMP:
+	case COMM_SET_MCCONF_TEMP_SETUP:
+	case COMM_DETECT_APPLY_ALL_FOC:
+	case COMM_JUMP_TO_BOOTLOADER_ALL_CAN:
+	case COMM_ERASE_NEW_APP_ALL_CAN:
+	case COMM_WRITE_NEW_APP_DATA_ALL_CAN:
+		return true;
+
+	default:
+		return false;
+	}
+}
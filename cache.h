@@ -0,0 +1,36 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Settings
+#ifndef CACHE_TIMEOUT
+#define CACHE_TIMEOUT			60000	// Ticks of cache_timerfunc an answer is kept for
+#endif
+
+// Functions
+void cache_invalidate(void);
+uint32_t cache_generation(void);
+bool cache_request(const unsigned char *data, unsigned int len, int handler_num);
+void cache_store(const unsigned char *data, unsigned int len, uint32_t generation);
+void cache_timerfunc(void);
+
+#endif /* CACHE_H_ */
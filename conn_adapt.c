@@ -0,0 +1,164 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Traffic-adaptive connection parameters.
+ *
+ * Counts the packets that go over the BLE link and classifies it as busy,
+ * normal or idle. A busy link wants short connection intervals and long
+ * connection events, an idle one long intervals and slave latency so that
+ * the radio is free for other things. Switching back from idle is done on
+ * the first packet, going towards idle only after a while without traffic,
+ * and the state never changes faster than CONN_ADAPT_HOLDOFF so that the
+ * central is not flooded with update requests.
+ *
+ * Every link is tracked on its own. What the states mean in terms of
+ * connection parameters is up to the apply function.
+ *
+ * The functions are not reentrant. The caller is responsible for calling
+ * them from one context, or from within critical regions.
+ */
+
+#include "conn_adapt.h"
+
+// Private types
+typedef struct {
+	CONN_ADAPT_STATE state;
+	uint32_t packets;
+	uint32_t window_time;
+	uint32_t quiet_time;
+	uint32_t calm_time;
+	uint32_t holdoff;
+} LINK_t;
+
+// Private variables
+static void (*m_apply_func)(int link, CONN_ADAPT_STATE state) = 0;
+static LINK_t m_links[CONN_ADAPT_LINKS];
+
+// Private functions
+static void link_timerfunc(int link);
+
+void conn_adapt_init(void (*apply_func)(int link, CONN_ADAPT_STATE state)) {
+	m_apply_func = apply_func;
+	for (int i = 0;i < CONN_ADAPT_LINKS;i++) {
+		conn_adapt_reset(i);
+	}
+}
+
+/**
+ * Forget the traffic history of a link, call this when a new connection is
+ * made on it. The link starts out as normal, as set up by the preferred
+ * connection parameters, and the apply function is not called.
+ */
+void conn_adapt_reset(int link) {
+	if (link < 0 || link >= CONN_ADAPT_LINKS) {
+		return;
+	}
+
+	LINK_t *l = &m_links[link];
+	l->state = CONN_ADAPT_NORMAL;
+	l->packets = 0;
+	l->window_time = 0;
+	l->quiet_time = 0;
+	l->calm_time = CONN_ADAPT_CALM_TIME;
+	l->holdoff = CONN_ADAPT_HOLDOFF;
+}
+
+/**
+ * Count a packet sent or received over a link.
+ */
+void conn_adapt_packet(int link) {
+	if (link < 0 || link >= CONN_ADAPT_LINKS) {
+		return;
+	}
+
+	m_links[link].packets++;
+	m_links[link].quiet_time = 0;
+}
+
+CONN_ADAPT_STATE conn_adapt_state(int link) {
+	if (link < 0 || link >= CONN_ADAPT_LINKS) {
+		return CONN_ADAPT_NORMAL;
+	}
+
+	return m_links[link].state;
+}
+
+/**
+ * @return
+ * true if any link is busy.
+ */
+bool conn_adapt_any_busy(void) {
+	for (int i = 0;i < CONN_ADAPT_LINKS;i++) {
+		if (m_links[i].state == CONN_ADAPT_BUSY) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Call this function every millisecond.
+ */
+void conn_adapt_timerfunc(void) {
+	for (int i = 0;i < CONN_ADAPT_LINKS;i++) {
+		link_timerfunc(i);
+	}
+}
+
+static void link_timerfunc(int link) {
+	LINK_t *l = &m_links[link];
+
+	if (l->holdoff > 0) {
+		l->holdoff--;
+	}
+
+	if (l->quiet_time < CONN_ADAPT_IDLE_TIME) {
+		l->quiet_time++;
+	}
+
+	if (l->calm_time < CONN_ADAPT_CALM_TIME) {
+		l->calm_time++;
+	}
+
+	if (++l->window_time >= CONN_ADAPT_WINDOW) {
+		if (l->packets >= CONN_ADAPT_BUSY_PACKETS) {
+			l->calm_time = 0;
+		}
+		l->packets = 0;
+		l->window_time = 0;
+	}
+
+	CONN_ADAPT_STATE target = CONN_ADAPT_NORMAL;
+	if (l->calm_time < CONN_ADAPT_CALM_TIME) {
+		target = CONN_ADAPT_BUSY;
+	} else if (l->quiet_time >= CONN_ADAPT_IDLE_TIME) {
+		target = CONN_ADAPT_IDLE;
+	}
+
+	if (target == l->state || (l->holdoff > 0 && l->state != CONN_ADAPT_IDLE)) {
+		return;
+	}
+
+	l->state = target;
+	l->holdoff = CONN_ADAPT_HOLDOFF;
+
+	if (m_apply_func) {
+		m_apply_func(link, l->state);
+	}
+}
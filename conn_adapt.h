@@ -0,0 +1,54 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef CONN_ADAPT_H_
+#define CONN_ADAPT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Settings
+#ifndef CONN_ADAPT_LINKS
+#ifdef NRF_SDH_BLE_PERIPHERAL_LINK_COUNT
+#define CONN_ADAPT_LINKS			NRF_SDH_BLE_PERIPHERAL_LINK_COUNT
+#else
+#define CONN_ADAPT_LINKS			1
+#endif
+#endif
+
+#define CONN_ADAPT_WINDOW			100		// Ticks packets are counted over
+#define CONN_ADAPT_BUSY_PACKETS		5		// Packets in one window that make the link busy
+#define CONN_ADAPT_CALM_TIME		2000	// Ticks without a busy window before leaving busy
+#define CONN_ADAPT_IDLE_TIME		5000	// Ticks without packets before the link is idle
+#define CONN_ADAPT_HOLDOFF			1000	// Shortest time between two changes, except waking up
+
+// Types
+typedef enum {
+	CONN_ADAPT_IDLE = 0,
+	CONN_ADAPT_NORMAL,
+	CONN_ADAPT_BUSY
+} CONN_ADAPT_STATE;
+
+// Functions
+void conn_adapt_init(void (*apply_func)(int link, CONN_ADAPT_STATE state));
+void conn_adapt_reset(int link);
+void conn_adapt_packet(int link);
+CONN_ADAPT_STATE conn_adapt_state(int link);
+bool conn_adapt_any_busy(void);
+void conn_adapt_timerfunc(void);
+
+#endif /* CONN_ADAPT_H_ */
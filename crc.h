@@ -25,9 +25,29 @@
 #ifndef CRC_H_
 #define CRC_H_
 
+/*
+ * Backends, all of them give the same result.
+ *
+ * BYTE:   One 512 byte table, one lookup per byte.
+ * NIBBLE: One 32 byte table, two lookups per byte. For flash-tight builds.
+ * SLICE4: Four tables (2 KB), processes four bytes per step.
+ * SLICE8: Eight tables (4 KB), processes eight bytes per step.
+ * WORD64: Like SLICE8, but with 64-bit loads. Intended for host tools.
+ */
+#define CRC16_BACKEND_BYTE		0
+#define CRC16_BACKEND_NIBBLE	1
+#define CRC16_BACKEND_SLICE4	2
+#define CRC16_BACKEND_SLICE8	3
+#define CRC16_BACKEND_WORD64	4
+
+#ifndef CRC16_BACKEND
+#define CRC16_BACKEND			CRC16_BACKEND_SLICE4
+#endif
+
 /*
  * Functions
  */
 unsigned short crc16(unsigned char *buf, unsigned int len);
+unsigned short crc16_update(unsigned short crc, const unsigned char *buf, unsigned int len);
 
 #endif /* CRC_H_ */
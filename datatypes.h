@@ -99,9 +99,26 @@ typedef enum {
 	COMM_PING_CAN,
 	COMM_APP_DISABLE_OUTPUT,
 	COMM_TERMINAL_CMD_SYNC,
-	COMM_GET_IMU_DATA
+	COMM_GET_IMU_DATA,
+
+	// Extensions of this bridge, followed by a COMM_EXT_NRF_CMD byte. The
+	// last ID, as the VESC firmware assigns new IDs after COMM_GET_IMU_DATA.
+	COMM_EXT_NRF_BRIDGE = 255
 } COMM_PACKET_ID;
 
+// Sub-commands of COMM_EXT_NRF_BRIDGE
+typedef enum {
+	COMM_EXT_NRF_STATS = 0,
+	COMM_EXT_NRF_SET_BAUD,
+	COMM_EXT_NRF_TELEMETRY_SUBSCRIBE,
+	COMM_EXT_NRF_TELEMETRY_DELTA,
+	COMM_EXT_NRF_COMPRESSION,
+	COMM_EXT_NRF_COMPRESSED,
+	COMM_EXT_NRF_ISR_STATS,
+	COMM_EXT_NRF_TRACE,
+	COMM_EXT_NRF_UPLOAD_DROPPED
+} COMM_EXT_NRF_CMD;
+
 // Orientation data
 typedef struct {
 	float q0;
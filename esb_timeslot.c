@@ -2,6 +2,8 @@
 #include "sdk_common.h"
 #include "nrf.h"
 #include "app_error.h"
+#include "isr_stats.h"
+#include "trace.h"
 
 #if 0
 #ifdef APP_ERROR_CHECK
@@ -114,9 +116,12 @@ void nrf_evt_signal_handler(uint32_t evt_id) {
 /**@brief Timeslot event handler.
  */
 nrf_radio_signal_callback_return_param_t * radio_callback(uint8_t signal_type) {
+	ISR_STATS_ENTER(ISR_STATS_RADIO_CB);
+
 	switch (signal_type) {
 	case NRF_RADIO_CALLBACK_SIGNAL_TYPE_START:
 		/* Start of the timeslot - set up timer interrupt */
+		TRACE_EVENT(TRACE_TIMESLOT_START, 0);
 		signal_callback_return_param.params.request.p_next = NULL;
 		signal_callback_return_param.callback_action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_NONE;
 
@@ -134,13 +139,16 @@ nrf_radio_signal_callback_return_param_t * radio_callback(uint8_t signal_type) {
 
 		/* Call TIMESLOT_BEGIN_IRQHandler later. */
 		NVIC_EnableIRQ(TIMER0_IRQn);
+		ISR_STATS_PEND(ISR_STATS_TIMESLOT_BEGIN);
 		NVIC_SetPendingIRQ(TIMESLOT_BEGIN_IRQn);
 		break;
 
 	case NRF_RADIO_CALLBACK_SIGNAL_TYPE_RADIO:
 		signal_callback_return_param.params.request.p_next = NULL;
 		signal_callback_return_param.callback_action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_NONE;
+		ISR_STATS_ENTER(ISR_STATS_RADIO);
 		RADIO_IRQHandler();
+		ISR_STATS_EXIT(ISR_STATS_RADIO);
 		break;
 
 	case NRF_RADIO_CALLBACK_SIGNAL_TYPE_TIMER0:
@@ -152,6 +160,7 @@ nrf_radio_signal_callback_return_param_t * radio_callback(uint8_t signal_type) {
 			NRF_TIMER0->EVENTS_COMPARE[0] = 0;
 
 			/* This is the "timeslot is about to end" timeout. */
+			TRACE_EVENT(TRACE_TIMESLOT_END, 0);
 			if (!nrf_esb_is_idle()) {
 				NRF_RADIO->INTENCLR = 0xFFFFFFFF;
 				NRF_RADIO->TASKS_DISABLE = 1;
@@ -182,6 +191,7 @@ nrf_radio_signal_callback_return_param_t * radio_callback(uint8_t signal_type) {
 		break;
 
 	case NRF_RADIO_CALLBACK_SIGNAL_TYPE_EXTEND_SUCCEEDED:
+		TRACE_EVENT(TRACE_TIMESLOT_EXTEND, 0);
 		NRF_TIMER0->TASKS_STOP = 1;
 		NRF_TIMER0->EVENTS_COMPARE[0] = 0;
 		NRF_TIMER0->EVENTS_COMPARE[1] = 0;
@@ -190,6 +200,7 @@ nrf_radio_signal_callback_return_param_t * radio_callback(uint8_t signal_type) {
 		NRF_TIMER0->TASKS_START = 1;
 
 		m_total_timeslot_length += TX_LEN_EXTENSION_US;
+		ISR_STATS_PEND(ISR_STATS_TIMESLOT_BEGIN);
 		NVIC_SetPendingIRQ(TIMESLOT_BEGIN_IRQn);
 		signal_callback_return_param.params.request.p_next = NULL;
 		signal_callback_return_param.callback_action = NRF_RADIO_SIGNAL_CALLBACK_ACTION_NONE;
@@ -197,6 +208,7 @@ nrf_radio_signal_callback_return_param_t * radio_callback(uint8_t signal_type) {
 
 	case NRF_RADIO_CALLBACK_SIGNAL_TYPE_EXTEND_FAILED: {
 		/* Tried scheduling a new timeslot, but failed. */
+		TRACE_EVENT(TRACE_TIMESLOT_EXTEND_FAIL, 0);
 
 		/* Disabling UESB is done in a lower interrupt priority. */
 		/* Call TIMESLOT_END_IRQHandler later. */
@@ -210,6 +222,7 @@ nrf_radio_signal_callback_return_param_t * radio_callback(uint8_t signal_type) {
 		break;
 	}
 
+	ISR_STATS_EXIT(ISR_STATS_RADIO_CB);
 	return (&signal_callback_return_param);
 }
 
@@ -264,6 +277,8 @@ void TIMESLOT_END_IRQHandler(void) {
  *       This handler is used to initiate UESB RX/TX.
  */
 void TIMESLOT_BEGIN_IRQHandler(void) {
+	ISR_STATS_ENTER(ISR_STATS_TIMESLOT_BEGIN);
+
 	if (m_state == STATE_IDLE) {
 		nrf_esb_init(&nrf_esb_config);
 		nrf_esb_set_address_length(3);
@@ -297,6 +312,8 @@ void TIMESLOT_BEGIN_IRQHandler(void) {
 		}
 	}
 	CRITICAL_REGION_EXIT();
+
+	ISR_STATS_EXIT(ISR_STATS_TIMESLOT_BEGIN);
 }
 
 void esb_timeslot_set_next_packet(uint8_t *data, unsigned int len) {
@@ -320,16 +337,18 @@ void esb_timeslot_set_ch_addr(uint8_t ch, uint8_t b0, uint8_t b1, uint8_t b2) {
 
 void nrf_esb_event_handler(nrf_esb_evt_t const * p_event) {
 	if (p_event->evt_id == NRF_ESB_EVENT_TX_FAILED) {
+		TRACE_EVENT(TRACE_ESB_TX_FAIL, 0);
 		nrf_esb_flush_tx();
 	}
 
 	if (p_event->evt_id == NRF_ESB_EVENT_TX_SUCCESS) {
-
+		TRACE_EVENT(TRACE_ESB_TX_SUCCESS, 0);
 	}
 
 	if (p_event->evt_id & NRF_ESB_EVENT_RX_RECEIVED) {
 		/* Data reception is handled in a lower priority interrupt. */
 		/* Call UESB_RX_HANDLE_IRQHandler later. */
+		ISR_STATS_PEND(ISR_STATS_ESB_RX);
 		NVIC_SetPendingIRQ(UESB_RX_HANDLE_IRQn);
 	}
 }
@@ -374,7 +393,9 @@ uint32_t esb_timeslot_init(ut_data_handler_t evt_handler) {
 }
 
 void UESB_RX_HANDLE_IRQHandler(void) {
+	ISR_STATS_ENTER(ISR_STATS_ESB_RX);
 	nrf_esb_payload_t rx_payload;
 	nrf_esb_read_rx_payload(&rx_payload);
 	m_evt_handler(rx_payload.data, rx_payload.length);
+	ISR_STATS_EXIT(ISR_STATS_ESB_RX);
 }
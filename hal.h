@@ -0,0 +1,121 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Hardware abstraction layer between the bridge logic in bridge.c and the
+ * platform it runs on. main.c implements it on the nRF52 with the SoftDevice,
+ * host/hal_host.c on Linux with pseudo-terminals.
+ *
+ * The platform calls into the bridge with the functions in bridge.h: received
+ * data, connection changes, bridge_timerfunc every millisecond and
+ * bridge_process from the main loop.
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "packet.h"
+
+// Settings
+#ifndef HAL_USB
+#ifdef NRF52840_XXAA
+#define HAL_USB						1		// USB CDC ACM port
+#else
+#define HAL_USB						0
+#endif
+#endif
+
+#define HAL_UART_PRIO_HIGH			0		// Real-time control packets
+#define HAL_UART_PRIO_NORMAL		1
+#define HAL_UART_PRIO_NUM			2
+#define HAL_UART_HIST_BINS			16		// Bins of hal_uart_tx_hist
+
+// Critical regions around state that is shared with interrupts. The host
+// runs everything from one thread.
+#ifdef HAL_HOST
+#define CRITICAL_REGION_ENTER()
+#define CRITICAL_REGION_EXIT()
+#else
+#include "app_util_platform.h"
+#include "isr_stats.h"
+
+#if ISR_STATS
+// Time how long the critical regions of the bridge keep interrupts masked
+#undef CRITICAL_REGION_ENTER
+#undef CRITICAL_REGION_EXIT
+#define CRITICAL_REGION_ENTER()									\
+	{															\
+		uint8_t __CR_NESTED = 0;								\
+		app_util_critical_region_enter(&__CR_NESTED);			\
+		isr_stats_enter(ISR_STATS_CRITICAL);
+#define CRITICAL_REGION_EXIT()									\
+		isr_stats_exit(ISR_STATS_CRITICAL);						\
+		app_util_critical_region_exit(__CR_NESTED);				\
+	}
+#endif
+#endif
+
+// Types
+typedef struct {
+	bool connected;
+	uint32_t tx_depth;				// Bytes queued for the link
+	uint32_t tx_depth_max;
+	uint32_t tx_drops;				// Packets dropped because the queue was full
+	uint8_t tx_phy;					// BLE_GAP_PHY_*
+	uint8_t rx_phy;
+	uint16_t tx_octets;				// Data length
+	uint16_t rx_octets;
+	uint16_t att_mtu;
+	uint16_t conn_interval;			// 1.25 ms units
+	uint16_t slave_latency;
+	uint16_t l2cap_mtu;				// 0 while no channel is open
+} HAL_BLE_STATS_t;
+
+// UART to the VESC. Sending never blocks, the data is queued, or dropped and
+// counted in hal_uart_tx_drops if there is no room. hal_uart_reserve takes the
+// position in the queue of the next packet the calling context sends with
+// prio ahead of time, see uart_dma_reserve. It has to be followed by
+// hal_uart_send from the same context if it returns true.
+bool hal_uart_reserve(unsigned int len, int prio);
+void hal_uart_send(const packet_segment *segs, int seg_num, int prio);
+void hal_uart_tx_pause(bool pause);
+bool hal_uart_baud_supported(uint32_t baud);
+void hal_uart_set_baud(uint32_t baud);
+void hal_uart_set_enabled(bool enabled);
+const uint32_t *hal_uart_tx_hist(int prio);
+uint32_t hal_uart_tx_drops(int prio);
+
+// BLE NUS links. hal_ble_send queues a complete packet, or drops it and
+// returns false if there is no room or the link is not connected.
+bool hal_ble_connected(int link);
+bool hal_ble_send(int link, const packet_segment *segs, int seg_num);
+void hal_ble_stats(int link, HAL_BLE_STATS_t *stats);
+
+// USB CDC ACM, only used when HAL_USB is set
+bool hal_usb_connected(void);
+void hal_usb_send(const packet_segment *segs, int seg_num);
+
+// ESB timeslot radio
+void hal_esb_set_ch_addr(uint8_t ch, uint8_t b0, uint8_t b1, uint8_t b2);
+void hal_esb_send(const uint8_t *data, uint16_t len);
+
+// Raw output of the event trace, see trace.c
+void hal_trace_write(const uint8_t *data, unsigned int len);
+
+#endif /* HAL_H_ */
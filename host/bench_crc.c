@@ -0,0 +1,196 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Speed of every CRC16_BACKEND for different message sizes, and how much work
+ * calculating the packet CRC incrementally as the payload arrives takes off
+ * the call that completes a packet. Cycles are the time stamp counter, so
+ * bytes/cycle is only printed on x86.
+ */
+
+#include <string.h>
+#include "test.h"
+#include "packet.h"
+#include "crc.h"
+#include "crc_backends.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES()				__rdtsc()
+#else
+#define CYCLES()				0
+#endif
+
+// Settings
+#define BUF_LEN					PACKET_MAX_PL_LEN
+#define BENCH_MIN_S				0.2
+#define FRAMES					20000
+#define FRAME_CHUNK				20		// Bytes per call, like a BLE notification
+
+// Private variables
+static unsigned char m_buf[BUF_LEN];
+static uint8_t m_frame[PACKET_MAX_PL_LEN + 8];
+static unsigned int m_frame_len;
+static unsigned int m_frames;
+static volatile unsigned short m_sink;
+
+// Private functions
+/*
+ * Calculate the CRC of BUF_LEN / size separate messages of size bytes, over
+ * and over, for BENCH_MIN_S.
+ *
+ * @param bytes_per_cycle
+ * Set to the bytes per TSC cycle, 0 without a TSC.
+ *
+ * @param ns_per_byte
+ * Set to the time per byte.
+ */
+static void crc_speed(unsigned short (*update)(unsigned short, const unsigned char*, unsigned int),
+		unsigned int size, double *bytes_per_cycle, double *ns_per_byte) {
+	unsigned int runs = 0;
+	double start = test_time();
+	uint64_t c_start = CYCLES();
+	double t = 0.0;
+
+	do {
+		unsigned short sink = 0;
+		for (unsigned int i = 0;i + size <= BUF_LEN;i += size) {
+			sink ^= update(0, m_buf + i, size);
+		}
+		m_sink = sink;
+		runs++;
+		t = test_time() - start;
+	} while (t < BENCH_MIN_S);
+
+	double bytes = (double)(BUF_LEN / size * size) * runs;
+	uint64_t cycles = CYCLES() - c_start;
+
+	*bytes_per_cycle = cycles ? bytes / cycles : 0.0;
+	*ns_per_byte = t / bytes * 1e9;
+}
+
+static void send_func(const packet_segment *segs, int seg_num, int handler_num) {
+	(void)handler_num;
+	m_frame_len = 0;
+	for (int i = 0;i < seg_num;i++) {
+		memcpy(m_frame + m_frame_len, segs[i].data, segs[i].len);
+		m_frame_len += segs[i].len;
+	}
+}
+
+static void process_func(unsigned char *data, unsigned int len, int handler_num) {
+	(void)data;
+	(void)len;
+	(void)handler_num;
+	m_frames++;
+}
+
+/*
+ * Average time of the packet_process_bytes call that completes a frame, when
+ * the frame arrives in FRAME_CHUNK byte chunks.
+ */
+static double completion_ns(void) {
+	double total = 0.0;
+	double overhead = 0.0;
+
+	for (int i = 0;i < 1000;i++) {
+		double t0 = test_time();
+		overhead += test_time() - t0;
+	}
+	overhead /= 1000;
+
+	m_frames = 0;
+	packet_init(0, process_func, 0);
+
+	for (int i = 0;i < FRAMES;i++) {
+		unsigned int last = ((m_frame_len - 1) / FRAME_CHUNK) * FRAME_CHUNK;
+
+		for (unsigned int j = 0;j < last;j += FRAME_CHUNK) {
+			packet_process_bytes(m_frame + j, FRAME_CHUNK, 0);
+		}
+
+		double t0 = test_time();
+		packet_process_bytes(m_frame + last, m_frame_len - last, 0);
+		total += test_time() - t0 - overhead;
+	}
+
+	CHECK(m_frames == FRAMES, "%u of %u frames", m_frames, FRAMES);
+
+	return total / FRAMES * 1e9;
+}
+
+static double full_crc_ns(void) {
+	unsigned int runs = 0;
+	double start = test_time();
+	double t = 0.0;
+
+	do {
+		m_sink = crc16(m_buf, BUF_LEN);
+		runs++;
+		t = test_time() - start;
+	} while (t < BENCH_MIN_S);
+
+	return t / runs * 1e9;
+}
+
+int main(void) {
+	static const unsigned int sizes[] = {1, 8, 64, 512};
+	const unsigned int size_num = sizeof(sizes) / sizeof(sizes[0]);
+	double bpc[CRC_BACKEND_NUM][sizeof(sizes) / sizeof(sizes[0])];
+	double ns[CRC_BACKEND_NUM][sizeof(sizes) / sizeof(sizes[0])];
+	uint32_t r = 1;
+
+	for (unsigned int i = 0;i < BUF_LEN;i++) {
+		m_buf[i] = test_rand(&r);
+	}
+
+	for (unsigned int b = 0;b < CRC_BACKEND_NUM;b++) {
+		for (unsigned int i = 0;i < size_num;i++) {
+			crc_speed(crc_backends[b].update, sizes[i], &bpc[b][i], &ns[b][i]);
+		}
+	}
+
+	for (int table = 0;table < 2;table++) {
+		if (table == 0 && bpc[0][0] == 0.0) {
+			continue;
+		}
+
+		printf("CRC16_BACKEND, %s for messages of\n        ",
+				table == 0 ? "bytes/cycle" : "ns/byte");
+		for (unsigned int i = 0;i < size_num;i++) {
+			printf("%8u", sizes[i]);
+		}
+		printf("\n");
+
+		for (unsigned int b = 0;b < CRC_BACKEND_NUM;b++) {
+			printf("  %-6s", crc_backends[b].name);
+			for (unsigned int i = 0;i < size_num;i++) {
+				printf("%8.3f", table == 0 ? bpc[b][i] : ns[b][i]);
+			}
+			printf("\n");
+		}
+	}
+
+	packet_init(send_func, 0, 1);
+	packet_send_packet(m_buf, BUF_LEN, 1);
+
+	printf("%u byte packet in %u byte chunks\n", BUF_LEN, FRAME_CHUNK);
+	printf("  completing call         %8.1f ns\n", completion_ns());
+	printf("  CRC at once, for scale  %8.1f ns\n", full_crc_ns());
+
+	return TEST_RESULT("bench_crc");
+}
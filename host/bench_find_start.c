@@ -0,0 +1,160 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Speed of the word-at-a-time start byte search of packet.c compared with a
+ * byte loop, on noise with different densities of start bytes, and of the
+ * decoder as a whole on the same noise. The last row is the worst case for
+ * the decoder: 03 01 FF 03 repeated, where every fourth byte starts a
+ * candidate with a valid header and stop byte whose CRC has to be checked.
+ * Cycles are the time stamp counter and only printed on x86.
+ */
+
+#include "../packet.c"
+#include "test.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES()				__rdtsc()
+#else
+#define CYCLES()				0
+#endif
+
+// Settings
+#define BUF_LEN					(1 << 16)
+#define BENCH_MIN_S				0.2
+
+// Private variables
+static uint8_t m_buf[BUF_LEN];
+static volatile unsigned int m_sink;
+
+// Private functions
+static unsigned int find_start_byte_ref(const unsigned char *buffer, unsigned int len) {
+	for (unsigned int i = 0;i < len;i++) {
+		if (buffer[i] == 2 ||
+				(PACKET_MAX_PL_LEN > 255 && buffer[i] == 3) ||
+				(PACKET_MAX_PL_LEN > 65535 && buffer[i] == 4)) {
+			return i;
+		}
+	}
+
+	return len;
+}
+
+/*
+ * Scan the whole buffer from start byte to start byte, like the decoder does
+ * after rejecting candidates.
+ */
+static unsigned int scan(unsigned int (*find)(const unsigned char*, unsigned int)) {
+	unsigned int pos = 0;
+	unsigned int found = 0;
+
+	while (pos < BUF_LEN) {
+		pos += find(m_buf + pos, BUF_LEN - pos) + 1;
+		found++;
+	}
+
+	return found;
+}
+
+static double ns_per_byte(unsigned int (*find)(const unsigned char*, unsigned int)) {
+	unsigned int runs = 0;
+	double start = test_time();
+	double t = 0.0;
+
+	do {
+		m_sink = scan(find);
+		runs++;
+		t = test_time() - start;
+	} while (t < BENCH_MIN_S);
+
+	return t / ((double)BUF_LEN * runs) * 1e9;
+}
+
+static void process_func(unsigned char *data, unsigned int len, int handler_num) {
+	(void)data;
+	(void)len;
+	(void)handler_num;
+}
+
+static void decode_per_byte(double *ns, double *cycles) {
+	unsigned int runs = 0;
+	double start = test_time();
+	uint64_t c_start = CYCLES();
+	double t = 0.0;
+
+	do {
+		packet_init(0, process_func, 0);
+		for (unsigned int i = 0;i < BUF_LEN;i += 256) {
+			packet_process_bytes(m_buf + i, 256, 0);
+		}
+		runs++;
+		t = test_time() - start;
+	} while (t < BENCH_MIN_S);
+
+	*cycles = (double)(CYCLES() - c_start) / ((double)BUF_LEN * runs);
+	*ns = t / ((double)BUF_LEN * runs) * 1e9;
+}
+
+static void print_row(const char *name) {
+	unsigned int found = scan(find_start_byte);
+	CHECK(found == scan(find_start_byte_ref), "search results differ");
+
+	double ns, cycles;
+	decode_per_byte(&ns, &cycles);
+
+	printf("%-12s %15.3f %19.3f %16.3f %20.1f\n", name, ns_per_byte(find_start_byte),
+			ns_per_byte(find_start_byte_ref), ns, cycles);
+}
+
+int main(void) {
+	static const uint32_t sparsities[] = {0, 16, 128, 1024};
+
+	printf("start bytes   search ns/byte   byte loop ns/byte   decode ns/byte   decode cycles/byte\n");
+
+	for (unsigned int i = 0;i < sizeof(sparsities) / sizeof(sparsities[0]);i++) {
+		uint32_t sparsity = sparsities[i];
+		uint32_t r = 1;
+
+		// sparsity 0 is uniform noise, where 2 of 256 values are start bytes
+		for (unsigned int j = 0;j < BUF_LEN;j++) {
+			uint8_t b = test_rand(&r);
+			if (sparsity) {
+				if ((test_rand(&r) % sparsity) == 0) {
+					b = 2;
+				} else if (b == 2 || b == 3) {
+					b = 0;
+				}
+			}
+			m_buf[j] = b;
+		}
+
+		char name[16];
+		snprintf(name, sizeof(name), sparsity ? "1/%u" : "uniform", sparsity);
+		print_row(name);
+	}
+
+	// [3][len 0x01FF] with the stop byte where the next candidate starts.
+	// Only a candidate if PACKET_MAX_PL_LEN allows 511 bytes.
+	static const uint8_t pattern[] = {3, 0x01, 0xFF, 3};
+	for (unsigned int j = 0;j < BUF_LEN;j++) {
+		m_buf[j] = pattern[j % sizeof(pattern)];
+	}
+	print_row("03 01 FF 03");
+
+	return TEST_RESULT("bench_find_start");
+}
@@ -0,0 +1,126 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Compression ratio and encode/decode time of lz.c on a COMM_GET_MCCONF
+ * reply, which is what COMM_EXT_NRF_COMPRESSION is meant for. The payload is
+ * fixtures/mcconf_default.bin unless another file is given. Cycles are the
+ * time stamp counter and only printed on x86.
+ *
+ * The fixture is generated from the firmware defaults. A configuration read
+ * from a real controller can compress differently, so run this on a capture
+ * of a GET_MCCONF or GET_APPCONF reply payload before changing
+ * BLE_COMPRESS_MIN_SAVING. The benchmark reports whether the payload passes
+ * that threshold.
+ */
+
+#include <string.h>
+#include "test.h"
+#include "lz.h"
+#include "packet.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES()				__rdtsc()
+#else
+#define CYCLES()				0
+#endif
+
+// Settings
+#define FIXTURE					"fixtures/mcconf_default.bin"
+#define BENCH_MIN_S				0.2
+#define BLE_NOTIFY_LEN			20		// Payload of one notification at the default MTU
+#define FRAME_OVERHEAD(len)		((len) > 255 ? 6 : 5)
+#define COMP_HDR_LEN			4		// [255][COMPRESSED][u16 len]
+#define MIN_SAVING				10		// BLE_COMPRESS_MIN_SAVING in bridge.c
+
+// Private variables
+static uint8_t m_in[PACKET_MAX_PL_LEN];
+static uint8_t m_comp[PACKET_MAX_PL_LEN];
+static uint8_t m_out[PACKET_MAX_PL_LEN];
+static LZ_STATE_t m_lz;
+static volatile int m_sink;
+
+// Private functions
+static int compress(const uint8_t *in, unsigned int in_len, uint8_t *out, unsigned int out_max) {
+	return lz_compress(&m_lz, in, in_len, out, out_max);
+}
+
+static unsigned int notifications(unsigned int pl_len) {
+	return (pl_len + FRAME_OVERHEAD(pl_len) + BLE_NOTIFY_LEN - 1) / BLE_NOTIFY_LEN;
+}
+
+static void timed(int (*func)(const uint8_t*, unsigned int, uint8_t*, unsigned int),
+		const uint8_t *in, unsigned int in_len, uint8_t *out, unsigned int out_max,
+		double *ns, double *cycles) {
+	unsigned int runs = 0;
+	double start = test_time();
+	uint64_t c_start = CYCLES();
+	double t = 0.0;
+
+	do {
+		m_sink = func(in, in_len, out, out_max);
+		runs++;
+		t = test_time() - start;
+	} while (t < BENCH_MIN_S);
+
+	*cycles = (double)(CYCLES() - c_start) / runs;
+	*ns = t / runs * 1e9;
+}
+
+int main(int argc, char **argv) {
+	const char *path = argc > 1 ? argv[1] : FIXTURE;
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return 1;
+	}
+
+	unsigned int len = fread(m_in, 1, sizeof(m_in), f);
+	fclose(f);
+
+	// Without the threshold, to report the ratio of payloads that do not pass it
+	int comp = compress(m_in, len, m_comp, len - COMP_HDR_LEN - 1);
+	CHECK(comp > 0, "%s did not compress", path);
+	if (comp <= 0) {
+		return TEST_RESULT("bench_lz");
+	}
+
+	// The limit the bridge uses
+	unsigned int limit = len * (100 - MIN_SAVING) / 100;
+	bool passes = comp + COMP_HDR_LEN <= (int)limit;
+
+	int dec = lz_decompress(m_comp, comp, m_out, len);
+	CHECK(dec == (int)len && memcmp(m_in, m_out, len) == 0, "round trip failed");
+
+	double enc_ns, enc_cycles, dec_ns, dec_cycles;
+	timed(compress, m_in, len, m_comp, len - COMP_HDR_LEN - 1, &enc_ns, &enc_cycles);
+	timed(lz_decompress, m_comp, comp, m_out, len, &dec_ns, &dec_cycles);
+
+	printf("%s\n", path);
+	printf("  payload      %5u bytes, %u notifications\n", len, notifications(len));
+	printf("  compressed   %5d bytes, %u notifications, ratio %.2f\n",
+			comp + COMP_HDR_LEN, notifications(comp + COMP_HDR_LEN),
+			(double)len / (comp + COMP_HDR_LEN));
+	printf("  threshold    %5u bytes (%d%% saving), %s\n", limit, MIN_SAVING,
+			passes ? "compressed by the bridge" : "sent uncompressed by the bridge");
+	printf("  encode  %10.0f ns %10.0f cycles %8.2f ns/byte\n", enc_ns, enc_cycles, enc_ns / len);
+	printf("  decode  %10.0f ns %10.0f cycles %8.2f ns/byte\n", dec_ns, dec_cycles, dec_ns / len);
+
+	return TEST_RESULT("bench_lz");
+}
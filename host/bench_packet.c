@@ -0,0 +1,342 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Decoding cost of packet_process_bytes for different chunk sizes, compared
+ * with the original decoder, which took one byte at a time and moved the
+ * buffer with memmove. Chunk sizes are those of a BLE notification, a USB
+ * transfer and a UART DMA buffer. Cycles are the time stamp counter and only
+ * printed on x86.
+ *
+ * The original decoder is a copy of packet_process_byte and
+ * try_decode_packet from before the decoder was reworked. It uses the
+ * current crc16, so that only the decoders differ.
+ */
+
+#include <string.h>
+#include "test.h"
+#include "packet.h"
+#include "crc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES()				__rdtsc()
+#else
+#define CYCLES()				0
+#endif
+
+// Settings
+#define STREAM_LEN				(1 << 20)
+#define BENCH_MIN_S				0.2		// Shortest measurement per case
+#define BASE_BUFFER_LEN			(PACKET_MAX_PL_LEN + 8)
+
+// Private types
+typedef struct {
+	unsigned int rx_read_ptr;
+	unsigned int rx_write_ptr;
+	int bytes_left;
+	unsigned char rx_buffer[BASE_BUFFER_LEN];
+} BASE_STATE_t;
+
+// Private variables
+static uint8_t m_stream[STREAM_LEN + PACKET_MAX_PL_LEN + 8];
+static unsigned int m_stream_len;
+static unsigned int m_frames;
+static BASE_STATE_t m_base;
+
+// Private functions
+static void process_func(unsigned char *data, unsigned int len, int handler_num);
+
+/*
+ * try_decode_packet of the original decoder.
+ */
+static int base_try_decode_packet(unsigned char *buffer, unsigned int in_len, int *bytes_left) {
+	*bytes_left = 0;
+
+	if (in_len == 0) {
+		*bytes_left = 1;
+		return -2;
+	}
+
+	bool is_len_8b = buffer[0] == 2;
+	unsigned int data_start = buffer[0];
+
+#if PACKET_MAX_PL_LEN > 255
+	bool is_len_16b = buffer[0] == 3;
+#else
+#define is_len_16b false
+#endif
+
+#if PACKET_MAX_PL_LEN > 65535
+	bool is_len_24b = buffer[0] == 4;
+#else
+#define is_len_24b false
+#endif
+
+	// No valid start byte
+	if (!is_len_8b && !is_len_16b && !is_len_24b) {
+		return -1;
+	}
+
+	// Not enough data to determine length
+	if (in_len < data_start) {
+		*bytes_left = data_start - in_len;
+		return -2;
+	}
+
+	unsigned int len = 0;
+
+	if (is_len_8b) {
+		len = (unsigned int)buffer[1];
+
+		// No support for zero length packets
+		if (len < 1) {
+			return -1;
+		}
+	} else if (is_len_16b) {
+		len = (unsigned int)buffer[1] << 8 | (unsigned int)buffer[2];
+
+		// A shorter packet should use less length bytes
+		if (len < 255) {
+			return -1;
+		}
+	} else if (is_len_24b) {
+		len = (unsigned int)buffer[1] << 16 |
+				(unsigned int)buffer[2] << 8 |
+				(unsigned int)buffer[3];
+
+		// A shorter packet should use less length bytes
+		if (len < 65535) {
+			return -1;
+		}
+	}
+
+	// Too long packet
+	if (len > PACKET_MAX_PL_LEN) {
+		return -1;
+	}
+
+	// Need more data to determine rest of packet
+	if (in_len < (len + data_start + 3)) {
+		*bytes_left = (len + data_start + 3) - in_len;
+		return -2;
+	}
+
+	// Invalid stop byte
+	if (buffer[data_start + len + 2] != 3) {
+		return -1;
+	}
+
+	unsigned short crc_calc = crc16(buffer + data_start, len);
+	unsigned short crc_rx = (unsigned short)buffer[data_start + len] << 8
+							| (unsigned short)buffer[data_start + len + 1];
+
+	if (crc_calc == crc_rx) {
+		process_func(buffer + data_start, len, 0);
+		return len + data_start + 3;
+	} else {
+		return -1;
+	}
+}
+
+/*
+ * packet_process_byte of the original decoder, without the timeout.
+ */
+static void base_process_byte(uint8_t rx_data) {
+	BASE_STATE_t *handler = &m_base;
+
+	unsigned int data_len = handler->rx_write_ptr - handler->rx_read_ptr;
+
+	// Out of space (should not happen)
+	if (data_len >= BASE_BUFFER_LEN) {
+		handler->rx_write_ptr = 0;
+		handler->rx_read_ptr = 0;
+		handler->bytes_left = 0;
+		handler->rx_buffer[handler->rx_write_ptr++] = rx_data;
+		return;
+	}
+
+	// Everything has to be aligned, so shift buffer if we are out of space.
+	// (as opposed to using a circular buffer)
+	if (handler->rx_write_ptr >= BASE_BUFFER_LEN) {
+		memmove(handler->rx_buffer,
+				handler->rx_buffer + handler->rx_read_ptr,
+				data_len);
+
+		handler->rx_read_ptr = 0;
+		handler->rx_write_ptr = data_len;
+	}
+
+	handler->rx_buffer[handler->rx_write_ptr++] = rx_data;
+	data_len++;
+
+	if (handler->bytes_left > 1) {
+		handler->bytes_left--;
+		return;
+	}
+
+	// Try decoding the packet at various offsets until it succeeds, or
+	// until we run out of data.
+	for (;;) {
+		int res = base_try_decode_packet(handler->rx_buffer + handler->rx_read_ptr,
+				data_len, &handler->bytes_left);
+
+		// More data is needed
+		if (res == -2) {
+			break;
+		}
+
+		if (res > 0) {
+			data_len -= res;
+			handler->rx_read_ptr += res;
+		} else if (res == -1) {
+			// Something went wrong. Move pointer forward and try again.
+			handler->rx_read_ptr++;
+			data_len--;
+		}
+	}
+
+	// Nothing left, move pointers to avoid memmove
+	if (data_len == 0) {
+		handler->rx_read_ptr = 0;
+		handler->rx_write_ptr = 0;
+	}
+}
+
+static void send_func(const packet_segment *segs, int seg_num, int handler_num) {
+	(void)handler_num;
+	for (int i = 0;i < seg_num;i++) {
+		memcpy(m_stream + m_stream_len, segs[i].data, segs[i].len);
+		m_stream_len += segs[i].len;
+	}
+}
+
+static void process_func(unsigned char *data, unsigned int len, int handler_num) {
+	(void)data;
+	(void)len;
+	(void)handler_num;
+	m_frames++;
+}
+
+/*
+ * Frames of random lengths up to max_len. With noise, every tenth frame is
+ * followed by a burst of random bytes.
+ */
+static unsigned int stream_generate(unsigned int max_len, bool noise) {
+	uint32_t r = 1;
+	uint8_t pl[PACKET_MAX_PL_LEN];
+	unsigned int frames = 0;
+
+	m_stream_len = 0;
+	packet_init(send_func, 0, 1);
+
+	while (m_stream_len < STREAM_LEN) {
+		unsigned int len = 1 + test_rand_range(&r, max_len);
+		for (unsigned int i = 0;i < len;i++) {
+			pl[i] = test_rand(&r);
+		}
+		packet_send_packet(pl, len, 1);
+		frames++;
+
+		if (noise && (frames % 10) == 0) {
+			unsigned int n = test_rand_range(&r, 64);
+			for (unsigned int i = 0;i < n && m_stream_len < STREAM_LEN;i++) {
+				m_stream[m_stream_len++] = test_rand(&r);
+			}
+		}
+	}
+
+	return frames;
+}
+
+/*
+ * chunk 0 feeds every byte to packet_process_byte, -1 to the original
+ * decoder.
+ *
+ * @return
+ * Cycles per byte.
+ */
+static double bench(const char *name, int chunk, double base_cycles) {
+	unsigned int runs = 0;
+	double start = test_time();
+	uint64_t c_start = CYCLES();
+	double t = 0.0;
+
+	do {
+		m_frames = 0;
+		packet_init(0, process_func, 0);
+		memset(&m_base, 0, sizeof(m_base));
+
+		if (chunk < 0) {
+			for (unsigned int i = 0;i < m_stream_len;i++) {
+				base_process_byte(m_stream[i]);
+			}
+		} else if (chunk == 0) {
+			for (unsigned int i = 0;i < m_stream_len;i++) {
+				packet_process_byte(m_stream[i], 0);
+			}
+		} else {
+			for (unsigned int i = 0;i < m_stream_len;i += chunk) {
+				unsigned int n = m_stream_len - i < (unsigned int)chunk ? m_stream_len - i : (unsigned int)chunk;
+				packet_process_bytes(m_stream + i, n, 0);
+			}
+		}
+
+		runs++;
+		t = test_time() - start;
+	} while (t < BENCH_MIN_S);
+
+	double bytes = (double)m_stream_len * runs;
+	double cycles = (double)(CYCLES() - c_start) / bytes;
+
+	printf("  %-6s %6u frames %8.2f cycles/byte", name, m_frames, cycles);
+	if (base_cycles > 0.0 && cycles > 0.0) {
+		printf(" %6.2fx", base_cycles / cycles);
+	}
+	printf("\n");
+
+	return cycles;
+}
+
+static void bench_stream(const char *name, unsigned int max_len, bool noise) {
+	static const int chunks[] = {0, 1, 20, 64, 256, 4096};
+	unsigned int frames = stream_generate(max_len, noise);
+
+	printf("%s: %u bytes, %u frames of 1 - %u bytes%s\n", name,
+			m_stream_len, frames, max_len, noise ? ", with noise" : "");
+
+	double base_cycles = bench("orig", -1, 0.0);
+	unsigned int base_frames = m_frames;
+	CHECK(noise || base_frames == frames, "original: %u of %u frames", base_frames, frames);
+
+	for (unsigned int i = 0;i < sizeof(chunks) / sizeof(chunks[0]);i++) {
+		char chunk_name[16];
+		snprintf(chunk_name, sizeof(chunk_name), "%d", chunks[i]);
+		bench(chunks[i] ? chunk_name : "byte", chunks[i], base_cycles);
+		CHECK(m_frames == base_frames, "%u frames, original decoder %u", m_frames, base_frames);
+	}
+}
+
+int main(void) {
+	printf("orig for the original decoder, byte for packet_process_byte, otherwise\n");
+	printf("the chunk size. Speedup over the original decoder.\n");
+	bench_stream("short", 20, false);
+	bench_stream("long", PACKET_MAX_PL_LEN, false);
+	bench_stream("noisy", PACKET_MAX_PL_LEN, true);
+
+	return TEST_RESULT("bench_packet");
+}
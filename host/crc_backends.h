@@ -0,0 +1,42 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Every CRC16_BACKEND in one program. The Makefile builds crc.c once per
+ * backend, with crc16_update renamed to crc16_update_<backend>.
+ */
+
+#ifndef CRC_BACKENDS_H_
+#define CRC_BACKENDS_H_
+
+#define CRC_BACKEND_LIST(X)		X(BYTE) X(NIBBLE) X(SLICE4) X(SLICE8) X(WORD64)
+
+#define CRC_BACKEND_DECLARE(name)	\
+	unsigned short crc16_update_##name(unsigned short crc, const unsigned char *buf, unsigned int len);
+CRC_BACKEND_LIST(CRC_BACKEND_DECLARE)
+
+typedef struct {
+	const char *name;
+	unsigned short (*update)(unsigned short crc, const unsigned char *buf, unsigned int len);
+} CRC_BACKEND_t;
+
+#define CRC_BACKEND_ENTRY(name)		{#name, crc16_update_##name},
+static const CRC_BACKEND_t crc_backends[] = {CRC_BACKEND_LIST(CRC_BACKEND_ENTRY)};
+
+#define CRC_BACKEND_NUM			(sizeof(crc_backends) / sizeof(crc_backends[0]))
+
+#endif /* CRC_BACKENDS_H_ */
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+
+# Writes mcconf_default.bin, the payload of a COMM_GET_MCCONF reply: the
+# command byte, the configuration signature and the motor configuration with
+# the defaults of mcconf_default.h, in the order confgenerator.c of the VESC
+# firmware 3.x serializes it. Used by bench_lz to measure the compression of a
+# realistic payload.
+
+import math
+import os
+import struct
+
+COMM_GET_MCCONF = 14
+MCCONF_SIGNATURE = 2211848314
+
+# (type, value), in serialization order. f is buffer_append_float32_auto.
+FIELDS = [
+	('u8', 1), ('u8', 0), ('u8', 2), ('u8', 0),		# pwm, comm, motor type, sensors
+	('f', 60.0), ('f', -60.0), ('f', 60.0), ('f', -60.0), ('f', 130.0),
+	('f', -100000.0), ('f', 100000.0), ('f', 0.8), ('f', 300.0), ('f', 1500.0),
+	('f', 8.0), ('f', 57.0), ('f', 10.0), ('f', 8.0),
+	('u8', 1), ('f', 85.0), ('f', 100.0), ('f', 85.0), ('f', 100.0), ('f', 0.15),
+	('f', 0.005), ('f', 0.95), ('f', 1500000.0), ('f', -1500000.0),
+	('f', 1.0), ('f', 1.0), ('f', 1.0),
+	('f', 150.0), ('f', 1100.0), ('f', 10.0), ('f', 62.0), ('f', 0.1),
+	('f', 80000.0), ('f', 600.0),
+	('i8', -1), ('i8', 1), ('i8', 3), ('i8', 2), ('i8', 5), ('i8', 6), ('i8', 4), ('i8', -1),
+	('f', 2000.0),
+	('f', 0.03), ('f', 50.0), ('f', 25000.0), ('f', 0.08), ('u8', 0),
+	('f', 0.0), ('f', 7.0), ('f', 1.0), ('f', 1.0), ('f', 0.0), ('f', 0.0), ('f', 0.5),
+	('u8', 0), ('f', 2000.0), ('f', 30000.0),
+	('f', 0.000007), ('f', 0.015), ('f', 0.00245), ('f', 9e7), ('f', 0.05),
+	('f', 10.0), ('f', 200.0), ('f', 400.0), ('f', 0.1), ('f', 0.05), ('f', 0.0), ('f', 0.0),
+	('u8', 255), ('u8', 255), ('u8', 255), ('u8', 255),
+	('u8', 255), ('u8', 255), ('u8', 255), ('u8', 255),
+	('f', 2500.0), ('u8', 0), ('u8', 0), ('f', 0.0), ('u8', 0), ('f', 25.0), ('f', 0.1),
+	('f', 0.004), ('f', 0.004), ('f', 0.0001), ('f', 0.2), ('f', 900.0), ('u8', 1),
+	('f', 0.03), ('f', 0.0), ('f', 0.0004), ('f', 0.2), ('f', 1.0),
+	('f', 0.01), ('f', 0.1), ('f', 0.0046), ('f', 0.04),
+	('i32', 500), ('f', 0.02), ('f', 0.5), ('u32', 8192),
+	('u8', 0), ('u8', 0), ('u8', 0), ('u8', 16),
+	('f', 3000.0), ('f', 40000.0), ('f', 25000.0), ('f', 3380.0), ('u8', 0),
+	('u8', 14), ('f', 3.0), ('f', 0.083), ('u8', 0), ('u8', 3), ('f', 6.0),
+]
+
+def float32_auto(number):
+	# Same rounding as buffer.c, in single precision
+	number = struct.unpack('>f', struct.pack('>f', number))[0]
+	sig, e = math.frexp(number)
+	sig_i = 0
+	if abs(sig) >= 0.5:
+		sig_i = int(struct.unpack('>f', struct.pack('>f', (abs(sig) - 0.5) * 2.0 * 8388608.0))[0])
+		e += 126
+	res = ((e & 0xFF) << 23) | (sig_i & 0x7FFFFF)
+	if sig < 0:
+		res |= 1 << 31
+	return struct.pack('>I', res)
+
+def serialize():
+	out = bytes([COMM_GET_MCCONF]) + struct.pack('>I', MCCONF_SIGNATURE)
+	for t, v in FIELDS:
+		if t == 'f':
+			out += float32_auto(v)
+		else:
+			out += struct.pack({'u8': '>B', 'i8': '>b', 'i32': '>i', 'u32': '>I'}[t], v)
+	return out
+
+if __name__ == '__main__':
+	path = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'mcconf_default.bin')
+	with open(path, 'wb') as f:
+		f.write(serialize())
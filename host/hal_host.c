@@ -0,0 +1,487 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Linux backend of hal.h, which runs the bridge as a host executable.
+ *
+ * The UART to the VESC, every BLE link and the USB port are pseudo-terminals.
+ * A VESC, or a simulation of one, is attached to the UART terminal, e.g.
+ * with socat, and clients open the other terminals like serial ports. A BLE
+ * link or the USB port is connected while its terminal is open. Outgoing
+ * data is queued per terminal with the same whole-packet drop policy as on
+ * the hardware.
+ *
+ * bridge_timerfunc runs from a simulated clock at a selectable multiple of
+ * real time, so that timeouts can be exercised faster or slower than they
+ * run on the hardware.
+ *
+ * The radios are not simulated. Packets for ESB are dropped, and the BLE
+ * link parameters and UART queueing histograms in the stats are 0.
+ */
+
+#define _GNU_SOURCE
+
+#include "bridge.h"
+#include "conn_adapt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+
+// Settings
+#define PORT_TX_BUF_LEN				65536	// Outgoing queue of every terminal
+#define TICKS_CATCH_UP_MAX			1000	// Most ticks that are run in one go after a stall
+
+// Private types
+typedef struct {
+	const char *name;
+	int fd;
+	char path[64];
+	char link[256];					// Symlink to path, if requested
+	bool open;
+	uint8_t tx_buf[PORT_TX_BUF_LEN];
+	uint32_t tx_len;
+	uint32_t tx_hold;				// Bytes from here on are held back while paused
+	uint32_t tx_depth_max;
+	uint32_t tx_drops;
+} PORT_t;
+
+// Private variables
+static PORT_t m_uart;
+static PORT_t m_ble[BLE_LINKS];
+#if HAL_USB
+static PORT_t m_usb;
+#endif
+static bool m_uart_enabled = true;
+static bool m_uart_paused = false;
+static uint32_t m_uart_reserved = 0;		// Bytes of the next packet, see hal_uart_reserve
+static const uint32_t m_uart_tx_hist[HAL_UART_HIST_BINS];
+static double m_speed = 1.0;
+static const char *m_link_dir = 0;
+static volatile sig_atomic_t m_quit = 0;
+
+// Private functions
+static void port_init(PORT_t *p, const char *name);
+static void port_close(PORT_t *p);
+static bool port_update(PORT_t *p);
+static bool port_queue(PORT_t *p, const packet_segment *segs, int seg_num);
+static void port_flush(PORT_t *p);
+static int port_read(PORT_t *p, uint8_t *data, unsigned int max_len);
+static uint64_t now_us(void);
+static void on_signal(int sig);
+
+bool hal_uart_reserve(unsigned int len, int prio) {
+	// Everything runs from one thread, so the reserved packet is the next one
+	// that is queued. Only the pause needs to know about it.
+	(void)prio;
+	m_uart_reserved = len;
+	return true;
+}
+
+void hal_uart_send(const packet_segment *segs, int seg_num, int prio) {
+	(void)prio;
+
+	// The TX pin is disconnected while the bridge is disabled
+	if (m_uart_enabled) {
+		port_queue(&m_uart, segs, seg_num);
+	}
+	m_uart_reserved = 0;
+}
+
+void hal_uart_tx_pause(bool pause) {
+	m_uart_paused = pause;
+	m_uart.tx_hold = m_uart.tx_len + m_uart_reserved;
+}
+
+bool hal_uart_baud_supported(uint32_t baud) {
+	switch (baud) {
+	case 115200:
+	case 230400:
+	case 460800:
+	case 921600:
+	case 1000000:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void hal_uart_set_baud(uint32_t baud) {
+	// A terminal has no baud rate
+	(void)baud;
+}
+
+void hal_uart_set_enabled(bool enabled) {
+	m_uart_enabled = enabled;
+}
+
+const uint32_t *hal_uart_tx_hist(int prio) {
+	(void)prio;
+	return m_uart_tx_hist;
+}
+
+uint32_t hal_uart_tx_drops(int prio) {
+	// There is only one queue, counted as normal priority
+	return prio == HAL_UART_PRIO_NORMAL ? m_uart.tx_drops : 0;
+}
+
+bool hal_ble_connected(int link) {
+	return m_ble[link].open;
+}
+
+bool hal_ble_send(int link, const packet_segment *segs, int seg_num) {
+	return port_queue(&m_ble[link], segs, seg_num);
+}
+
+void hal_ble_stats(int link, HAL_BLE_STATS_t *stats) {
+	PORT_t *p = &m_ble[link];
+
+	memset(stats, 0, sizeof(HAL_BLE_STATS_t));
+	stats->connected = p->open;
+	stats->tx_depth = p->tx_len;
+	stats->tx_depth_max = p->tx_depth_max;
+	stats->tx_drops = p->tx_drops;
+}
+
+#if HAL_USB
+bool hal_usb_connected(void) {
+	return m_usb.open;
+}
+
+void hal_usb_send(const packet_segment *segs, int seg_num) {
+	port_queue(&m_usb, segs, seg_num);
+}
+#endif
+
+void hal_esb_set_ch_addr(uint8_t ch, uint8_t b0, uint8_t b1, uint8_t b2) {
+	(void)ch;
+	(void)b0;
+	(void)b1;
+	(void)b2;
+}
+
+void hal_esb_send(const uint8_t *data, uint16_t len) {
+	(void)data;
+	(void)len;
+}
+
+void hal_trace_write(const uint8_t *data, unsigned int len) {
+	// The event trace is not recorded on the host
+	(void)data;
+	(void)len;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-s speed] [-d dir]\n"
+			"  -s speed  Rate of the simulated clock relative to real time (default 1)\n"
+			"  -d dir    Create symlinks vesc, ble0.. and usb to the terminals in dir\n",
+			name);
+}
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "s:d:h")) != -1) {
+		switch (opt) {
+		case 's':
+			m_speed = atof(optarg);
+			if (m_speed <= 0.0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'd':
+			m_link_dir = optarg;
+			break;
+
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	static char ble_names[BLE_LINKS][8];
+	port_init(&m_uart, "vesc");
+	for (int i = 0;i < BLE_LINKS;i++) {
+		snprintf(ble_names[i], sizeof(ble_names[i]), "ble%d", i);
+		port_init(&m_ble[i], ble_names[i]);
+	}
+#if HAL_USB
+	port_init(&m_usb, "usb");
+#endif
+
+	conn_adapt_init(0);
+	bridge_init();
+
+	uint64_t start = now_us();
+	uint64_t ticks = 0;
+
+	while (!m_quit) {
+		uint8_t buffer[4096];
+		int len;
+
+		// Connections
+		port_update(&m_uart);
+		for (int i = 0;i < BLE_LINKS;i++) {
+			if (port_update(&m_ble[i])) {
+				if (m_ble[i].open) {
+					bridge_ble_connected(i);
+				} else {
+					bridge_ble_disconnected(i);
+				}
+			}
+		}
+#if HAL_USB
+		if (port_update(&m_usb)) {
+			if (m_usb.open) {
+				bridge_usb_connected();
+			} else {
+				bridge_usb_disconnected();
+			}
+		}
+#endif
+
+		// Received data, the UART first like on the hardware
+		while ((len = port_read(&m_uart, buffer, sizeof(buffer))) > 0) {
+			bridge_uart_rx(buffer, len);
+		}
+		for (int i = 0;i < BLE_LINKS;i++) {
+			while ((len = port_read(&m_ble[i], buffer, sizeof(buffer))) > 0) {
+				bridge_ble_rx(i, buffer, len);
+			}
+		}
+#if HAL_USB
+		while ((len = port_read(&m_usb, buffer, sizeof(buffer))) > 0) {
+			bridge_usb_rx(buffer, len);
+		}
+#endif
+
+		// Timers
+		uint64_t due = (uint64_t)((double)(now_us() - start) * m_speed / 1000.0);
+		if (due > ticks + TICKS_CATCH_UP_MAX) {
+			ticks = due - TICKS_CATCH_UP_MAX;
+		}
+		while (ticks < due) {
+			bridge_timerfunc();
+			ticks++;
+		}
+
+		bridge_process();
+
+		// Sleep until the next tick or until there is something to do.
+		// Closed terminals report a hangup all the time, so they are only
+		// checked again on the next pass.
+		struct pollfd fds[BLE_LINKS + 2];
+		PORT_t *ports[BLE_LINKS + 2];
+		int nfds = 0;
+
+		ports[nfds++] = &m_uart;
+		for (int i = 0;i < BLE_LINKS;i++) {
+			ports[nfds++] = &m_ble[i];
+		}
+#if HAL_USB
+		ports[nfds++] = &m_usb;
+#endif
+
+		int polled = 0;
+		for (int i = 0;i < nfds;i++) {
+			PORT_t *p = ports[i];
+			port_flush(p);
+			if (p->open) {
+				fds[polled].fd = p->fd;
+				fds[polled].events = POLLIN;
+				if (p->tx_len > 0) {
+					fds[polled].events |= POLLOUT;
+				}
+				polled++;
+			}
+		}
+
+		uint64_t next = start + (uint64_t)((double)(ticks + 1) * 1000.0 / m_speed);
+		uint64_t now = now_us();
+		uint64_t wait = next > now ? next - now : 0;
+		struct timespec timeout = {wait / 1000000, (wait % 1000000) * 1000};
+		ppoll(fds, polled, &timeout, NULL);
+	}
+
+	port_close(&m_uart);
+	for (int i = 0;i < BLE_LINKS;i++) {
+		port_close(&m_ble[i]);
+	}
+#if HAL_USB
+	port_close(&m_usb);
+#endif
+
+	return 0;
+}
+
+static void port_init(PORT_t *p, const char *name) {
+	memset(p, 0, sizeof(PORT_t));
+	p->name = name;
+
+	p->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (p->fd < 0 || grantpt(p->fd) != 0 || unlockpt(p->fd) != 0) {
+		perror("posix_openpt");
+		exit(1);
+	}
+	snprintf(p->path, sizeof(p->path), "%s", ptsname(p->fd));
+
+	// Pass bytes through unchanged. The settings stay with the terminal
+	// after the slave side is closed.
+	int fd = open(p->path, O_RDWR | O_NOCTTY);
+	if (fd >= 0) {
+		struct termios t;
+		if (tcgetattr(fd, &t) == 0) {
+			cfmakeraw(&t);
+			tcsetattr(fd, TCSANOW, &t);
+		}
+		close(fd);
+	}
+
+	if (m_link_dir) {
+		snprintf(p->link, sizeof(p->link), "%s/%s", m_link_dir, name);
+		unlink(p->link);
+		if (symlink(p->path, p->link) != 0) {
+			perror(p->link);
+			p->link[0] = '\0';
+		}
+	}
+
+	printf("%s %s\n", name, p->path);
+}
+
+static void port_close(PORT_t *p) {
+	if (p->link[0]) {
+		unlink(p->link);
+	}
+	close(p->fd);
+}
+
+/**
+ * Check if the slave side of a terminal is open.
+ *
+ * @return
+ * true if that changed.
+ */
+static bool port_update(PORT_t *p) {
+	struct pollfd fd = {p->fd, 0, 0};
+	poll(&fd, 1, 0);
+
+	bool open = !(fd.revents & POLLHUP);
+	if (open == p->open) {
+		return false;
+	}
+
+	p->open = open;
+	p->tx_len = 0;
+	p->tx_hold = 0;
+	return true;
+}
+
+/**
+ * Queue a packet for a terminal. Like on the hardware only complete packets
+ * are queued.
+ *
+ * @return
+ * true if it was queued, false if the terminal is closed or the queue full.
+ */
+static bool port_queue(PORT_t *p, const packet_segment *segs, int seg_num) {
+	if (!p->open) {
+		return false;
+	}
+
+	uint32_t len = 0;
+	for (int i = 0;i < seg_num;i++) {
+		len += segs[i].len;
+	}
+
+	if (len > PORT_TX_BUF_LEN - p->tx_len) {
+		p->tx_drops++;
+		return false;
+	}
+
+	for (int i = 0;i < seg_num;i++) {
+		memcpy(p->tx_buf + p->tx_len, segs[i].data, segs[i].len);
+		p->tx_len += segs[i].len;
+	}
+
+	if (p->tx_len > p->tx_depth_max) {
+		p->tx_depth_max = p->tx_len;
+	}
+
+	port_flush(p);
+	return true;
+}
+
+static void port_flush(PORT_t *p) {
+	uint32_t len = p->tx_len;
+	if (p == &m_uart && m_uart_paused && p->tx_hold < len) {
+		len = p->tx_hold;
+	}
+
+	if (!p->open || len == 0) {
+		return;
+	}
+
+	ssize_t res = write(p->fd, p->tx_buf, len);
+	if (res > 0) {
+		memmove(p->tx_buf, p->tx_buf + res, p->tx_len - res);
+		p->tx_len -= res;
+		p->tx_hold -= p->tx_hold > (uint32_t)res ? (uint32_t)res : p->tx_hold;
+	}
+}
+
+/**
+ * @return
+ * Bytes read, 0 if there are none.
+ */
+static int port_read(PORT_t *p, uint8_t *data, unsigned int max_len) {
+	if (!p->open) {
+		return 0;
+	}
+
+	ssize_t res = read(p->fd, data, max_len);
+	if (res < 0 && errno != EAGAIN && errno != EINTR) {
+		// Closed in the meantime, noticed by port_update
+		return 0;
+	}
+
+	return res > 0 ? res : 0;
+}
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_signal(int sig) {
+	(void)sig;
+	m_quit = 1;
+}
@@ -0,0 +1,67 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Helpers shared by the host tests and benchmarks. Every test is a program
+ * that returns non-zero if a CHECK failed. The benchmarks print their results
+ * and only fail if they decode something wrong.
+ */
+
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond, ...)												\
+	do {																\
+		if (!(cond)) {													\
+			test_failures++;											\
+			fprintf(stderr, "%s:%d: CHECK(%s) failed: ", __FILE__, __LINE__, #cond);	\
+			fprintf(stderr, __VA_ARGS__);								\
+			fprintf(stderr, "\n");										\
+		}																\
+	} while (0)
+
+#define TEST_RESULT(name)												\
+	(printf("%s: %s\n", name, test_failures ? "FAILED" : "ok"), test_failures != 0)
+
+// Small deterministic PRNG (xorshift32), so that failing seeds can be replayed
+static inline uint32_t test_rand(uint32_t *state) {
+	uint32_t x = *state ? *state : 0x9E3779B9;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static inline uint32_t test_rand_range(uint32_t *state, uint32_t n) {
+	return test_rand(state) % n;
+}
+
+// Monotonic time in seconds, for the benchmarks
+static inline double test_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+#endif /* TEST_H_ */
@@ -0,0 +1,113 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Checks crc16 against a bit-wise CRC-16/XMODEM, and that continuing a CRC
+ * with crc16_update over any split of the data gives the same result as
+ * calculating it at once. Every CRC16_BACKEND is checked, not only the one
+ * the firmware is built with.
+ */
+
+#include "test.h"
+#include "crc.h"
+#include "crc_backends.h"
+
+// Settings
+#define BUF_LEN					1100
+#define FUZZ_ROUNDS				20000
+
+// Private functions
+static unsigned short crc16_ref(unsigned short crc, const unsigned char *buf, unsigned int len) {
+	for (unsigned int i = 0;i < len;i++) {
+		crc ^= (unsigned short)buf[i] << 8;
+		for (int j = 0;j < 8;j++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+
+	return crc;
+}
+
+int main(void) {
+	unsigned char buf[BUF_LEN];
+	uint32_t r = 1;
+
+	unsigned char check[] = "123456789";
+	CHECK(crc16(check, 9) == 0x31C3, "check value %04x", crc16(check, 9));
+
+	for (unsigned int i = 0;i < BUF_LEN;i++) {
+		buf[i] = test_rand(&r);
+	}
+
+	// Every length and alignment of short buffers
+	for (unsigned int ofs = 0;ofs < 8;ofs++) {
+		for (unsigned int len = 0;len <= 64;len++) {
+			unsigned short res = crc16(buf + ofs, len);
+			unsigned short ref = crc16_ref(0, buf + ofs, len);
+			CHECK(res == ref, "offset %u len %u: %04x, expected %04x", ofs, len, res, ref);
+		}
+	}
+
+	// Random splits, like a payload that arrives in chunks
+	for (int i = 0;i < FUZZ_ROUNDS;i++) {
+		unsigned int ofs = test_rand_range(&r, 8);
+		unsigned int len = test_rand_range(&r, BUF_LEN - 8);
+		unsigned int max_chunk = 1 + test_rand_range(&r, 64);
+		unsigned short crc = 0;
+
+		for (unsigned int pos = 0;pos < len;) {
+			unsigned int n = test_rand_range(&r, max_chunk + 1);
+			if (n > len - pos) {
+				n = len - pos;
+			}
+			crc = crc16_update(crc, buf + ofs + pos, n);
+			pos += n;
+		}
+
+		unsigned short ref = crc16_ref(0, buf + ofs, len);
+		CHECK(crc == ref, "round %d len %u chunks up to %u: %04x, expected %04x",
+				i, len, max_chunk, crc, ref);
+	}
+
+	// Every backend, bit-exact with the reference for every start value,
+	// length and alignment
+	for (unsigned int b = 0;b < CRC_BACKEND_NUM;b++) {
+		const CRC_BACKEND_t *be = &crc_backends[b];
+
+		for (unsigned int ofs = 0;ofs < 8;ofs++) {
+			for (unsigned int len = 0;len <= 64;len++) {
+				unsigned short res = be->update(0, buf + ofs, len);
+				unsigned short ref = crc16_ref(0, buf + ofs, len);
+				CHECK(res == ref, "%s offset %u len %u: %04x, expected %04x",
+						be->name, ofs, len, res, ref);
+			}
+		}
+
+		for (int i = 0;i < FUZZ_ROUNDS;i++) {
+			unsigned short init = test_rand(&r);
+			unsigned int ofs = test_rand_range(&r, 8);
+			unsigned int len = test_rand_range(&r, BUF_LEN - 8);
+
+			unsigned short res = be->update(init, buf + ofs, len);
+			unsigned short ref = crc16_ref(init, buf + ofs, len);
+			CHECK(res == ref, "%s round %d init %04x len %u: %04x, expected %04x",
+					be->name, i, init, len, res, ref);
+		}
+	}
+
+	return TEST_RESULT("test_crc");
+}
@@ -0,0 +1,99 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Fuzzes the word-at-a-time start byte search of packet.c against a plain
+ * byte loop, for every alignment and length of the buffer. packet.c is
+ * included to get at the private function.
+ */
+
+#include "../packet.c"
+#include "test.h"
+
+// Settings
+#define BUF_LEN					256
+#define FUZZ_ROUNDS				20000
+
+// Private functions
+static unsigned int find_start_byte_ref(const unsigned char *buffer, unsigned int len) {
+	for (unsigned int i = 0;i < len;i++) {
+		if (buffer[i] == 2 ||
+				(PACKET_MAX_PL_LEN > 255 && buffer[i] == 3) ||
+				(PACKET_MAX_PL_LEN > 65535 && buffer[i] == 4)) {
+			return i;
+		}
+	}
+
+	return len;
+}
+
+/*
+ * Random bytes with about one start byte per 'sparsity' bytes. Bytes next to
+ * the start bytes in value are common, as they are the ones a word-wise
+ * search is most likely to get wrong.
+ */
+static void fill(uint8_t *buf, unsigned int len, uint32_t sparsity, uint32_t *r) {
+	static const uint8_t near[] = {0, 1, 4, 5, 6, 7, 0x80, 0x82, 0x83, 0xFE, 0xFF};
+
+	for (unsigned int i = 0;i < len;i++) {
+		uint32_t k = test_rand(r);
+		if (sparsity && (k % sparsity) == 0) {
+			buf[i] = 2 + ((k >> 16) & 1);
+		} else if ((k & 0x300) == 0) {
+			buf[i] = near[(k >> 12) % sizeof(near)];
+		} else {
+			do {
+				buf[i] = test_rand(r);
+			} while (buf[i] == 2 || buf[i] == 3);
+		}
+	}
+}
+
+int main(void) {
+	static const uint32_t sparsities[] = {0, 2, 7, 64, 1000};
+	uint8_t buf[BUF_LEN + 8];
+	uint32_t r = 1;
+
+	// Every single start byte position, alignment and length
+	for (unsigned int ofs = 0;ofs < 8;ofs++) {
+		for (unsigned int len = 0;len <= 40;len++) {
+			for (unsigned int pos = 0;pos <= len;pos++) {
+				fill(buf, sizeof(buf), 0, &r);
+				if (pos < len) {
+					buf[ofs + pos] = 2 + (pos & 1);
+				}
+
+				unsigned int res = find_start_byte(buf + ofs, len);
+				CHECK(res == pos, "offset %u len %u: %u, expected %u", ofs, len, res, pos);
+			}
+		}
+	}
+
+	for (int i = 0;i < FUZZ_ROUNDS;i++) {
+		uint32_t sparsity = sparsities[test_rand_range(&r, sizeof(sparsities) / sizeof(sparsities[0]))];
+		unsigned int ofs = test_rand_range(&r, 8);
+		unsigned int len = test_rand_range(&r, BUF_LEN + 1);
+
+		fill(buf, sizeof(buf), sparsity, &r);
+
+		unsigned int res = find_start_byte(buf + ofs, len);
+		unsigned int ref = find_start_byte_ref(buf + ofs, len);
+		CHECK(res == ref, "round %d offset %u len %u: %u, expected %u", i, ofs, len, res, ref);
+	}
+
+	return TEST_RESULT("test_find_start");
+}
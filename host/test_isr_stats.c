@@ -0,0 +1,187 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Checks isr_stats.c with a cycle counter the test sets: that only the
+ * outermost of nested probes counts, that latency is measured from the first
+ * pend, that the counter may wrap in between and that every histogram bin
+ * starts and ends where isr_stats_latency_hist says.
+ */
+
+#include "test.h"
+
+#undef ISR_STATS_CYCLES
+#define ISR_STATS_CYCLES()			m_cycles
+
+static uint32_t m_cycles;
+
+#include "../isr_stats.c"
+
+// Settings
+#define PROBE					ISR_STATS_RADIO
+
+// Private functions
+static int hist_bin(const uint32_t *hist) {
+	int bin = -1;
+
+	for (int i = 0;i < ISR_STATS_BINS;i++) {
+		if (hist[i]) {
+			if (bin >= 0 || hist[i] != 1) {
+				return -2;
+			}
+			bin = i;
+		}
+	}
+
+	return bin;
+}
+
+static int duration_bin(uint32_t cycles) {
+	isr_stats_reset();
+	m_cycles = 1000;
+	isr_stats_enter(PROBE);
+	m_cycles += cycles;
+	isr_stats_exit(PROBE);
+	return hist_bin(isr_stats_duration_hist(PROBE));
+}
+
+static int latency_bin(uint32_t cycles) {
+	isr_stats_reset();
+	m_cycles = 1000;
+	isr_stats_pend(PROBE);
+	m_cycles += cycles;
+	isr_stats_enter(PROBE);
+	isr_stats_exit(PROBE);
+	return hist_bin(isr_stats_latency_hist(PROBE));
+}
+
+static void test_nesting(void) {
+	isr_stats_init();
+
+	m_cycles = 100;
+	isr_stats_enter(PROBE);
+	m_cycles = 150;
+	isr_stats_enter(PROBE);
+	m_cycles = 200;
+	isr_stats_exit(PROBE);
+	CHECK(isr_stats_count(PROBE) == 0, "inner exit counted");
+	CHECK(isr_stats_max_duration(PROBE) == 0, "inner exit recorded %u", isr_stats_max_duration(PROBE));
+
+	m_cycles = 400;
+	isr_stats_exit(PROBE);
+	CHECK(isr_stats_count(PROBE) == 1, "count %u", isr_stats_count(PROBE));
+	CHECK(isr_stats_max_duration(PROBE) == 300, "duration %u", isr_stats_max_duration(PROBE));
+
+	// An exit without enter changes nothing
+	m_cycles = 10000;
+	isr_stats_exit(PROBE);
+	CHECK(isr_stats_count(PROBE) == 1, "unmatched exit counted");
+	CHECK(isr_stats_max_duration(PROBE) == 300, "unmatched exit recorded");
+
+	// Other probes are independent
+	CHECK(isr_stats_count(ISR_STATS_UART) == 0, "other probe counted");
+
+	// Max keeps the longest
+	m_cycles = 20000;
+	isr_stats_enter(PROBE);
+	m_cycles += 50;
+	isr_stats_exit(PROBE);
+	CHECK(isr_stats_count(PROBE) == 2, "count %u", isr_stats_count(PROBE));
+	CHECK(isr_stats_max_duration(PROBE) == 300, "max duration %u", isr_stats_max_duration(PROBE));
+}
+
+static void test_latency(void) {
+	isr_stats_reset();
+
+	// Pending twice before running, the first pend counts
+	m_cycles = 100;
+	isr_stats_pend(PROBE);
+	m_cycles = 150;
+	isr_stats_pend(PROBE);
+	m_cycles = 300;
+	isr_stats_enter(PROBE);
+
+	// A nested enter does not take a new pend
+	isr_stats_pend(PROBE);
+	m_cycles = 350;
+	isr_stats_enter(PROBE);
+	isr_stats_exit(PROBE);
+	isr_stats_exit(PROBE);
+	CHECK(isr_stats_max_latency(PROBE) == 200, "latency %u", isr_stats_max_latency(PROBE));
+
+	// The pend from inside counts for the next run
+	m_cycles = 500;
+	isr_stats_enter(PROBE);
+	isr_stats_exit(PROBE);
+	CHECK(isr_stats_max_latency(PROBE) == 200, "latency %u", isr_stats_max_latency(PROBE));
+
+	uint32_t n = 0;
+	for (int i = 0;i < ISR_STATS_BINS;i++) {
+		n += isr_stats_latency_hist(PROBE)[i];
+	}
+	CHECK(n == 2, "%u latencies recorded", n);
+
+	// Without pend, there is no latency
+	isr_stats_reset();
+	m_cycles = 1000;
+	isr_stats_enter(PROBE);
+	isr_stats_exit(PROBE);
+	CHECK(hist_bin(isr_stats_latency_hist(PROBE)) == -1, "latency without pend");
+	CHECK(isr_stats_count(PROBE) == 1, "count %u", isr_stats_count(PROBE));
+
+	// The counter wraps between pend and exit
+	isr_stats_reset();
+	m_cycles = 0xFFFFFFF0;
+	isr_stats_pend(PROBE);
+	m_cycles = 0x10;
+	isr_stats_enter(PROBE);
+	m_cycles = 0x50;
+	isr_stats_exit(PROBE);
+	CHECK(isr_stats_max_latency(PROBE) == 0x20, "wrapped latency %u", isr_stats_max_latency(PROBE));
+	CHECK(isr_stats_max_duration(PROBE) == 0x40, "duration %u", isr_stats_max_duration(PROBE));
+}
+
+static void test_bins(void) {
+	uint32_t first = 1 << ISR_STATS_SHIFT;
+
+	CHECK(duration_bin(0) == 0, "0 cycles in bin %d", duration_bin(0));
+	CHECK(duration_bin(first - 1) == 0, "%u cycles in bin %d", first - 1, duration_bin(first - 1));
+	CHECK(latency_bin(0) == 0, "latency 0 in bin %d", latency_bin(0));
+
+	for (int n = 1;n < ISR_STATS_BINS;n++) {
+		uint32_t lo = 1U << (ISR_STATS_SHIFT + n - 1);
+		uint32_t hi = (1U << (ISR_STATS_SHIFT + n)) - 1;
+
+		// Everything from the last bin on goes in the last bin
+		if (n == ISR_STATS_BINS - 1) {
+			hi = 0xFFFFFFFF;
+		}
+
+		CHECK(duration_bin(lo) == n, "%u cycles in bin %d, expected %d", lo, duration_bin(lo), n);
+		CHECK(duration_bin(hi) == n, "%u cycles in bin %d, expected %d", hi, duration_bin(hi), n);
+		CHECK(latency_bin(lo) == n, "latency %u in bin %d, expected %d", lo, latency_bin(lo), n);
+		CHECK(latency_bin(hi) == n, "latency %u in bin %d, expected %d", hi, latency_bin(hi), n);
+	}
+}
+
+int main(void) {
+	test_nesting();
+	test_latency();
+	test_bins();
+
+	return TEST_RESULT("test_isr_stats");
+}
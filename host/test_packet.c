@@ -0,0 +1,289 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Checks the packet decoder against a plain reference decoder that tries
+ * every offset of the stream and calculates the full CRC of every candidate,
+ * like the original byte-wise decoder did, and checks that feeding chunks to
+ * packet_process_bytes decodes the same as feeding every byte to
+ * packet_process_byte.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "test.h"
+#include "packet.h"
+#include "crc.h"
+
+// Settings
+#define STREAM_MAX				(1 << 18)
+#define CLEAN_FRAMES			400		// Frames of the clean stream, must fit in STREAM_MAX
+#define FUZZ_SEEDS				500
+
+// Private types
+typedef struct {
+	unsigned int frames;
+	uint32_t hash;				// FNV-1a over the lengths and payloads of all frames
+} DECODED_t;
+
+// Private variables
+static uint8_t m_stream[STREAM_MAX];
+static unsigned int m_stream_len;
+static DECODED_t m_decoded;
+
+// Private functions
+static void decoded_add(DECODED_t *d, const unsigned char *data, unsigned int len) {
+	uint32_t h = d->hash ? d->hash : 2166136261u;
+	for (int i = 0;i < 4;i++) {
+		h = (h ^ ((len >> (8 * i)) & 0xFF)) * 16777619u;
+	}
+	for (unsigned int i = 0;i < len;i++) {
+		h = (h ^ data[i]) * 16777619u;
+	}
+	d->hash = h;
+	d->frames++;
+}
+
+static void process_func(unsigned char *data, unsigned int len, int handler_num) {
+	(void)handler_num;
+	decoded_add(&m_decoded, data, len);
+}
+
+/*
+ * Reference decoder. At every offset the candidate is decoded if it is
+ * complete and valid, otherwise the decoder moves one byte forward. A
+ * candidate that runs past the end of the stream stays pending.
+ */
+static DECODED_t ref_decode(const uint8_t *s, unsigned int n) {
+	DECODED_t d = {0, 0};
+	unsigned int pos = 0;
+
+	while (pos < n) {
+		unsigned int start = s[pos];
+		unsigned int len = 0;
+
+		if (start != 2 && !(PACKET_MAX_PL_LEN > 255 && start == 3)) {
+			pos++;
+			continue;
+		}
+
+		if (pos + start > n) {
+			break;
+		}
+
+		if (start == 2) {
+			len = s[pos + 1];
+		} else {
+			len = (unsigned int)s[pos + 1] << 8 | s[pos + 2];
+		}
+
+		if ((start == 2 && len < 1) || (start == 3 && len < 255) || len > PACKET_MAX_PL_LEN) {
+			pos++;
+			continue;
+		}
+
+		if (pos + start + len + 3 > n) {
+			break;
+		}
+
+		const uint8_t *pl = s + pos + start;
+		unsigned short crc_rx = (unsigned short)pl[len] << 8 | pl[len + 1];
+
+		if (pl[len + 2] == 3 && crc16((unsigned char*)pl, len) == crc_rx) {
+			decoded_add(&d, pl, len);
+			pos += start + len + 3;
+		} else {
+			pos++;
+		}
+	}
+
+	return d;
+}
+
+static void stream_frame(const uint8_t *pl, unsigned int len) {
+	unsigned short crc = crc16((unsigned char*)pl, len);
+
+	if (len <= 255) {
+		m_stream[m_stream_len++] = 2;
+	} else {
+		m_stream[m_stream_len++] = 3;
+		m_stream[m_stream_len++] = len >> 8;
+	}
+	m_stream[m_stream_len++] = len & 0xFF;
+	memcpy(m_stream + m_stream_len, pl, len);
+	m_stream_len += len;
+	m_stream[m_stream_len++] = crc >> 8;
+	m_stream[m_stream_len++] = crc & 0xFF;
+	m_stream[m_stream_len++] = 3;
+}
+
+/*
+ * Valid frames mixed with bursts of start, stop and length bytes and with
+ * random noise.
+ */
+static void stream_generate(uint32_t seed) {
+	static const unsigned int lens[] = {1, 2, 5, 50, 200, 255, 256, 300, 512};
+	static const uint8_t specials[] = {0, 1, 2, 3, 4, 255};
+	uint32_t r = seed * 2654435761u + 1;
+	uint8_t pl[PACKET_MAX_PL_LEN];
+
+	m_stream_len = 0;
+
+	for (int i = 0;i < 300;i++) {
+		uint32_t m = test_rand_range(&r, 10);
+
+		if (m < 5) {
+			unsigned int len = lens[test_rand_range(&r, sizeof(lens) / sizeof(lens[0]))];
+			for (unsigned int j = 0;j < len;j++) {
+				pl[j] = test_rand(&r);
+			}
+			stream_frame(pl, len);
+		} else if (m < 8) {
+			unsigned int n = test_rand_range(&r, 40);
+			for (unsigned int j = 0;j < n;j++) {
+				uint32_t k = test_rand_range(&r, sizeof(specials) + 1);
+				m_stream[m_stream_len++] = k < sizeof(specials) ? specials[k] : test_rand(&r);
+			}
+		} else {
+			unsigned int n = test_rand_range(&r, 300);
+			for (unsigned int j = 0;j < n;j++) {
+				m_stream[m_stream_len++] = test_rand(&r);
+			}
+		}
+	}
+}
+
+/*
+ * Feed the stream in chunks of 1 to chunk_max bytes. A chunk_max of 0 uses
+ * packet_process_byte.
+ */
+static DECODED_t feed(uint32_t seed, unsigned int chunk_max) {
+	uint32_t r = seed ^ 0xA5A5A5A5;
+	unsigned int pos = 0;
+
+	memset(&m_decoded, 0, sizeof(m_decoded));
+	packet_init(0, process_func, 0);
+
+	while (pos < m_stream_len) {
+		if (chunk_max == 0) {
+			packet_process_byte(m_stream[pos++], 0);
+			continue;
+		}
+
+		unsigned int n = 1 + test_rand_range(&r, chunk_max);
+		if (n > m_stream_len - pos) {
+			n = m_stream_len - pos;
+		}
+
+		packet_process_bytes(m_stream + pos, n, 0);
+		pos += n;
+	}
+
+	return m_decoded;
+}
+
+static void check_stream(const char *name, uint32_t seed) {
+	static const unsigned int chunks[] = {1, 7, 64, 600, 4096};
+	DECODED_t ref = ref_decode(m_stream, m_stream_len);
+	DECODED_t bytewise = feed(seed, 0);
+
+	CHECK(bytewise.frames == ref.frames && bytewise.hash == ref.hash,
+			"%s seed %u byte-wise: %u frames, reference %u",
+			name, seed, bytewise.frames, ref.frames);
+
+	for (unsigned int i = 0;i < sizeof(chunks) / sizeof(chunks[0]);i++) {
+		DECODED_t d = feed(seed, chunks[i]);
+		CHECK(d.frames == bytewise.frames && d.hash == bytewise.hash,
+				"%s seed %u chunk %u: %u frames, byte-wise %u",
+				name, seed, chunks[i], d.frames, bytewise.frames);
+	}
+}
+
+static void send_func(const packet_segment *segs, int seg_num, int handler_num) {
+	(void)handler_num;
+	for (int i = 0;i < seg_num;i++) {
+		memcpy(m_stream + m_stream_len, segs[i].data, segs[i].len);
+		m_stream_len += segs[i].len;
+	}
+}
+
+/*
+ * Every frame sent with packet_send_packet comes out again, whole and in
+ * order, however the stream is split up.
+ */
+static void test_clean_stream(void) {
+	uint32_t r = 1;
+	uint8_t pl[PACKET_MAX_PL_LEN];
+	DECODED_t sent = {0, 0};
+
+	m_stream_len = 0;
+	packet_init(send_func, 0, 1);
+
+	for (int i = 0;i < CLEAN_FRAMES;i++) {
+		unsigned int len = 1 + test_rand_range(&r, PACKET_MAX_PL_LEN);
+		for (unsigned int j = 0;j < len;j++) {
+			pl[j] = test_rand(&r);
+		}
+		packet_send_packet(pl, len, 1);
+		decoded_add(&sent, pl, len);
+	}
+
+	CHECK(m_stream_len < STREAM_MAX, "stream too long");
+	DECODED_t d = feed(0, 0);
+	CHECK(d.frames == sent.frames && d.hash == sent.hash,
+			"clean stream: %u of %u frames", d.frames, sent.frames);
+	check_stream("clean", 0);
+}
+
+/*
+ * Bogus candidates that stay incomplete for a long time use up the CRC
+ * budget. The valid frame behind them must still be decoded once its stop
+ * byte has arrived.
+ */
+static void test_budget_drain(void) {
+	uint8_t pl[100];
+
+	m_stream_len = 0;
+	for (unsigned int i = 0;i < 400;i++) {
+		m_stream[m_stream_len++] = 2;
+		m_stream[m_stream_len++] = 0xFF;
+	}
+	for (unsigned int i = 0;i < sizeof(pl);i++) {
+		pl[i] = i;
+	}
+	stream_frame(pl, sizeof(pl));
+	for (unsigned int i = 0;i < 300;i++) {
+		m_stream[m_stream_len++] = 0;
+	}
+
+	DECODED_t ref = ref_decode(m_stream, m_stream_len);
+	CHECK(ref.frames == 1, "reference decoded %u frames", ref.frames);
+	check_stream("budget drain", 0);
+}
+
+int main(void) {
+	test_clean_stream();
+	test_budget_drain();
+
+	for (uint32_t seed = 0;seed < FUZZ_SEEDS;seed++) {
+		stream_generate(seed);
+		check_stream("fuzz", seed);
+	}
+
+	return TEST_RESULT("test_packet");
+}
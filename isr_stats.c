@@ -0,0 +1,171 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Interrupt latency and duration histograms, based on the DWT cycle counter.
+ *
+ * Every probe records how long it ran from isr_stats_enter to isr_stats_exit,
+ * including the time it was preempted. Probes for interrupts that are
+ * triggered from software also record how late they started, measured from
+ * isr_stats_pend. Hardware interrupts only have a duration, as there is no
+ * way to tell when their event happened.
+ *
+ * Probes can be nested, only the outermost enter and exit count. This is
+ * what critical regions need.
+ *
+ * Each probe is only recorded from one interrupt at a time, so the
+ * functions do not need any locking. The cycle counter wraps after about a
+ * minute at 64 MHz, which does not matter for differences.
+ */
+
+#ifndef ISR_STATS_CYCLES
+#include "nrf.h"
+#define USE_DWT
+#endif
+#include "isr_stats.h"
+
+#include <string.h>
+
+// Private types
+typedef struct {
+	volatile bool pending;
+	uint32_t pend_time;
+	uint32_t enter_time;
+	uint32_t depth;
+	uint32_t count;
+	uint32_t max_latency;
+	uint32_t max_duration;
+	uint32_t latency[ISR_STATS_BINS];
+	uint32_t duration[ISR_STATS_BINS];
+} PROBE_t;
+
+// Private variables
+static PROBE_t m_probes[ISR_STATS_PROBES];
+
+// Private functions
+static void hist_add(uint32_t *hist, uint32_t cycles);
+
+void isr_stats_init(void) {
+#if ISR_STATS && defined(USE_DWT)
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+	isr_stats_reset();
+}
+
+void isr_stats_reset(void) {
+	memset(m_probes, 0, sizeof(m_probes));
+}
+
+/**
+ * Record that the interrupt of a probe was triggered, e.g. with
+ * NVIC_SetPendingIRQ. If it is triggered again before it runs, the first
+ * time counts.
+ */
+void isr_stats_pend(ISR_STATS_PROBE probe) {
+	PROBE_t *p = &m_probes[probe];
+
+	if (!p->pending) {
+		p->pend_time = ISR_STATS_CYCLES();
+		p->pending = true;
+	}
+}
+
+void isr_stats_enter(ISR_STATS_PROBE probe) {
+	uint32_t now = ISR_STATS_CYCLES();
+	PROBE_t *p = &m_probes[probe];
+
+	if (p->depth++ > 0) {
+		return;
+	}
+
+	p->enter_time = now;
+
+	if (p->pending) {
+		uint32_t latency = now - p->pend_time;
+		p->pending = false;
+		hist_add(p->latency, latency);
+		if (latency > p->max_latency) {
+			p->max_latency = latency;
+		}
+	}
+}
+
+void isr_stats_exit(ISR_STATS_PROBE probe) {
+	uint32_t now = ISR_STATS_CYCLES();
+	PROBE_t *p = &m_probes[probe];
+
+	if (p->depth == 0 || --p->depth > 0) {
+		return;
+	}
+
+	uint32_t duration = now - p->enter_time;
+	hist_add(p->duration, duration);
+	if (duration > p->max_duration) {
+		p->max_duration = duration;
+	}
+	p->count++;
+}
+
+uint32_t isr_stats_count(ISR_STATS_PROBE probe) {
+	return m_probes[probe].count;
+}
+
+uint32_t isr_stats_max_latency(ISR_STATS_PROBE probe) {
+	return m_probes[probe].max_latency;
+}
+
+uint32_t isr_stats_max_duration(ISR_STATS_PROBE probe) {
+	return m_probes[probe].max_duration;
+}
+
+/**
+ * Get the latency histogram of a probe. Bin 0 counts latencies below
+ * 2^ISR_STATS_SHIFT cycles, and bin n > 0 those of 2^(ISR_STATS_SHIFT + n - 1)
+ * to 2^(ISR_STATS_SHIFT + n) - 1 cycles. The last bin also counts anything
+ * longer.
+ *
+ * @return
+ * ISR_STATS_BINS counters.
+ */
+const uint32_t *isr_stats_latency_hist(ISR_STATS_PROBE probe) {
+	return m_probes[probe].latency;
+}
+
+/**
+ * Get the duration histogram of a probe, with the same bins as
+ * isr_stats_latency_hist.
+ *
+ * @return
+ * ISR_STATS_BINS counters.
+ */
+const uint32_t *isr_stats_duration_hist(ISR_STATS_PROBE probe) {
+	return m_probes[probe].duration;
+}
+
+static void hist_add(uint32_t *hist, uint32_t cycles) {
+	cycles >>= ISR_STATS_SHIFT;
+
+	int bin = 0;
+	while (cycles && bin < (ISR_STATS_BINS - 1)) {
+		cycles >>= 1;
+		bin++;
+	}
+
+	hist[bin]++;
+}
@@ -0,0 +1,71 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef ISR_STATS_H_
+#define ISR_STATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Settings
+#ifndef ISR_STATS
+#define ISR_STATS					0		// Set to 1 to record, normally from the Makefile
+#endif
+
+#define ISR_STATS_BINS				16		// Histogram bins
+#define ISR_STATS_SHIFT				4		// Bin 1 starts at 2^ISR_STATS_SHIFT cycles
+
+// The cycle counter. Can be replaced to run the recording on another target.
+#ifndef ISR_STATS_CYCLES
+#define ISR_STATS_CYCLES()			(DWT->CYCCNT)
+#endif
+
+// Probes
+typedef enum {
+	ISR_STATS_RADIO_CB = 0,			// radio_callback, timeslot signals
+	ISR_STATS_RADIO,				// RADIO_IRQHandler, called from radio_callback
+	ISR_STATS_TIMESLOT_BEGIN,		// TIMESLOT_BEGIN_IRQHandler
+	ISR_STATS_ESB_RX,				// UESB_RX_HANDLE_IRQHandler
+	ISR_STATS_UART,					// UARTE interrupt
+	ISR_STATS_CRITICAL,				// Critical regions of the bridge, see hal.h
+	ISR_STATS_PROBES
+} ISR_STATS_PROBE;
+
+// Recording, compiled out unless ISR_STATS is set
+#if ISR_STATS
+#define ISR_STATS_PEND(probe)		isr_stats_pend(probe)
+#define ISR_STATS_ENTER(probe)		isr_stats_enter(probe)
+#define ISR_STATS_EXIT(probe)		isr_stats_exit(probe)
+#else
+#define ISR_STATS_PEND(probe)
+#define ISR_STATS_ENTER(probe)
+#define ISR_STATS_EXIT(probe)
+#endif
+
+// Functions
+void isr_stats_init(void);
+void isr_stats_reset(void);
+void isr_stats_pend(ISR_STATS_PROBE probe);
+void isr_stats_enter(ISR_STATS_PROBE probe);
+void isr_stats_exit(ISR_STATS_PROBE probe);
+uint32_t isr_stats_count(ISR_STATS_PROBE probe);
+uint32_t isr_stats_max_latency(ISR_STATS_PROBE probe);
+uint32_t isr_stats_max_duration(ISR_STATS_PROBE probe);
+const uint32_t *isr_stats_latency_hist(ISR_STATS_PROBE probe);
+const uint32_t *isr_stats_duration_hist(ISR_STATS_PROBE probe);
+
+#endif /* ISR_STATS_H_ */
@@ -0,0 +1,309 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * L2CAP connection oriented channel transport.
+ *
+ * Clients that support it read the PSM from a characteristic in the NUS
+ * service and open an LE credit based channel on it. The channel carries the
+ * same byte stream of framed VESC packets as NUS, but in SDUs of up to
+ * L2CAP_COC_MTU bytes without any ATT overhead, and the peer can only send
+ * as much as we have given it credits for. While the channel is open, the
+ * data of the link goes over it instead of NUS.
+ *
+ * Received SDUs are handed to the rx function directly from the BLE event,
+ * after which the buffer is given back to the SoftDevice. On the TX side
+ * up to L2CAP_COC_TX_QUEUE SDUs are queued in the SoftDevice so that the
+ * link does not go quiet between two SDUs. The tx function is called when
+ * there is room for another one.
+ *
+ * The events and l2cap_coc_reset are handled from within critical regions by
+ * the caller. l2cap_coc_tx_buf and l2cap_coc_send can be called from any
+ * context, but only from one at a time for a link, and call the SoftDevice
+ * with interrupts enabled.
+ */
+
+#include "l2cap_coc.h"
+#include "nrf_sdh_ble.h"
+#include "ble_srv_common.h"
+#include "app_util_platform.h"
+
+#include <string.h>
+
+// Credits that let the peer send one complete SDU. Every PDU carries at most
+// L2CAP_COC_MPS bytes, and the first one also the 2 byte SDU length.
+#define CREDITS						((L2CAP_COC_MTU + 2 + L2CAP_COC_MPS - 1) / L2CAP_COC_MPS)
+
+// Private types
+typedef struct {
+	uint16_t conn_handle;
+	uint16_t cid;
+	uint16_t tx_mtu;
+	uint8_t rx_buf[L2CAP_COC_MTU];
+	uint8_t tx_buf[L2CAP_COC_TX_QUEUE][L2CAP_COC_MTU];
+	int tx_head;
+	int tx_pending;
+} CHANNEL_t;
+
+// Private variables
+static void (*m_rx_func)(int link, const uint8_t *data, uint16_t len) = 0;
+static void (*m_tx_func)(void) = 0;
+static CHANNEL_t m_channels[L2CAP_COC_LINKS];
+static ble_gatts_char_handles_t m_psm_handles;
+
+// Private functions
+static void setup_request(int link, ble_l2cap_evt_t const *p_evt);
+
+void l2cap_coc_init(void (*rx_func)(int link, const uint8_t *data, uint16_t len),
+		void (*tx_func)(void)) {
+	m_rx_func = rx_func;
+	m_tx_func = tx_func;
+
+	for (int i = 0;i < L2CAP_COC_LINKS;i++) {
+		l2cap_coc_reset(i);
+	}
+}
+
+/**
+ * Reserve SoftDevice memory for one channel per connection. Must be called
+ * after nrf_sdh_ble_default_cfg_set and before nrf_sdh_ble_enable.
+ *
+ * @param conn_cfg_tag
+ * The connection configuration tag the connections are made with.
+ *
+ * @param ram_start
+ * Start of the application RAM.
+ *
+ * @return
+ * NRF_SUCCESS, or the error from sd_ble_cfg_set.
+ */
+uint32_t l2cap_coc_cfg_set(uint8_t conn_cfg_tag, uint32_t ram_start) {
+	ble_cfg_t cfg;
+	memset(&cfg, 0, sizeof(cfg));
+
+	cfg.conn_cfg.conn_cfg_tag = conn_cfg_tag;
+	cfg.conn_cfg.params.l2cap_conn_cfg.rx_mps = L2CAP_COC_MPS;
+	cfg.conn_cfg.params.l2cap_conn_cfg.tx_mps = L2CAP_COC_MPS;
+	cfg.conn_cfg.params.l2cap_conn_cfg.rx_queue_size = 1;
+	cfg.conn_cfg.params.l2cap_conn_cfg.tx_queue_size = L2CAP_COC_TX_QUEUE;
+	cfg.conn_cfg.params.l2cap_conn_cfg.ch_count = 1;
+
+	return sd_ble_cfg_set(BLE_CONN_CFG_L2CAP, &cfg, ram_start);
+}
+
+/**
+ * Add the read-only characteristic that holds the PSM, as a little endian
+ * uint16. It has to be added right after the service it goes into.
+ *
+ * @param service_handle
+ * The service to add it to.
+ *
+ * @param uuid_type
+ * UUID type of the service, the characteristic uses the same base.
+ *
+ * @return
+ * NRF_SUCCESS, or the error from characteristic_add.
+ */
+uint32_t l2cap_coc_char_add(uint16_t service_handle, uint8_t uuid_type) {
+	uint8_t psm[2] = {L2CAP_COC_PSM & 0xFF, L2CAP_COC_PSM >> 8};
+	ble_add_char_params_t add_char_params;
+	memset(&add_char_params, 0, sizeof(add_char_params));
+
+	add_char_params.uuid = L2CAP_COC_PSM_UUID;
+	add_char_params.uuid_type = uuid_type;
+	add_char_params.max_len = sizeof(psm);
+	add_char_params.init_len = sizeof(psm);
+	add_char_params.p_init_value = psm;
+	add_char_params.char_props.read = 1;
+	add_char_params.read_access = SEC_OPEN;
+
+	return characteristic_add(service_handle, &add_char_params, &m_psm_handles);
+}
+
+/**
+ * Handle the L2CAP events of a link.
+ *
+ * @param link
+ * The link the connection handle of the event belongs to.
+ *
+ * @param p_ble_evt
+ * The event. Events other than L2CAP events are ignored.
+ */
+void l2cap_coc_on_ble_evt(int link, ble_evt_t const *p_ble_evt) {
+	ble_l2cap_evt_t const *p_evt = &p_ble_evt->evt.l2cap_evt;
+	CHANNEL_t *ch = &m_channels[link];
+
+	switch (p_ble_evt->header.evt_id) {
+	case BLE_L2CAP_EVT_CH_SETUP_REQUEST:
+		setup_request(link, p_evt);
+		break;
+
+	case BLE_L2CAP_EVT_CH_SETUP:
+		if (p_evt->local_cid == ch->cid) {
+			ch->tx_mtu = p_evt->params.ch_setup.tx_params.tx_mtu;
+			if (ch->tx_mtu > L2CAP_COC_MTU) {
+				ch->tx_mtu = L2CAP_COC_MTU;
+			}
+
+			// Data that waited for NUS can go over the channel now
+			if (m_tx_func) {
+				m_tx_func();
+			}
+		}
+		break;
+
+	case BLE_L2CAP_EVT_CH_RELEASED:
+		if (p_evt->local_cid == ch->cid) {
+			l2cap_coc_reset(link);
+
+			// The rest goes over NUS again
+			if (m_tx_func) {
+				m_tx_func();
+			}
+		}
+		break;
+
+	case BLE_L2CAP_EVT_CH_RX:
+		if (p_evt->local_cid == ch->cid) {
+			if (m_rx_func) {
+				m_rx_func(link, p_evt->params.rx.sdu_buf.p_data, p_evt->params.rx.sdu_len);
+			}
+
+			ble_data_t sdu_buf = {ch->rx_buf, sizeof(ch->rx_buf)};
+			sd_ble_l2cap_ch_rx(ch->conn_handle, ch->cid, &sdu_buf);
+		}
+		break;
+
+	case BLE_L2CAP_EVT_CH_TX:
+		if (p_evt->local_cid == ch->cid && ch->tx_pending > 0) {
+			ch->tx_pending--;
+			if (m_tx_func) {
+				m_tx_func();
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/**
+ * Forget the channel of a link. Call on connect and disconnect.
+ */
+void l2cap_coc_reset(int link) {
+	CHANNEL_t *ch = &m_channels[link];
+
+	ch->conn_handle = BLE_CONN_HANDLE_INVALID;
+	ch->cid = BLE_L2CAP_CID_INVALID;
+	ch->tx_mtu = 0;
+	ch->tx_head = 0;
+	ch->tx_pending = 0;
+}
+
+/**
+ * @return
+ * The largest SDU that can be sent to the peer, or 0 if no channel is open.
+ */
+uint16_t l2cap_coc_mtu(int link) {
+	return m_channels[link].tx_mtu;
+}
+
+/**
+ * Get a buffer to put the next SDU in.
+ *
+ * @param max_len
+ * Set to the size of the SDU that fits.
+ *
+ * @return
+ * The buffer, or 0 if no channel is open or the SoftDevice queue is full.
+ */
+uint8_t *l2cap_coc_tx_buf(int link, uint16_t *max_len) {
+	CHANNEL_t *ch = &m_channels[link];
+
+	if (ch->tx_mtu == 0 || ch->tx_pending >= L2CAP_COC_TX_QUEUE) {
+		return 0;
+	}
+
+	*max_len = ch->tx_mtu;
+	return ch->tx_buf[ch->tx_head];
+}
+
+/**
+ * Send the SDU that was put in the buffer from l2cap_coc_tx_buf.
+ *
+ * @param len
+ * The length of the SDU.
+ */
+void l2cap_coc_send(int link, uint16_t len) {
+	CHANNEL_t *ch = &m_channels[link];
+	ble_data_t sdu_buf = {ch->tx_buf[ch->tx_head], len};
+
+	// Counted before the SoftDevice can report the SDU as sent
+	CRITICAL_REGION_ENTER();
+	ch->tx_pending++;
+	CRITICAL_REGION_EXIT();
+
+	if (sd_ble_l2cap_ch_tx(ch->conn_handle, ch->cid, &sdu_buf) == NRF_SUCCESS) {
+		// SDUs are sent in order, so the oldest buffer is always freed first
+		ch->tx_head = (ch->tx_head + 1) % L2CAP_COC_TX_QUEUE;
+	} else {
+		CRITICAL_REGION_ENTER();
+		if (ch->tx_pending > 0) {
+			ch->tx_pending--;
+		}
+		CRITICAL_REGION_EXIT();
+	}
+}
+
+static void setup_request(int link, ble_l2cap_evt_t const *p_evt) {
+	CHANNEL_t *ch = &m_channels[link];
+	ble_l2cap_ch_setup_params_t params;
+	memset(&params, 0, sizeof(params));
+
+	uint16_t cid = p_evt->local_cid;
+
+	if (p_evt->params.ch_setup_request.le_psm != L2CAP_COC_PSM) {
+		params.status = BLE_L2CAP_CH_STATUS_CODE_LE_PSM_NOT_SUPPORTED;
+		sd_ble_l2cap_ch_setup(p_evt->conn_handle, &cid, &params);
+		return;
+	}
+
+	// One channel per link
+	if (ch->cid != BLE_L2CAP_CID_INVALID) {
+		params.status = BLE_L2CAP_CH_STATUS_CODE_NO_RESOURCES;
+		sd_ble_l2cap_ch_setup(p_evt->conn_handle, &cid, &params);
+		return;
+	}
+
+	// Enough credits for a whole SDU for every receive buffer, so that the
+	// peer never waits for us in the middle of one.
+	sd_ble_l2cap_ch_flow_control(p_evt->conn_handle, BLE_L2CAP_CID_INVALID, CREDITS, NULL);
+
+	params.status = BLE_L2CAP_CH_STATUS_CODE_SUCCESS;
+	params.rx_params.rx_mtu = L2CAP_COC_MTU;
+	params.rx_params.rx_mps = L2CAP_COC_MPS;
+	params.rx_params.sdu_buf.p_data = ch->rx_buf;
+	params.rx_params.sdu_buf.len = sizeof(ch->rx_buf);
+
+	if (sd_ble_l2cap_ch_setup(p_evt->conn_handle, &cid, &params) == NRF_SUCCESS) {
+		ch->conn_handle = p_evt->conn_handle;
+		ch->cid = cid;
+		ch->tx_head = 0;
+		ch->tx_pending = 0;
+	}
+}
@@ -0,0 +1,51 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef L2CAP_COC_H_
+#define L2CAP_COC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble.h"
+
+// Settings
+#ifndef L2CAP_COC_LINKS
+#define L2CAP_COC_LINKS				NRF_SDH_BLE_PERIPHERAL_LINK_COUNT
+#endif
+
+#define L2CAP_COC_PSM				0x0080	// Dynamic LE PSM the channel is opened on
+#define L2CAP_COC_PSM_UUID			0x0004	// PSM characteristic in the NUS service, after RX and TX
+#ifdef NRF52840_XXAA
+#define L2CAP_COC_MTU				2048	// Largest SDU in either direction
+#else
+#define L2CAP_COC_MTU				512
+#endif
+#define L2CAP_COC_MPS				(NRF_SDH_BLE_GAP_DATA_LENGTH - 4)	// One PDU per link layer packet
+#define L2CAP_COC_TX_QUEUE			2		// SDUs handed to the SoftDevice at a time
+
+// Functions
+void l2cap_coc_init(void (*rx_func)(int link, const uint8_t *data, uint16_t len),
+		void (*tx_func)(void));
+uint32_t l2cap_coc_cfg_set(uint8_t conn_cfg_tag, uint32_t ram_start);
+uint32_t l2cap_coc_char_add(uint16_t service_handle, uint8_t uuid_type);
+void l2cap_coc_on_ble_evt(int link, ble_evt_t const *p_ble_evt);
+void l2cap_coc_reset(int link);
+uint16_t l2cap_coc_mtu(int link);
+uint8_t *l2cap_coc_tx_buf(int link, uint16_t *max_len);
+void l2cap_coc_send(int link, uint16_t len);
+
+#endif /* L2CAP_COC_H_ */
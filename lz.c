@@ -0,0 +1,265 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Small LZ77 codec producing the LZ4 block format, so that clients can use any
+ * LZ4 library to decode and encode.
+ *
+ * Each sequence is a token byte with the number of literals in the upper
+ * nibble and the match length - 4 in the lower nibble, where 15 means that
+ * more length bytes follow (added up until one is not 255). The token is
+ * followed by the literals and a little-endian 16-bit match offset. The last
+ * sequence only has literals. As the format requires, the last five bytes are
+ * always literals and no match starts in the last 12 bytes.
+ *
+ * The compressor uses a hash table of recent positions from the caller and no
+ * other memory, the decompressor none at all. Both can run in several contexts
+ * at a time, as long as each uses its own LZ_STATE_t.
+ */
+
+#include "lz.h"
+
+#include <string.h>
+
+#define MIN_MATCH		4
+#define LAST_LITERALS	5
+#define MF_LIMIT		12
+#define HASH_SIZE		(1 << LZ_HASH_BITS)
+
+// Private functions
+static int put_length(uint8_t *out, unsigned int *op, unsigned int out_max, unsigned int len);
+
+static inline uint32_t read32(const uint8_t *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline unsigned int hash(uint32_t seq) {
+	return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Compress a buffer.
+ *
+ * @param state
+ * Match finder table, not used by anyone else during the call.
+ *
+ * @param in
+ * The data to compress. At most 65535 bytes.
+ *
+ * @param out
+ * The compressed data.
+ *
+ * @param out_max
+ * Size of out.
+ *
+ * @return
+ * The length of the compressed data, or -1 if it did not fit in out.
+ */
+int lz_compress(LZ_STATE_t *state, const uint8_t *in, unsigned int in_len, uint8_t *out, unsigned int out_max) {
+	uint16_t *table = state->hash;
+	unsigned int ip = 0;
+	unsigned int anchor = 0;
+	unsigned int op = 0;
+
+	// Positions are stored + 1 so that 0 means empty
+	memset(table, 0, sizeof(state->hash));
+
+	if (in_len > 65535) {
+		return -1;
+	}
+
+	while (in_len >= MF_LIMIT && ip < in_len - MF_LIMIT) {
+		uint32_t seq = read32(in + ip);
+		unsigned int h = hash(seq);
+		unsigned int ref = table[h];
+		table[h] = ip + 1;
+
+		if (ref == 0 || read32(in + ref - 1) != seq) {
+			ip++;
+			continue;
+		}
+		ref--;
+
+		unsigned int match_len = MIN_MATCH;
+		while (ip + match_len < in_len - LAST_LITERALS &&
+				in[ref + match_len] == in[ip + match_len]) {
+			match_len++;
+		}
+
+		unsigned int lit_len = ip - anchor;
+		unsigned int token_pos = op;
+		unsigned int offset = ip - ref;
+
+		if (op >= out_max) {
+			return -1;
+		}
+		op++;
+
+		if (put_length(out, &op, out_max, lit_len) < 0 || out_max - op < lit_len + 2) {
+			return -1;
+		}
+
+		memcpy(out + op, in + anchor, lit_len);
+		op += lit_len;
+		out[op++] = offset;
+		out[op++] = offset >> 8;
+
+		if (put_length(out, &op, out_max, match_len - MIN_MATCH) < 0) {
+			return -1;
+		}
+
+		out[token_pos] = (lit_len < 15 ? lit_len : 15) << 4 |
+				(match_len - MIN_MATCH < 15 ? match_len - MIN_MATCH : 15);
+
+		ip += match_len;
+		anchor = ip;
+
+		// Index a position inside the match as well, this finds the next
+		// repetition of a structure more often.
+		if (ip - 2 < in_len - MF_LIMIT) {
+			table[hash(read32(in + ip - 2))] = ip - 2 + 1;
+		}
+	}
+
+	// Last literals
+	unsigned int lit_len = in_len - anchor;
+
+	if (op >= out_max) {
+		return -1;
+	}
+
+	out[op++] = (lit_len < 15 ? lit_len : 15) << 4;
+
+	if (put_length(out, &op, out_max, lit_len) < 0 || out_max - op < lit_len) {
+		return -1;
+	}
+
+	memcpy(out + op, in + anchor, lit_len);
+	op += lit_len;
+
+	return op;
+}
+
+/**
+ * Decompress a buffer. Corrupt input is detected as far as it would lead
+ * outside of the buffers.
+ *
+ * @param in
+ * The compressed data.
+ *
+ * @param out
+ * The decompressed data.
+ *
+ * @param out_max
+ * Size of out.
+ *
+ * @return
+ * The length of the decompressed data, or -1 if the input is corrupt or does
+ * not fit in out.
+ */
+int lz_decompress(const uint8_t *in, unsigned int in_len, uint8_t *out, unsigned int out_max) {
+	unsigned int ip = 0;
+	unsigned int op = 0;
+
+	while (ip < in_len) {
+		uint8_t token = in[ip++];
+		unsigned int lit_len = token >> 4;
+
+		if (lit_len == 15) {
+			uint8_t b;
+			do {
+				if (ip >= in_len) {
+					return -1;
+				}
+				b = in[ip++];
+				lit_len += b;
+			} while (b == 255);
+		}
+
+		if (lit_len > in_len - ip || lit_len > out_max - op) {
+			return -1;
+		}
+
+		memcpy(out + op, in + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		if (ip == in_len) {
+			break;
+		}
+
+		if (in_len - ip < 2) {
+			return -1;
+		}
+
+		unsigned int offset = in[ip] | in[ip + 1] << 8;
+		ip += 2;
+
+		if (offset == 0 || offset > op) {
+			return -1;
+		}
+
+		unsigned int match_len = token & 0x0F;
+
+		if (match_len == 15) {
+			uint8_t b;
+			do {
+				if (ip >= in_len) {
+					return -1;
+				}
+				b = in[ip++];
+				match_len += b;
+			} while (b == 255);
+		}
+
+		match_len += MIN_MATCH;
+
+		if (match_len > out_max - op) {
+			return -1;
+		}
+
+		// Byte by byte, the match may overlap what it produces
+		for (unsigned int i = 0;i < match_len;i++) {
+			out[op] = out[op - offset];
+			op++;
+		}
+	}
+
+	return op;
+}
+
+static int put_length(uint8_t *out, unsigned int *op, unsigned int out_max, unsigned int len) {
+	if (len < 15) {
+		return 0;
+	}
+
+	len -= 15;
+
+	for (;;) {
+		if (*op >= out_max) {
+			return -1;
+		}
+
+		if (len >= 255) {
+			out[(*op)++] = 255;
+			len -= 255;
+		} else {
+			out[(*op)++] = len;
+			return 0;
+		}
+	}
+}
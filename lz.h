@@ -0,0 +1,37 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef LZ_H_
+#define LZ_H_
+
+#include <stdint.h>
+
+// Settings
+#ifndef LZ_HASH_BITS
+#define LZ_HASH_BITS			9		// Match finder table size, 2 bytes per entry
+#endif
+
+// Types
+typedef struct {
+	uint16_t hash[1 << LZ_HASH_BITS];
+} LZ_STATE_t;
+
+// Functions
+int lz_compress(LZ_STATE_t *state, const uint8_t *in, unsigned int in_len, uint8_t *out, unsigned int out_max);
+int lz_decompress(const uint8_t *in, unsigned int in_len, uint8_t *out, unsigned int out_max);
+
+#endif /* LZ_H_ */
@@ -34,7 +34,7 @@
 #include "nrf_ble_qwr.h"
 #include "app_timer.h"
 #include "ble_nus.h"
-#include "app_uart.h"
+#include "app_fifo.h"
 #include "app_util_platform.h"
 #include "nrf_pwr_mgmt.h"
 #include "bsp_btn_ble.h"
@@ -58,11 +58,16 @@
 #include "boards.h"
 #endif
 
-#include "packet.h"
-#include "buffer.h"
-#include "datatypes.h"
+#include "bridge.h"
 #include "esb_timeslot.h"
-#include "crc.h"
+#include "uart_dma.h"
+#include "conn_adapt.h"
+#include "l2cap_coc.h"
+#include "isr_stats.h"
+#include "trace.h"
+#if TRACE
+#include "SEGGER_RTT.h"
+#endif
 
 #ifndef MODULE_BUILTIN
 #define MODULE_BUILTIN					0
@@ -92,6 +97,11 @@
 #define MAX_CONN_INTERVAL               MSEC_TO_UNITS(20, UNIT_1_25_MS)             /**< Maximum acceptable connection interval (75 ms), Connection interval uses 1.25 ms units. */
 #define SLAVE_LATENCY                   0                                           /**< Slave latency. */
 #define CONN_SUP_TIMEOUT                MSEC_TO_UNITS(4000, UNIT_10_MS)             /**< Connection supervisory timeout (4 seconds), Supervision Timeout uses 10 ms units. */
+#define BUSY_MIN_CONN_INTERVAL          MSEC_TO_UNITS(7.5, UNIT_1_25_MS)            /**< Minimum connection interval while there is a lot of traffic. */
+#define BUSY_MAX_CONN_INTERVAL          MSEC_TO_UNITS(15, UNIT_1_25_MS)             /**< Maximum connection interval while there is a lot of traffic. */
+#define IDLE_MIN_CONN_INTERVAL          MSEC_TO_UNITS(50, UNIT_1_25_MS)             /**< Minimum connection interval while there is no traffic. */
+#define IDLE_MAX_CONN_INTERVAL          MSEC_TO_UNITS(100, UNIT_1_25_MS)            /**< Maximum connection interval while there is no traffic. */
+#define IDLE_SLAVE_LATENCY              2                                           /**< Slave latency while there is no traffic. */
 #define FIRST_CONN_PARAMS_UPDATE_DELAY  APP_TIMER_TICKS(5000)                       /**< Time from initiating event (connect or start of notification) to first time sd_ble_gap_conn_param_update is called (5 seconds). */
 #define NEXT_CONN_PARAMS_UPDATE_DELAY   APP_TIMER_TICKS(30000)                      /**< Time between each call to sd_ble_gap_conn_param_update after the first call (30 seconds). */
 #define MAX_CONN_PARAMS_UPDATE_COUNT    3                                           /**< Number of attempts before giving up the connection parameter negotiation. */
@@ -99,15 +109,25 @@
 #define DEAD_BEEF                       0xDEADBEEF                                  /**< Value used as error code on stack dump, can be used to identify stack location on stack unwind. */
 
 #ifdef NRF52840_XXAA
-#define UART_TX_BUF_SIZE                2048
-#define UART_RX_BUF_SIZE                32768
+#define BLE_TX_BUF_SIZE                 8192                                        /**< Outgoing notification queue size, must be a power of two. */
+#define USB_RX_BUF_SIZE                 4096                                        /**< Must be a power of two. */
+#define USB_TX_BUF_SIZE                 8192                                        /**< Must be a power of two. */
+#define USB_TX_CHUNK_SIZE               1024                                        /**< Largest single CDC ACM write. */
 #else
-#define UART_TX_BUF_SIZE                2048
-#define UART_RX_BUF_SIZE                8192
+#define BLE_TX_BUF_SIZE                 4096                                        /**< Outgoing notification queue size, must be a power of two. */
+#endif
+
+#ifndef BLE_TX_COALESCE_US
+#define BLE_TX_COALESCE_US              1000                                        /**< Longest time a partly filled notification is held back waiting for more data. */
 #endif
+#define BLE_TX_COALESCE_TICKS           MAX(APP_TIMER_MIN_TIMEOUT_TICKS, \
+		(uint32_t)(((uint64_t)BLE_TX_COALESCE_US * APP_TIMER_CLOCK_FREQ) / \
+		((APP_TIMER_CONFIG_RTC_FREQUENCY + 1) * 1000000ULL)))
 
-#define PACKET_VESC						0
-#define PACKET_BLE						1
+#if UART_DMA_PRIO_HIGH != HAL_UART_PRIO_HIGH || UART_DMA_PRIO_NORMAL != HAL_UART_PRIO_NORMAL || \
+	UART_DMA_PRIO_NUM != HAL_UART_PRIO_NUM || UART_DMA_HIST_BINS != HAL_UART_HIST_BINS
+#error "The UART priorities and histograms of uart_dma.h and hal.h differ"
+#endif
 
 #ifdef NRF52840_XXAA																/**< nrf52840 dongle (PCA10059). */
 #define UART_RX							31
@@ -135,41 +155,59 @@
 
 // Private variables
 APP_TIMER_DEF(m_packet_timer);
-APP_TIMER_DEF(m_nrf_timer);
+APP_TIMER_DEF(m_ble_tx_timer);
 
 BLE_NUS_DEF(m_nus, NRF_SDH_BLE_TOTAL_LINK_COUNT);                                   /**< BLE NUS service instance. */
 NRF_BLE_GATT_DEF(m_gatt);                                                           /**< GATT module instance. */
-NRF_BLE_QWR_DEF(m_qwr);                                                             /**< Context for the Queued Write module.*/
+NRF_BLE_QWRS_DEF(m_qwr, NRF_SDH_BLE_TOTAL_LINK_COUNT);                              /**< Context for the Queued Write module, one per link.*/
 BLE_ADVERTISING_DEF(m_advertising);                                                 /**< Advertising module instance. */
 
-static uint16_t   m_conn_handle          = BLE_CONN_HANDLE_INVALID;                 /**< Handle of the current connection. */
-static uint16_t   m_ble_nus_max_data_len = BLE_GATT_ATT_MTU_DEFAULT - 3;            /**< Maximum length of data (in bytes) that can be transmitted to the peer by the Nordic UART service module. */
 static ble_uuid_t m_adv_uuids[]          =                                          /**< Universally unique service identifier. */
 {
 		{BLE_UUID_NUS_SERVICE, NUS_SERVICE_UUID_TYPE}
 };
-static bool								m_is_enabled = true;
-static bool								m_uart_error = false;
-static int								m_other_comm_disable_time = 0;
 
-app_uart_comm_params_t m_uart_comm_params =
-{
-		.rx_pin_no    = UART_RX,
-		.tx_pin_no    = UART_TX,
-		.rts_pin_no   = 0,
-		.cts_pin_no   = 0,
-		.flow_control = APP_UART_FLOW_CONTROL_DISABLED,
-		.use_parity   = false,
-#if defined (UART_PRESENT)
-		.baud_rate    = NRF_UART_BAUDRATE_115200
-#else
-		.baud_rate    = NRF_UARTE_BAUDRATE_115200
+// State of one BLE connection. Outgoing data is queued in tx_fifo and sent as
+// notifications whenever the SoftDevice has room, see ble_tx_drain.
+// Consecutive packets are packed into notifications of up to nus_max_data_len
+// bytes.
+typedef struct {
+	uint16_t conn_handle;
+	uint16_t nus_max_data_len;					// Maximum notification payload for the MTU of the link
+	app_fifo_t tx_fifo;
+	uint8_t tx_fifo_buf[BLE_TX_BUF_SIZE];
+	uint8_t tx_chunk[BLE_NUS_MAX_DATA_LEN];
+	uint16_t tx_chunk_len;
+	bool tx_busy;								// A context is draining the link, see ble_tx_drain_link
+	bool tx_again;								// Drain again when done, data came in meanwhile
+	bool tx_again_flush;
+	uint32_t tx_depth_max;
+	uint32_t tx_drops;
+	// Negotiated link parameters, reported in COMM_EXT_NRF_STATS
+	uint8_t tx_phy;
+	uint8_t rx_phy;
+	uint16_t tx_octets;
+	uint16_t rx_octets;
+	uint16_t conn_interval;
+	uint16_t slave_latency;
+} BLE_LINK_t;
+
+static BLE_LINK_t						m_links[BLE_LINKS];
+static int								m_links_used = 0;
+static int								m_ble_tx_next = 0;
+static bool								m_ble_tx_timer_running = false;
+static volatile bool					m_l2cap_tx_due = false;		// See l2cap_tx_handler
+
+static uint32_t							m_uart_tx_pin = UART_TX;
+static uint32_t							m_uart_baudrate = NRF_UARTE_BAUDRATE_115200;
+#if TRACE
+static uint8_t							m_trace_rtt_buf[TRACE_RECORDS * TRACE_RECORD_LEN];
 #endif
-};
 
 // Functions
-void ble_printf(const char* format, ...);
-static void set_enabled(bool en);
+static void ble_tx_drain(bool flush);
+static void ble_tx_flush(int link);
+static int ble_link_find(uint16_t conn_handle);
 
 #ifdef NRF52840_XXAA
 static void cdc_acm_user_ev_handler(app_usbd_class_inst_t const * p_inst,
@@ -195,34 +233,142 @@ APP_USBD_CDC_ACM_GLOBAL_DEF(m_app_cdc_acm,
 		APP_USBD_CDC_COMM_PROTOCOL_NONE
 );
 
+// Received USB data is stored in m_usb_rx_fifo and decoded from the main
+// loop. When the FIFO is full no new read is started, so that the host is
+// NAKed instead of data being lost. Outgoing data is queued in
+// m_usb_tx_fifo and written in chunks of up to USB_TX_CHUNK_SIZE bytes,
+// with the next write started on TX_DONE. All CDC ACM calls are made from
+// the main loop, as app_usbd is not reentrant.
+static app_fifo_t						m_usb_rx_fifo;
+static uint8_t							m_usb_rx_fifo_buf[USB_RX_BUF_SIZE];
+static uint8_t							m_usb_rx_chunk[NRF_DRV_USBD_EPSIZE];
+static bool								m_usb_rx_armed = false;
+static app_fifo_t						m_usb_tx_fifo;
+static uint8_t							m_usb_tx_fifo_buf[USB_TX_BUF_SIZE];
+static uint8_t							m_usb_tx_chunk[USB_TX_CHUNK_SIZE];
+static bool								m_usb_tx_busy = false;
+static volatile bool					m_usb_port_open = false;
+static uint32_t							m_usb_tx_drops = 0;
+
+static void usb_rx_store(void) {
+	uint32_t len = app_usbd_cdc_acm_rx_size(&m_app_cdc_acm);
+	app_fifo_write(&m_usb_rx_fifo, m_usb_rx_chunk, &len);
+}
+
+static void usb_rx_start(void) {
+	while (m_usb_port_open && !m_usb_rx_armed) {
+		uint32_t free_space = 0;
+		app_fifo_write(&m_usb_rx_fifo, NULL, &free_space);
+		if (free_space < sizeof(m_usb_rx_chunk)) {
+			break;
+		}
+
+		ret_code_t ret = app_usbd_cdc_acm_read_any(&m_app_cdc_acm,
+				m_usb_rx_chunk, sizeof(m_usb_rx_chunk));
+
+		if (ret == NRF_SUCCESS) {
+			// Data was already buffered by the class
+			usb_rx_store();
+		} else if (ret == NRF_ERROR_IO_PENDING) {
+			m_usb_rx_armed = true;
+		} else {
+			break;
+		}
+	}
+}
+
+static void usb_tx_start(void) {
+	if (m_usb_tx_busy || !m_usb_port_open) {
+		return;
+	}
+
+	uint32_t len = sizeof(m_usb_tx_chunk);
+	CRITICAL_REGION_ENTER();
+	if (app_fifo_read(&m_usb_tx_fifo, m_usb_tx_chunk, &len) != NRF_SUCCESS) {
+		len = 0;
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (len > 0 && app_usbd_cdc_acm_write(&m_app_cdc_acm, m_usb_tx_chunk, len) == NRF_SUCCESS) {
+		m_usb_tx_busy = true;
+	}
+}
+
+bool hal_usb_connected(void) {
+	return m_usb_port_open;
+}
+
+void hal_usb_send(const packet_segment *segs, int seg_num) {
+	if (!m_usb_port_open) {
+		return;
+	}
+
+	uint32_t len_tot = 0;
+	for (int i = 0;i < seg_num;i++) {
+		len_tot += segs[i].len;
+	}
+
+	CRITICAL_REGION_ENTER();
+	uint32_t free_space = 0;
+	app_fifo_write(&m_usb_tx_fifo, NULL, &free_space);
+
+	if (free_space < len_tot) {
+		m_usb_tx_drops++;
+	} else {
+		for (int i = 0;i < seg_num;i++) {
+			uint32_t len = segs[i].len;
+			app_fifo_write(&m_usb_tx_fifo, segs[i].data, &len);
+		}
+	}
+	CRITICAL_REGION_EXIT();
+}
+
 static void cdc_acm_user_ev_handler(app_usbd_class_inst_t const * p_inst, app_usbd_cdc_acm_user_event_t event) {
+	(void)p_inst;
+
 	switch (event) {
-	case APP_USBD_CDC_ACM_USER_EVT_PORT_OPEN: {
-//		nrf_gpio_pin_set(LED_PIN);
-		// Setup first transfer
-		char rx;
-		app_usbd_cdc_acm_read(&m_app_cdc_acm, &rx, 1);
+	case APP_USBD_CDC_ACM_USER_EVT_PORT_OPEN:
+		bridge_usb_connected();
+		CRITICAL_REGION_ENTER();
+		app_fifo_flush(&m_usb_rx_fifo);
+		app_fifo_flush(&m_usb_tx_fifo);
+		m_usb_port_open = true;
+		CRITICAL_REGION_EXIT();
+		m_usb_rx_armed = false;
+		m_usb_tx_busy = false;
+		usb_rx_start();
 		break;
-	}
 	case APP_USBD_CDC_ACM_USER_EVT_PORT_CLOSE:
-//		nrf_gpio_pin_clear(LED_PIN);
+		m_usb_port_open = false;
+		bridge_usb_disconnected();
 		break;
 	case APP_USBD_CDC_ACM_USER_EVT_TX_DONE:
+		m_usb_tx_busy = false;
+		usb_tx_start();
 		break;
-	case APP_USBD_CDC_ACM_USER_EVT_RX_DONE: {
-		ret_code_t ret;
-		char rx;
-
-		do {
-			ret = app_usbd_cdc_acm_read(&m_app_cdc_acm, &rx, 1);
-		} while (ret == NRF_SUCCESS);
+	case APP_USBD_CDC_ACM_USER_EVT_RX_DONE:
+		m_usb_rx_armed = false;
+		usb_rx_store();
+		usb_rx_start();
 		break;
-	}
 	default:
 		break;
 	}
 }
 
+static void usb_process(void) {
+	uint8_t buffer[64];
+	uint32_t len = sizeof(buffer);
+
+	while (app_fifo_read(&m_usb_rx_fifo, buffer, &len) == NRF_SUCCESS) {
+		bridge_usb_rx(buffer, len);
+		len = sizeof(buffer);
+	}
+
+	usb_rx_start();
+	usb_tx_start();
+}
+
 static void usbd_user_ev_handler(app_usbd_event_type_t event) {
 	switch (event) {
 	case APP_USBD_EVT_DRV_SUSPEND:
@@ -297,6 +443,36 @@ static void start_advertising(void) {
 	bsp_board_led_on(POWER_LED);
 }
 
+/**
+ * @return
+ * The link with a connection handle, or -1 if there is none. With
+ * BLE_CONN_HANDLE_INVALID a free link is returned.
+ */
+static int ble_link_find(uint16_t conn_handle) {
+	for (int i = 0;i < BLE_LINKS;i++) {
+		if (m_links[i].conn_handle == conn_handle) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static void ble_link_reset(int link) {
+	BLE_LINK_t *l = &m_links[link];
+
+	l->conn_handle = BLE_CONN_HANDLE_INVALID;
+	l->nus_max_data_len = BLE_GATT_ATT_MTU_DEFAULT - 3;
+	l->tx_phy = BLE_GAP_PHY_1MBPS;
+	l->rx_phy = BLE_GAP_PHY_1MBPS;
+	l->tx_octets = BLE_GAP_DATA_LENGTH_DEFAULT;
+	l->rx_octets = BLE_GAP_DATA_LENGTH_DEFAULT;
+	l->conn_interval = 0;
+	l->slave_latency = 0;
+	l2cap_coc_reset(link);
+	ble_tx_flush(link);
+}
+
 
 /**@brief Function for handling Queued Write Module errors.
  *
@@ -312,8 +488,9 @@ static void nrf_qwr_error_handler(uint32_t nrf_error)
 
 static void nus_data_handler(ble_nus_evt_t * p_evt) {
 	if (p_evt->type == BLE_NUS_EVT_RX_DATA) {
-		for (uint32_t i = 0; i < p_evt->params.rx_data.length; i++) {
-			packet_process_byte(p_evt->params.rx_data.p_data[i], PACKET_BLE);
+		int link = ble_link_find(p_evt->conn_handle);
+		if (link >= 0) {
+			bridge_ble_rx(link, p_evt->params.rx_data.p_data, p_evt->params.rx_data.length);
 		}
 	}
 
@@ -327,8 +504,10 @@ static void services_init(void) {
 	// Initialize Queued Write Module.
 	qwr_init.error_handler = nrf_qwr_error_handler;
 
-	err_code = nrf_ble_qwr_init(&m_qwr, &qwr_init);
-	APP_ERROR_CHECK(err_code);
+	for (int i = 0;i < NRF_SDH_BLE_TOTAL_LINK_COUNT;i++) {
+		err_code = nrf_ble_qwr_init(&m_qwr[i], &qwr_init);
+		APP_ERROR_CHECK(err_code);
+	}
 
 	// Initialize NUS.
 	memset(&nus_init, 0, sizeof(nus_init));
@@ -337,6 +516,10 @@ static void services_init(void) {
 
 	err_code = ble_nus_init(&m_nus, &nus_init);
 	APP_ERROR_CHECK(err_code);
+
+	// Tells clients where to open the L2CAP channel
+	err_code = l2cap_coc_char_add(m_nus.service_handle, m_nus.uuid_type);
+	APP_ERROR_CHECK(err_code);
 }
 
 /**@brief Function for handling errors from the Connection Parameters module.
@@ -360,7 +543,7 @@ static void conn_params_init(void) {
 	cp_init.next_conn_params_update_delay  = NEXT_CONN_PARAMS_UPDATE_DELAY;
 	cp_init.max_conn_params_update_count   = MAX_CONN_PARAMS_UPDATE_COUNT;
 	cp_init.start_on_notify_cccd_handle    = BLE_GATT_HANDLE_INVALID;
-	cp_init.disconnect_on_fail             = true;
+	cp_init.disconnect_on_fail             = false;
 	cp_init.evt_handler                    = NULL;
 	cp_init.error_handler                  = conn_params_error_handler;
 
@@ -368,6 +551,56 @@ static void conn_params_init(void) {
 	APP_ERROR_CHECK(err_code);
 }
 
+/**@brief Function for requesting connection parameters that suit the traffic.
+ *
+ * @details Called by conn_adapt when the link changes between busy, normal and idle.
+ *          Radio time that an idle link does not use is picked up by the ESB
+ *          timeslots, as they keep extending for as long as the SoftDevice allows.
+ *
+ * @param[in] link   The link that changed.
+ * @param[in] state  The new state of the link.
+ */
+static void conn_adapt_apply(int link, CONN_ADAPT_STATE state) {
+	if (m_links[link].conn_handle == BLE_CONN_HANDLE_INVALID) {
+		return;
+	}
+
+	ble_gap_conn_params_t params;
+	memset(&params, 0, sizeof(params));
+	params.conn_sup_timeout = CONN_SUP_TIMEOUT;
+
+	switch (state) {
+	case CONN_ADAPT_BUSY:
+		params.min_conn_interval = BUSY_MIN_CONN_INTERVAL;
+		params.max_conn_interval = BUSY_MAX_CONN_INTERVAL;
+		params.slave_latency = 0;
+		break;
+
+	case CONN_ADAPT_IDLE:
+		params.min_conn_interval = IDLE_MIN_CONN_INTERVAL;
+		params.max_conn_interval = IDLE_MAX_CONN_INTERVAL;
+		params.slave_latency = IDLE_SLAVE_LATENCY;
+		break;
+
+	default:
+		params.min_conn_interval = MIN_CONN_INTERVAL;
+		params.max_conn_interval = MAX_CONN_INTERVAL;
+		params.slave_latency = SLAVE_LATENCY;
+		break;
+	}
+
+	// Let connection events run on for as long as there is data, but only
+	// when there is a lot of it. This is a SoftDevice wide option, and the
+	// extension only uses time that no other link is scheduled in.
+	ble_opt_t opt;
+	memset(&opt, 0, sizeof(opt));
+	opt.common_opt.conn_evt_ext.enable = conn_adapt_any_busy();
+	sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt);
+
+	// The central may refuse, in which case we just keep what we have.
+	ble_conn_params_change_conn_params(m_links[link].conn_handle, &params);
+}
+
 /**@brief Function for handling advertising events.
  *
  * @details This function will be called for advertising events which are passed to the application.
@@ -396,20 +629,70 @@ static void on_adv_evt(ble_adv_evt_t ble_adv_evt) {
  */
 static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context) {
 	switch (p_ble_evt->header.evt_id) {
-	case BLE_GAP_EVT_CONNECTED:
+	case BLE_GAP_EVT_CONNECTED: {
+		uint16_t conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+		int link = ble_link_find(BLE_CONN_HANDLE_INVALID);
+
+		if (link < 0) {
+			// More links than configured, should not happen
+			sd_ble_gap_disconnect(conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+			break;
+		}
+
 		//nrf_gpio_pin_set(LED_PIN);
 		bsp_board_led_on(CONNECTED_LED);
-        bsp_board_led_off(ADVERTISING_LED);
-		m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
-		nrf_ble_qwr_conn_handle_assign(&m_qwr, m_conn_handle);
-		sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_CONN, m_conn_handle, 8);
-		break;
+		ble_link_reset(link);
+		m_links[link].conn_handle = conn_handle;
+		m_links[link].conn_interval = p_ble_evt->evt.gap_evt.params.connected.conn_params.max_conn_interval;
+		m_links[link].slave_latency = p_ble_evt->evt.gap_evt.params.connected.conn_params.slave_latency;
+		nrf_ble_qwr_conn_handle_assign(&m_qwr[link], conn_handle);
+		bridge_ble_connected(link);
+		sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_CONN, conn_handle, 8);
+
+		// Do not wait for the peer to upgrade the link. The ATT MTU exchange
+		// and the data length update are started by nrf_ble_gatt.
+		ble_gap_phys_t const phys =
+		{
+				.rx_phys = BLE_GAP_PHY_2MBPS,
+				.tx_phys = BLE_GAP_PHY_2MBPS,
+		};
+		sd_ble_gap_phy_update(conn_handle, &phys);
+
+		// Advertising stops on every connection, keep it going while there
+		// are free links.
+		if (++m_links_used < BLE_LINKS) {
+			start_advertising();
+		} else {
+			bsp_board_led_off(ADVERTISING_LED);
+		}
+	} break;
+
+	case BLE_GAP_EVT_DISCONNECTED: {
+		int link = ble_link_find(p_ble_evt->evt.gap_evt.conn_handle);
+		if (link < 0) {
+			break;
+		}
+
+		ble_link_reset(link);
+		bridge_ble_disconnected(link);
+
+		if (m_links_used-- == BLE_LINKS) {
+			start_advertising();
+		}
 
-	case BLE_GAP_EVT_DISCONNECTED:
 		//nrf_gpio_pin_clear(LED_PIN);
-		bsp_board_led_off(CONNECTED_LED);
+		if (m_links_used == 0) {
+			bsp_board_led_off(CONNECTED_LED);
+		}
 		bsp_board_led_on(ADVERTISING_LED);
-		m_conn_handle = BLE_CONN_HANDLE_INVALID;
+	} break;
+
+	case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+		TRACE_EVENT(TRACE_BLE_HVN_COMPLETE, p_ble_evt->evt.gatts_evt.params.hvn_tx_complete.count);
+
+		// The connection event is over, so there is no point in holding back
+		// partly filled notifications any longer.
+		ble_tx_drain(true);
 		break;
 
 	case BLE_GAP_EVT_PHY_UPDATE_REQUEST: {
@@ -421,14 +704,64 @@ static void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context) {
 		sd_ble_gap_phy_update(p_ble_evt->evt.gap_evt.conn_handle, &phys);
 	} break;
 
+	case BLE_GAP_EVT_PHY_UPDATE: {
+		int link = ble_link_find(p_ble_evt->evt.gap_evt.conn_handle);
+		if (link >= 0 && p_ble_evt->evt.gap_evt.params.phy_update.status == BLE_HCI_STATUS_CODE_SUCCESS) {
+			m_links[link].tx_phy = p_ble_evt->evt.gap_evt.params.phy_update.tx_phy;
+			m_links[link].rx_phy = p_ble_evt->evt.gap_evt.params.phy_update.rx_phy;
+		}
+	} break;
+
+	case BLE_GAP_EVT_DATA_LENGTH_UPDATE: {
+		int link = ble_link_find(p_ble_evt->evt.gap_evt.conn_handle);
+		if (link >= 0) {
+			m_links[link].tx_octets = p_ble_evt->evt.gap_evt.params.data_length_update.effective_params.max_tx_octets;
+			m_links[link].rx_octets = p_ble_evt->evt.gap_evt.params.data_length_update.effective_params.max_rx_octets;
+		}
+	} break;
+
+	case BLE_GAP_EVT_CONN_PARAM_UPDATE: {
+		int link = ble_link_find(p_ble_evt->evt.gap_evt.conn_handle);
+		if (link >= 0) {
+			m_links[link].conn_interval = p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.max_conn_interval;
+			m_links[link].slave_latency = p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.slave_latency;
+		}
+	} break;
+
+	case BLE_L2CAP_EVT_CH_SETUP_REQUEST:
+	case BLE_L2CAP_EVT_CH_SETUP:
+	case BLE_L2CAP_EVT_CH_RELEASED:
+	case BLE_L2CAP_EVT_CH_RX:
+	case BLE_L2CAP_EVT_CH_TX: {
+		int link = ble_link_find(p_ble_evt->evt.l2cap_evt.conn_handle);
+		if (link < 0) {
+			break;
+		}
+
+		// Received SDUs are processed like NUS data. The TX state is shared
+		// with hal_ble_send.
+		if (p_ble_evt->header.evt_id == BLE_L2CAP_EVT_CH_RX) {
+			l2cap_coc_on_ble_evt(link, p_ble_evt);
+		} else {
+			CRITICAL_REGION_ENTER();
+			l2cap_coc_on_ble_evt(link, p_ble_evt);
+			CRITICAL_REGION_EXIT();
+		}
+
+		if (m_l2cap_tx_due) {
+			m_l2cap_tx_due = false;
+			ble_tx_drain(true);
+		}
+	} break;
+
 	case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
 		// Pairing not supported
-		sd_ble_gap_sec_params_reply(m_conn_handle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL, NULL);
+		sd_ble_gap_sec_params_reply(p_ble_evt->evt.gap_evt.conn_handle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL, NULL);
 		break;
 
 	case BLE_GATTS_EVT_SYS_ATTR_MISSING:
 		// No system attributes have been stored.
-		sd_ble_gatts_sys_attr_set(m_conn_handle, NULL, 0, 0);
+		sd_ble_gatts_sys_attr_set(p_ble_evt->evt.gatts_evt.conn_handle, NULL, 0, 0);
 		break;
 
 	case BLE_GATTC_EVT_TIMEOUT:
@@ -459,6 +792,7 @@ static void ble_stack_init(void) {
 	// Fetch the start address of the application RAM.
 	uint32_t ram_start = 0;
 	nrf_sdh_ble_default_cfg_set(APP_BLE_CONN_CFG_TAG, &ram_start);
+	l2cap_coc_cfg_set(APP_BLE_CONN_CFG_TAG, ram_start);
 
 	// Enable BLE stack.
 	nrf_sdh_ble_enable(&ram_start);
@@ -468,9 +802,10 @@ static void ble_stack_init(void) {
 }
 
 void gatt_evt_handler(nrf_ble_gatt_t * p_gatt, nrf_ble_gatt_evt_t const * p_evt) {
-	if ((m_conn_handle == p_evt->conn_handle) && (p_evt->evt_id == NRF_BLE_GATT_EVT_ATT_MTU_UPDATED)) {
-		m_ble_nus_max_data_len = p_evt->params.att_mtu_effective - OPCODE_LENGTH - HANDLE_LENGTH;
-//		ble_printf("Data len is set to 0x%X(%d)", m_ble_nus_max_data_len, m_ble_nus_max_data_len);
+	int link = ble_link_find(p_evt->conn_handle);
+	if (link >= 0 && p_evt->evt_id == NRF_BLE_GATT_EVT_ATT_MTU_UPDATED) {
+		m_links[link].nus_max_data_len = p_evt->params.att_mtu_effective - OPCODE_LENGTH - HANDLE_LENGTH;
+//		ble_printf("Data len is set to 0x%X(%d)", m_links[link].nus_max_data_len, m_links[link].nus_max_data_len);
 	}
 }
 
@@ -482,42 +817,17 @@ void gatt_init(void) {
 
 	err_code = nrf_ble_gatt_att_mtu_periph_set(&m_gatt, NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
 	APP_ERROR_CHECK(err_code);
-}
-
-void uart_event_handle(app_uart_evt_t * p_event) {
-	switch (p_event->evt_type) {
-	case APP_UART_DATA_READY: {
-//		uint8_t byte;
-//		while (app_uart_get(&byte) == NRF_SUCCESS) {
-//			packet_process_byte(byte, PACKET_VESC);
-//		}
-	} break;
 
-	case APP_UART_COMMUNICATION_ERROR:
-//		APP_ERROR_HANDLER(p_event->data.error_communication);
-		m_uart_error = true;
-		break;
-
-	case APP_UART_FIFO_ERROR:
-//		APP_ERROR_HANDLER(p_event->data.error_code);
-		app_uart_flush();
-		packet_reset(PACKET_VESC);
-		break;
+	err_code = nrf_ble_gatt_data_length_set(&m_gatt, BLE_CONN_HANDLE_INVALID, NRF_SDH_BLE_GAP_DATA_LENGTH);
+	APP_ERROR_CHECK(err_code);
+}
 
-	default:
-		break;
-	}
+static void uart_rx_handler(const uint8_t *data, size_t len) {
+	bridge_uart_rx(data, len);
 }
 
 static void uart_init(void) {
-	uint32_t err_code;
-	APP_UART_FIFO_INIT(&m_uart_comm_params,
-			UART_RX_BUF_SIZE,
-			UART_TX_BUF_SIZE,
-			uart_event_handle,
-			APP_IRQ_PRIORITY_LOW,
-			err_code);
-	APP_ERROR_CHECK(err_code);
+	uart_dma_init(UART_RX, m_uart_tx_pin, m_uart_baudrate, uart_rx_handler);
 }
 
 static void advertising_init(void) {
@@ -536,6 +846,8 @@ static void advertising_init(void) {
 	init.config.ble_adv_fast_enabled  = true;
 	init.config.ble_adv_fast_interval = APP_ADV_INTERVAL;
 	init.config.ble_adv_fast_timeout  = APP_ADV_DURATION;
+	// Restarted from ble_evt_handler, which knows if there is a free link
+	init.config.ble_adv_on_disconnect_disabled = true;
 	init.evt_handler = on_adv_evt;
 
 	err_code = ble_advertising_init(&m_advertising, &init);
@@ -544,155 +856,337 @@ static void advertising_init(void) {
 	ble_advertising_conn_cfg_tag_set(&m_advertising, APP_BLE_CONN_CFG_TAG);
 }
 
-static void set_enabled(bool en) {
-	m_is_enabled = en;
-
-	if (m_is_enabled) {
-		app_uart_close();
-		m_uart_comm_params.tx_pin_no = UART_TX;
+void hal_uart_set_enabled(bool enabled) {
+	if (enabled) {
+		uart_dma_uninit();
+		m_uart_tx_pin = UART_TX;
 		uart_init();
 		nrf_gpio_cfg_default(UART_TX_DISABLED);
 	} else {
-		app_uart_close();
-		m_uart_comm_params.tx_pin_no = UART_TX_DISABLED;
+		uart_dma_uninit();
+		m_uart_tx_pin = UART_TX_DISABLED;
 		uart_init();
 		nrf_gpio_cfg_default(UART_TX);
 	}
 }
 
-static void uart_send_buffer(unsigned char *data, unsigned int len) {
-	for (int i = 0;i < len;i++) {
-		app_uart_put(data[i]);
-	}
+bool hal_uart_reserve(unsigned int len, int prio) {
+	return uart_dma_reserve(len, prio);
 }
 
-void rfhelp_send_data_crc(uint8_t *data, unsigned int len) {
-	uint8_t buffer[len + 2];
-	unsigned short crc = crc16((unsigned char*)data, len);
-	memcpy(buffer, data, len);
-	buffer[len] = (char)(crc >> 8);
-	buffer[len + 1] = (char)(crc & 0xFF);
-	esb_timeslot_set_next_packet(buffer, len + 2);
+void hal_uart_send(const packet_segment *segs, int seg_num, int prio) {
+	// Dropped packets are counted by uart_dma, see hal_uart_tx_drops
+	(void)uart_dma_send(segs, seg_num, prio);
 }
 
-static void ble_send_buffer(unsigned char *data, unsigned int len) {
-	if (m_conn_handle != BLE_CONN_HANDLE_INVALID) {
-		uint32_t err_code = NRF_SUCCESS;
-		int ind = 0;
+void hal_uart_tx_pause(bool pause) {
+	uart_dma_tx_pause(pause);
+}
 
-		while (len > 0) {
-			if (m_conn_handle == BLE_CONN_HANDLE_INVALID ||
-					(err_code != NRF_ERROR_BUSY && err_code != NRF_SUCCESS && err_code != NRF_ERROR_RESOURCES)) {
-				break;
-			}
+const uint32_t *hal_uart_tx_hist(int prio) {
+	return uart_dma_tx_hist(prio);
+}
 
-			uint16_t max_len = BLE_NUS_MAX_DATA_LEN;
-			uint16_t tmp_len = len > max_len ? max_len : len;
-			err_code = ble_nus_data_send(&m_nus, data + ind, &tmp_len, m_conn_handle);
+uint32_t hal_uart_tx_drops(int prio) {
+	return uart_dma_tx_drops(prio);
+}
 
-			if (err_code != NRF_ERROR_RESOURCES) {
-				len -= tmp_len;
-				ind += tmp_len;
-			}
-		}
+static uint32_t uart_baud_reg(uint32_t baud) {
+	switch (baud) {
+	case 115200: return NRF_UARTE_BAUDRATE_115200;
+	case 230400: return NRF_UARTE_BAUDRATE_230400;
+	case 460800: return NRF_UARTE_BAUDRATE_460800;
+	case 921600: return NRF_UARTE_BAUDRATE_921600;
+	case 1000000: return NRF_UARTE_BAUDRATE_1000000;
+	default: return 0;
 	}
 }
 
-static void process_packet_ble(unsigned char *data, unsigned int len) {
-	if (data[0] == COMM_ERASE_NEW_APP ||
-			data[0] == COMM_WRITE_NEW_APP_DATA ||
-			data[0] == COMM_ERASE_NEW_APP_ALL_CAN ||
-			data[0] == COMM_WRITE_NEW_APP_DATA_ALL_CAN) {
-		m_other_comm_disable_time = 5000;
+bool hal_uart_baud_supported(uint32_t baud) {
+	return uart_baud_reg(baud) != 0;
+}
+
+void hal_uart_set_baud(uint32_t baud) {
+	m_uart_baudrate = uart_baud_reg(baud);
+	uart_dma_set_baudrate(m_uart_baudrate);
+}
+
+void hal_esb_set_ch_addr(uint8_t ch, uint8_t b0, uint8_t b1, uint8_t b2) {
+	esb_timeslot_set_ch_addr(ch, b0, b1, b2);
+}
+
+void hal_esb_send(const uint8_t *data, uint16_t len) {
+	esb_timeslot_set_next_packet((uint8_t*)data, len);
+}
+
+/**
+ * Hand one notification of a link to the SoftDevice, or one SDU if the
+ * client has opened an L2CAP channel. Only the queue is read within a
+ * critical region, the SoftDevice is called with interrupts enabled. Call
+ * with the link taken, see ble_tx_drain_link.
+ *
+ * @return
+ * true if a notification was taken, false if the link has nothing to send
+ * or the SoftDevice is out of buffers for it.
+ */
+static bool ble_tx_send(int link, bool flush) {
+	BLE_LINK_t *l = &m_links[link];
+	uint16_t conn_handle = l->conn_handle;
+
+	if (conn_handle == BLE_CONN_HANDLE_INVALID) {
+		return false;
+	}
+
+	// A notification that was already cut from the queue is sent first.
+	// SDUs are sent right away, as everything that comes in while the
+	// SoftDevice is busy with them ends up in the next one anyway.
+	if (l->tx_chunk_len == 0 && l2cap_coc_mtu(link) > 0) {
+		uint16_t max_len = 0;
+		uint8_t *sdu = l2cap_coc_tx_buf(link, &max_len);
+		if (!sdu) {
+			return false;
+		}
+
+		uint32_t len = max_len;
+		CRITICAL_REGION_ENTER();
+		app_fifo_read(&l->tx_fifo, sdu, &len);
+		CRITICAL_REGION_EXIT();
+
+		if (len == 0) {
+			return false;
+		}
+
+		l2cap_coc_send(link, len);
+		return true;
 	}
 
+	bool start_timer = false;
+	uint16_t len = 0;
+
 	CRITICAL_REGION_ENTER();
-	packet_send_packet(data, len, PACKET_VESC);
+	if (l->tx_chunk_len == 0) {
+		uint32_t queued = 0;
+		app_fifo_read(&l->tx_fifo, NULL, &queued);
+
+		if (queued > 0 && (queued >= l->nus_max_data_len || flush)) {
+			uint32_t chunk_len = MIN(l->nus_max_data_len, sizeof(l->tx_chunk));
+			app_fifo_read(&l->tx_fifo, l->tx_chunk, &chunk_len);
+			l->tx_chunk_len = chunk_len;
+		} else if (queued > 0 && !m_ble_tx_timer_running) {
+			m_ble_tx_timer_running = true;
+			start_timer = true;
+		}
+	}
+	len = l->tx_chunk_len;
 	CRITICAL_REGION_EXIT();
-}
 
-static void process_packet_vesc(unsigned char *data, unsigned int len) {
-	if (data[0] == COMM_EXT_NRF_ESB_SET_CH_ADDR) {
-		esb_timeslot_set_ch_addr(data[1], data[2], data[3], data[4]);
-	} else if (data[0] == COMM_EXT_NRF_ESB_SEND_DATA) {
-		rfhelp_send_data_crc(data + 1, len - 1);
-	} else if (data[0] == COMM_EXT_NRF_SET_ENABLED) {
-		set_enabled(data[1]);
-	} else {
-		if (m_is_enabled) {
-			packet_send_packet(data, len, PACKET_BLE);
-		}
+	if (start_timer) {
+		app_timer_start(m_ble_tx_timer, BLE_TX_COALESCE_TICKS, NULL);
 	}
-}
 
-void ble_printf(const char* format, ...) {
-	va_list arg;
-	va_start (arg, format);
-	int len;
-	static char print_buffer[255];
+	if (len == 0) {
+		return false;
+	}
 
-	print_buffer[0] = COMM_PRINT;
-	len = vsnprintf(print_buffer + 1, 254, format, arg);
-	va_end (arg);
+	uint32_t err_code = ble_nus_data_send(&m_nus, l->tx_chunk, &len, conn_handle);
 
-	if(len > 0) {
-		packet_send_packet((unsigned char*)print_buffer, (len < 254) ? len + 1 : 255, PACKET_BLE);
+	if (err_code == NRF_ERROR_RESOURCES || err_code == NRF_ERROR_BUSY) {
+		return false;
 	}
+
+	// Sent, or failed because e.g. notifications are not enabled. Either
+	// way the chunk is done.
+	l->tx_chunk_len = 0;
+	return true;
 }
 
-void cdc_printf(const char* format, ...) {
-#ifdef NRF52840_XXAA
-	va_list arg;
-	va_start (arg, format);
-	int len;
-	static char print_buffer[255];
+/**
+ * Take a link and send from it with ble_tx_send, so that only one context at
+ * a time cuts notifications from its queue and calls the SoftDevice for it.
+ * A context that finds the link taken leaves it to the one that has it,
+ * which drains it once more before letting go.
+ *
+ * @return
+ * true if a notification was taken.
+ */
+static bool ble_tx_drain_link(int link, bool flush) {
+	BLE_LINK_t *l = &m_links[link];
+	bool taken = false;
 
-	len = vsnprintf(print_buffer, sizeof(print_buffer), format, arg);
-	va_end (arg);
+	CRITICAL_REGION_ENTER();
+	if (l->tx_busy) {
+		l->tx_again = true;
+		l->tx_again_flush |= flush;
+	} else {
+		l->tx_busy = true;
+		taken = true;
+	}
+	CRITICAL_REGION_EXIT();
 
-	if(len > 0) {
-		app_usbd_cdc_acm_write(&m_app_cdc_acm, print_buffer,
-				len < sizeof(print_buffer) ? len : sizeof(print_buffer));
+	if (!taken) {
+		return false;
 	}
-#else
-	(void)format;
-#endif
-}
 
-static void esb_timeslot_data_handler(void *p_data, uint16_t length) {
-	if (m_other_comm_disable_time == 0) {
-		uint8_t buffer[length + 1];
-		buffer[0] = COMM_EXT_NRF_ESB_RX_DATA;
-		memcpy(buffer + 1, p_data, length);
+	bool sent = false;
+	bool again = true;
+
+	while (again) {
+		if (ble_tx_send(link, flush)) {
+			sent = true;
+		}
+
 		CRITICAL_REGION_ENTER();
-		packet_send_packet(buffer, length + 1, PACKET_VESC);
+		again = l->tx_again;
+		flush = flush || l->tx_again_flush;
+		l->tx_again = false;
+		l->tx_again_flush = false;
+		if (!again) {
+			l->tx_busy = false;
+		}
 		CRITICAL_REGION_EXIT();
 	}
+
+	return sent;
 }
 
-static void packet_timer_handler(void *p_context) {
-	(void)p_context;
-	packet_timerfunc();
+/**
+ * Send queued data as notifications until the queues are empty or the
+ * SoftDevice runs out of buffers. In the latter case sending continues on
+ * BLE_GATTS_EVT_HVN_TX_COMPLETE, so nothing ever waits for the radio.
+ *
+ * The links take turns one notification at a time, starting with a different
+ * link every time, so that a link with a lot of data cannot keep the others
+ * from getting their notifications queued.
+ *
+ * Can be called from any context. Interrupts are only masked while the
+ * queues are read, see ble_tx_send.
+ *
+ * @param flush
+ * Send the remaining data even if it does not fill a notification. When
+ * false, such data is held back for at most BLE_TX_COALESCE_US so that it
+ * can be packed together with the next packets.
+ */
+static void ble_tx_drain(bool flush) {
+	int first = m_ble_tx_next;
+	m_ble_tx_next = (first + 1) % BLE_LINKS;
+
+	bool sent = true;
+	while (sent) {
+		sent = false;
+		for (int i = 0;i < BLE_LINKS;i++) {
+			if (ble_tx_drain_link((first + i) % BLE_LINKS, flush)) {
+				sent = true;
+			}
+		}
+	}
+}
+
+static void ble_tx_flush(int link) {
+	CRITICAL_REGION_ENTER();
+	app_fifo_flush(&m_links[link].tx_fifo);
+	m_links[link].tx_chunk_len = 0;
+	CRITICAL_REGION_EXIT();
+}
+
+static uint32_t ble_tx_depth(int link) {
+	uint32_t free_space = 0;
+	app_fifo_write(&m_links[link].tx_fifo, NULL, &free_space);
+	return BLE_TX_BUF_SIZE - free_space + m_links[link].tx_chunk_len;
+}
 
+bool hal_ble_connected(int link) {
+	return m_links[link].conn_handle != BLE_CONN_HANDLE_INVALID;
+}
+
+bool hal_ble_send(int link, const packet_segment *segs, int seg_num) {
+	BLE_LINK_t *l = &m_links[link];
+
+	if (l->conn_handle == BLE_CONN_HANDLE_INVALID) {
+		return false;
+	}
+
+	uint32_t len = 0;
+	for (int i = 0;i < seg_num;i++) {
+		len += segs[i].len;
+	}
+
+	// Only queue complete packets. The FIFO is written from several contexts,
+	// so the segments of two packets must not interleave.
+	bool res = false;
 	CRITICAL_REGION_ENTER();
-	if (m_other_comm_disable_time > 0) {
-		m_other_comm_disable_time--;
+	uint32_t free_space = 0;
+	app_fifo_write(&l->tx_fifo, NULL, &free_space);
+	if (free_space < len) {
+		l->tx_drops++;
+	} else {
+		for (int i = 0;i < seg_num;i++) {
+			uint32_t seg_len = segs[i].len;
+			app_fifo_write(&l->tx_fifo, segs[i].data, &seg_len);
+		}
+
+		uint32_t depth = ble_tx_depth(link);
+		if (depth > l->tx_depth_max) {
+			l->tx_depth_max = depth;
+		}
+		res = true;
 	}
 	CRITICAL_REGION_EXIT();
+
+	if (res) {
+		ble_tx_drain(false);
+	}
+	return res;
+}
+
+static void l2cap_rx_handler(int link, const uint8_t *data, uint16_t len) {
+	bridge_ble_rx(link, data, len);
 }
 
-static void nrf_timer_handler(void *p_context) {
+static void l2cap_tx_handler(void) {
+	// Called from within the critical region of the L2CAP events, the
+	// SoftDevice is given the next SDU after it.
+	m_l2cap_tx_due = true;
+}
+
+static void ble_tx_timer_handler(void *p_context) {
 	(void)p_context;
+	m_ble_tx_timer_running = false;
+	ble_tx_drain(true);
+}
 
-	if (m_other_comm_disable_time == 0) {
-		uint8_t buffer[1];
-		buffer[0] = COMM_EXT_NRF_PRESENT;
-		CRITICAL_REGION_ENTER();
-		packet_send_packet(buffer, 1, PACKET_VESC);
-		CRITICAL_REGION_EXIT();
-	}
+void hal_ble_stats(int link, HAL_BLE_STATS_t *stats) {
+	BLE_LINK_t *l = &m_links[link];
+
+	stats->connected = l->conn_handle != BLE_CONN_HANDLE_INVALID;
+	stats->tx_depth = ble_tx_depth(link);
+	stats->tx_depth_max = l->tx_depth_max;
+	stats->tx_drops = l->tx_drops;
+	stats->tx_phy = l->tx_phy;
+	stats->rx_phy = l->rx_phy;
+	stats->tx_octets = l->tx_octets;
+	stats->rx_octets = l->rx_octets;
+	stats->att_mtu = l->nus_max_data_len + OPCODE_LENGTH + HANDLE_LENGTH;
+	stats->conn_interval = l->conn_interval;
+	stats->slave_latency = l->slave_latency;
+	stats->l2cap_mtu = l2cap_coc_mtu(link);
+}
+
+static void esb_timeslot_data_handler(void *p_data, uint16_t length) {
+	bridge_esb_rx(p_data, length);
+}
+
+void hal_trace_write(const uint8_t *data, unsigned int len) {
+#if TRACE
+	SEGGER_RTT_Write(TRACE_RTT_CHANNEL, data, len);
+#else
+	(void)data;
+	(void)len;
+#endif
+}
 
-	cdc_printf("Test\r\n");
+static void packet_timer_handler(void *p_context) {
+	(void)p_context;
+	bridge_timerfunc();
 }
 
 int main(void) {
@@ -701,6 +1195,14 @@ int main(void) {
  /*Initialize LEDs */
     bsp_board_init(BSP_INIT_LEDS);
 
+	// Before any of the recorded interrupts is enabled
+	isr_stats_init();
+	trace_init();
+#if TRACE
+	SEGGER_RTT_ConfigUpBuffer(TRACE_RTT_CHANNEL, "trace", m_trace_rtt_buf,
+			sizeof(m_trace_rtt_buf), SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+#endif
+
 #ifdef NRF52840_XXAA
 	nrf_drv_clock_init();
 
@@ -715,6 +1217,14 @@ int main(void) {
 #endif
 
 	uart_init();
+	for (int i = 0;i < BLE_LINKS;i++) {
+		app_fifo_init(&m_links[i].tx_fifo, m_links[i].tx_fifo_buf, sizeof(m_links[i].tx_fifo_buf));
+		ble_link_reset(i);
+	}
+#ifdef NRF52840_XXAA
+	app_fifo_init(&m_usb_rx_fifo, m_usb_rx_fifo_buf, sizeof(m_usb_rx_fifo_buf));
+	app_fifo_init(&m_usb_tx_fifo, m_usb_tx_fifo_buf, sizeof(m_usb_tx_fifo_buf));
+#endif
 	app_timer_init();
 	nrf_pwr_mgmt_init();
 	ble_stack_init();
@@ -724,16 +1234,14 @@ int main(void) {
 	advertising_init();
 	conn_params_init();
 
-	(void)set_enabled;
-
-	packet_init(uart_send_buffer, process_packet_vesc, PACKET_VESC);
-	packet_init(ble_send_buffer, process_packet_ble, PACKET_BLE);
+	conn_adapt_init(conn_adapt_apply);
+	l2cap_coc_init(l2cap_rx_handler, l2cap_tx_handler);
+	bridge_init();
 
 	app_timer_create(&m_packet_timer, APP_TIMER_MODE_REPEATED, packet_timer_handler);
 	app_timer_start(m_packet_timer, APP_TIMER_TICKS(1), NULL);
 
-	app_timer_create(&m_nrf_timer, APP_TIMER_MODE_REPEATED, nrf_timer_handler);
-	app_timer_start(m_nrf_timer, APP_TIMER_TICKS(1000), NULL);
+	app_timer_create(&m_ble_tx_timer, APP_TIMER_MODE_SINGLE_SHOT, ble_tx_timer_handler);
 
 	esb_timeslot_init(esb_timeslot_data_handler);
 	esb_timeslot_sd_start();
@@ -749,17 +1257,16 @@ int main(void) {
 		while (app_usbd_event_queue_process()){}
 #endif
 
-		if (m_uart_error) {
-			app_uart_close();
-			uart_init();
-			packet_reset(PACKET_VESC);
-			m_uart_error = false;
+		if (!uart_dma_process()) {
+			bridge_uart_rx_reset();
 		}
 
-		uint8_t byte;
-		while (app_uart_get(&byte) == NRF_SUCCESS) {
-			packet_process_byte(byte, PACKET_VESC);
-		}
+#ifdef NRF52840_XXAA
+		// After the UART, so that its replies are written right away
+		usb_process();
+#endif
+
+		bridge_process();
 
 		sd_app_evt_wait();
 	}
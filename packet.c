@@ -20,79 +20,159 @@
 #include <string.h>
 #include "packet.h"
 #include "crc.h"
+#include "trace.h"
 
 /**
  * The latest update aims at achieving optimal re-synchronization in the
  * case if lost data, at the cost of some performance.
+ *
+ * When a candidate frame is rejected the decoder jumps straight to the next
+ * possible start byte, and every candidate has to pass the start byte, length
+ * and stop byte checks before any CRC is calculated.
+ *
+ * The CRC of the candidate at the read pointer is updated as its payload
+ * arrives, so that completing a frame only requires a compare. This early
+ * CRC work is limited by a budget that is refilled by received bytes. A
+ * candidate is never rejected because of the budget: when it runs out the CRC
+ * is caught up once the stop byte has arrived, just like without the early
+ * update.
+ *
+ * The budget does not bound the total work. Every candidate that passes the
+ * start byte, length and stop byte checks gets its whole CRC calculated, and
+ * such a candidate can start at every fourth byte. A stream made for it, such
+ * as 03 01 FF 03 repeated, costs up to PACKET_MAX_PL_LEN / 4 CRC bytes per
+ * received byte, against about one byte on random noise. Bounding it would
+ * mean holding candidates back until more data arrives, which delays the last
+ * frame of a burst, so the decoder takes that cost instead. See
+ * host/bench_find_start.c.
  */
 
 // Defines
 #define BUFFER_LEN				(PACKET_MAX_PL_LEN + 8)
+#define CRC_BUDGET_MAX			(2 * BUFFER_LEN)
+#define CRC_UPDATE_MIN			16		// Pending payload bytes before an early CRC update
+
+// Word-at-a-time search for start bytes. A byte in the word is zero after the
+// xor if it is a start byte, and HAS_ZERO_BYTE is non-zero if any byte is zero.
+#define HAS_ZERO_BYTE(v)		(((v) - 0x01010101UL) & ~(v) & 0x80808080UL)
+#if PACKET_MAX_PL_LEN > 255
+#define HAS_START_BYTE(w)		(HAS_ZERO_BYTE(((w) & 0xFEFEFEFEUL) ^ 0x02020202UL) || \
+								(PACKET_MAX_PL_LEN > 65535 && HAS_ZERO_BYTE((w) ^ 0x04040404UL)))
+#else
+#define HAS_START_BYTE(w)		HAS_ZERO_BYTE((w) ^ 0x02020202UL)
+#endif
 
 // Private types
 typedef struct {
 	volatile unsigned short rx_timeout;
-	void(*send_func)(unsigned char *data, unsigned int len);
-	void(*process_func)(unsigned char *data, unsigned int len);
+	void(*send_func)(const packet_segment *segs, int seg_num, int handler_num);
+	void(*process_func)(unsigned char *data, unsigned int len, int handler_num);
 	unsigned int rx_read_ptr;
 	unsigned int rx_write_ptr;
+	unsigned int rx_data_len;
 	int bytes_left;
-	unsigned char rx_buffer[BUFFER_LEN];
-	unsigned char tx_buffer[BUFFER_LEN];
+	int crc_budget;
+	// Payload location and running CRC of the candidate at rx_read_ptr.
+	// rx_pl_start is 0 until the header of the candidate has been parsed.
+	unsigned int rx_pl_start;
+	unsigned int rx_pl_len;
+	unsigned int rx_crc_len;
+	unsigned short rx_crc;
+	// Circular buffer where every byte is stored twice, BUFFER_LEN apart. That
+	// way any window of up to BUFFER_LEN bytes starting at rx_read_ptr is
+	// contiguous in memory and can be decoded in place without memmove.
+	unsigned char rx_buffer[2 * BUFFER_LEN];
 } PACKET_STATE_t;
 
 // Private variables
 static PACKET_STATE_t m_handler_states[PACKET_HANDLERS];
 
 // Private functions
-static int try_decode_packet(unsigned char *buffer, unsigned int in_len,
-		void(*process_func)(unsigned char *data, unsigned int len), int *bytes_left);
-
-void packet_init(void (*s_func)(unsigned char *data, unsigned int len),
-		void (*p_func)(unsigned char *data, unsigned int len), int handler_num) {
+static int try_decode_packet(PACKET_STATE_t *handler);
+static void rx_crc_update(PACKET_STATE_t *handler, bool limit);
+static void rx_skip(PACKET_STATE_t *handler, unsigned int len);
+static unsigned int find_start_byte(const unsigned char *buffer, unsigned int len);
+static void rx_buffer_append(PACKET_STATE_t *handler, const uint8_t *data, unsigned int len);
+
+void packet_init(void (*s_func)(const packet_segment *segs, int seg_num, int handler_num),
+		void (*p_func)(unsigned char *data, unsigned int len, int handler_num), int handler_num) {
 	memset(&m_handler_states[handler_num], 0, sizeof(PACKET_STATE_t));
 	m_handler_states[handler_num].send_func = s_func;
 	m_handler_states[handler_num].process_func = p_func;
+	m_handler_states[handler_num].crc_budget = CRC_BUDGET_MAX;
 }
 
 void packet_reset(int handler_num) {
 	m_handler_states[handler_num].rx_read_ptr = 0;
 	m_handler_states[handler_num].rx_write_ptr = 0;
+	m_handler_states[handler_num].rx_data_len = 0;
 	m_handler_states[handler_num].bytes_left = 0;
+	m_handler_states[handler_num].crc_budget = CRC_BUDGET_MAX;
+	m_handler_states[handler_num].rx_pl_start = 0;
+	m_handler_states[handler_num].rx_crc_len = 0;
+	m_handler_states[handler_num].rx_crc = 0;
 }
 
+/**
+ * Send a packet. The header, the payload and the trailer are passed to the
+ * send function of the handler as three separate segments, so the payload
+ * is not copied.
+ */
 void packet_send_packet(unsigned char *data, unsigned int len, int handler_num) {
-	if (len == 0 || len > PACKET_MAX_PL_LEN) {
+	packet_send_packet_multi(data, len, &handler_num, 1);
+}
+
+/**
+ * Send the same packet to several handlers. The header and the CRC are only
+ * calculated once.
+ *
+ * @param handlers
+ * The handlers to send to.
+ *
+ * @param handler_cnt
+ * Number of handlers.
+ */
+void packet_send_packet_multi(unsigned char *data, unsigned int len,
+		const int *handlers, int handler_cnt) {
+	if (len == 0 || len > PACKET_MAX_PL_LEN || handler_cnt <= 0) {
 		return;
 	}
 
-	int b_ind = 0;
-	PACKET_STATE_t *handler = &m_handler_states[handler_num];
+	int h_ind = 0;
+	unsigned char header[4];
+	unsigned char trailer[3];
 
 	if (len <= 255) {
-		handler->tx_buffer[b_ind++] = 2;
-		handler->tx_buffer[b_ind++] = len;
+		header[h_ind++] = 2;
+		header[h_ind++] = len;
 	} else if (len <= 65535) {
-		handler->tx_buffer[b_ind++] = 3;
-		handler->tx_buffer[b_ind++] = len >> 8;
-		handler->tx_buffer[b_ind++] = len & 0xFF;
+		header[h_ind++] = 3;
+		header[h_ind++] = len >> 8;
+		header[h_ind++] = len & 0xFF;
 	} else {
-		handler->tx_buffer[b_ind++] = 4;
-		handler->tx_buffer[b_ind++] = len >> 16;
-		handler->tx_buffer[b_ind++] = (len >> 8) & 0x0F;
-		handler->tx_buffer[b_ind++] = len & 0xFF;
+		header[h_ind++] = 4;
+		header[h_ind++] = len >> 16;
+		header[h_ind++] = (len >> 8) & 0x0F;
+		header[h_ind++] = len & 0xFF;
 	}
 
-	memcpy(handler->tx_buffer + b_ind, data, len);
-	b_ind += len;
-
 	unsigned short crc = crc16(data, len);
-	handler->tx_buffer[b_ind++] = (uint8_t)(crc >> 8);
-	handler->tx_buffer[b_ind++] = (uint8_t)(crc & 0xFF);
-	handler->tx_buffer[b_ind++] = 3;
-
-	if (handler->send_func) {
-		handler->send_func(handler->tx_buffer, b_ind);
+	trailer[0] = (uint8_t)(crc >> 8);
+	trailer[1] = (uint8_t)(crc & 0xFF);
+	trailer[2] = 3;
+
+	packet_segment segs[3] = {
+			{header, h_ind},
+			{data, len},
+			{trailer, 3}
+	};
+
+	for (int i = 0;i < handler_cnt;i++) {
+		PACKET_STATE_t *handler = &m_handler_states[handlers[i]];
+		if (handler->send_func) {
+			TRACE_EVENT(TRACE_PACKET_TX, TRACE_PACKET_ARG(handlers[i], len));
+			handler->send_func(segs, 3, handlers[i]);
+		}
 	}
 }
 
@@ -111,95 +191,109 @@ void packet_timerfunc(void) {
 }
 
 void packet_process_byte(uint8_t rx_data, int handler_num) {
+	packet_process_bytes(&rx_data, 1, handler_num);
+}
+
+/**
+ * Feed a chunk of received data to a packet handler. This is equivalent to
+ * calling packet_process_byte for every byte, but the chunk is copied into
+ * the receive buffer at once and decoding is only attempted when enough
+ * data for the next decision has arrived.
+ *
+ * @param data
+ * The received data.
+ *
+ * @param len
+ * Number of bytes in data.
+ *
+ * @param handler_num
+ * The packet handler to feed.
+ */
+void packet_process_bytes(const uint8_t *data, size_t len, int handler_num) {
 	PACKET_STATE_t *handler = &m_handler_states[handler_num];
 
 	handler->rx_timeout = PACKET_RX_TIMEOUT;
 
-	unsigned int data_len = handler->rx_write_ptr - handler->rx_read_ptr;
+	while (len > 0) {
+		// Out of space (should not happen)
+		if (handler->rx_data_len >= BUFFER_LEN) {
+			packet_reset(handler_num);
+		}
 
-	// Out of space (should not happen)
-	if (data_len >= BUFFER_LEN) {
-		handler->rx_write_ptr = 0;
-		handler->rx_read_ptr = 0;
-		handler->bytes_left = 0;
-		handler->rx_buffer[handler->rx_write_ptr++] = rx_data;
-		return;
-	}
+		unsigned int chunk = BUFFER_LEN - handler->rx_data_len;
+		if (chunk > len) {
+			chunk = len;
+		}
 
-	// Everything has to be aligned, so shift buffer if we are out of space.
-	// (as opposed to using a circular buffer)
-	if (handler->rx_write_ptr >= BUFFER_LEN) {
-		memmove(handler->rx_buffer,
-				handler->rx_buffer + handler->rx_read_ptr,
-				data_len);
+		rx_buffer_append(handler, data, chunk);
+		data += chunk;
+		len -= chunk;
 
-		handler->rx_read_ptr = 0;
-		handler->rx_write_ptr = data_len;
-	}
-
-	handler->rx_buffer[handler->rx_write_ptr++] = rx_data;
-	data_len++;
+		handler->crc_budget += chunk * PACKET_CRC_BUDGET_PER_BYTE;
+		if (handler->crc_budget > CRC_BUDGET_MAX) {
+			handler->crc_budget = CRC_BUDGET_MAX;
+		}
 
-	if (handler->bytes_left > 1) {
-		handler->bytes_left--;
-		return;
-	}
+		if (handler->bytes_left > (int)chunk) {
+			handler->bytes_left -= chunk;
 
-	// Try decoding the packet at various offsets until it succeeds, or
-	// until we run out of data.
-	for (;;) {
-		int res = try_decode_packet(handler->rx_buffer + handler->rx_read_ptr,
-				data_len, handler->process_func, &handler->bytes_left);
+			// Keep the CRC of the pending packet up to date. Wait for a few
+			// bytes, so that a slow link does not call crc16_update per byte.
+			if (handler->rx_pl_start && (handler->rx_data_len - handler->rx_pl_start -
+					handler->rx_crc_len) >= CRC_UPDATE_MIN) {
+				rx_crc_update(handler, true);
+			}
 
-		// More data is needed
-		if (res == -2) {
-			break;
+			continue;
 		}
 
-		if (res > 0) {
-			data_len -= res;
-			handler->rx_read_ptr += res;
-		} else if (res == -1) {
-			// Something went wrong. Move pointer forward and try again.
-			handler->rx_read_ptr++;
-			data_len--;
+		// Try decoding the packet at various offsets until it succeeds, or
+		// until we run out of data.
+		for (;;) {
+			int res = try_decode_packet(handler);
+
+			// More data is needed
+			if (res == -2) {
+				break;
+			}
+
+			if (res > 0) {
+				rx_skip(handler, res);
+			} else if (res == -1) {
+				// Something went wrong. Skip to the next possible start byte
+				// and try again.
+				rx_skip(handler, 1 + find_start_byte(
+						handler->rx_buffer + handler->rx_read_ptr + 1,
+						handler->rx_data_len - 1));
+			}
 		}
 	}
-
-	// Nothing left, move pointers to avoid memmove
-	if (data_len == 0) {
-		handler->rx_read_ptr = 0;
-		handler->rx_write_ptr = 0;
-	}
 }
 
 /**
- * Try if it is possible to decode a packet from a buffer.
- *
- * @param buffer
- * The buffer to try from
- *
- * @param in_len
- * The length of the buffer
+ * Try if it is possible to decode a packet at the read pointer of a handler.
  *
- * @param process_func
- * Call this function with the decoded packet on success. Set to null
- * to disable.
+ * @param handler
+ * The handler to decode from. On success its process_func is called with
+ * the decoded packet. bytes_left is set to the number of additional bytes
+ * that are required to tell more about the packet.
  *
- * @param bytes_left
- * This many additional bytes are required to tell more about the packet.
+ * The CRC of the payload is updated with the bytes that are available while
+ * crc_budget allows it, and completed once the stop byte has been checked.
  *
  * @return
  * >0: Success, number of bytes decoded from buffer (not payload length)
  * -1: Invalid structure
  * -2: OK so far, but not enough data
  */
-static int try_decode_packet(unsigned char *buffer, unsigned int in_len,
-		void(*process_func)(unsigned char *data, unsigned int len), int *bytes_left) {
-	*bytes_left = 0;
+static int try_decode_packet(PACKET_STATE_t *handler) {
+	unsigned char *buffer = handler->rx_buffer + handler->rx_read_ptr;
+	unsigned int in_len = handler->rx_data_len;
+
+	handler->bytes_left = 0;
 
 	if (in_len == 0) {
-		*bytes_left = 1;
+		handler->bytes_left = 1;
 		return -2;
 	}
 
@@ -225,7 +319,7 @@ static int try_decode_packet(unsigned char *buffer, unsigned int in_len,
 
 	// Not enough data to determine length
 	if (in_len < data_start) {
-		*bytes_left = data_start - in_len;
+		handler->bytes_left = data_start - in_len;
 		return -2;
 	}
 
@@ -261,9 +355,13 @@ static int try_decode_packet(unsigned char *buffer, unsigned int in_len,
 		return -1;
 	}
 
+	handler->rx_pl_start = data_start;
+	handler->rx_pl_len = len;
+
 	// Need more data to determine rest of packet
 	if (in_len < (len + data_start + 3)) {
-		*bytes_left = (len + data_start + 3) - in_len;
+		rx_crc_update(handler, true);
+		handler->bytes_left = (len + data_start + 3) - in_len;
 		return -2;
 	}
 
@@ -272,13 +370,15 @@ static int try_decode_packet(unsigned char *buffer, unsigned int in_len,
 		return -1;
 	}
 
-	unsigned short crc_calc = crc16(buffer + data_start, len);
+	rx_crc_update(handler, false);
+
 	unsigned short crc_rx = (unsigned short)buffer[data_start + len] << 8
 							| (unsigned short)buffer[data_start + len + 1];
 
-	if (crc_calc == crc_rx) {
-		if (process_func) {
-			process_func(buffer + data_start, len);
+	if (handler->rx_crc == crc_rx) {
+		TRACE_EVENT(TRACE_PACKET_RX, TRACE_PACKET_ARG(handler - m_handler_states, len));
+		if (handler->process_func) {
+			handler->process_func(buffer + data_start, len, handler - m_handler_states);
 		}
 
 		return len + data_start + 3;
@@ -286,3 +386,122 @@ static int try_decode_packet(unsigned char *buffer, unsigned int in_len,
 		return -1;
 	}
 }
+
+/**
+ * Add the received payload bytes of the candidate at the read pointer to
+ * its running CRC.
+ *
+ * @param limit
+ * Leave the CRC behind if the work does not fit in the CRC budget. Used
+ * while the candidate is incomplete, so that the early updates cannot cause
+ * more work than the budget allows.
+ */
+static void rx_crc_update(PACKET_STATE_t *handler, bool limit) {
+	unsigned int avail = handler->rx_data_len - handler->rx_pl_start;
+	if (avail > handler->rx_pl_len) {
+		avail = handler->rx_pl_len;
+	}
+
+	if (avail <= handler->rx_crc_len) {
+		return;
+	}
+
+	unsigned int len = avail - handler->rx_crc_len;
+
+	// Out of CRC budget, most likely because of a lot of noise
+	if (limit && (int)len > handler->crc_budget) {
+		return;
+	}
+
+	handler->crc_budget -= len;
+	handler->rx_crc = crc16_update(handler->rx_crc, handler->rx_buffer +
+			handler->rx_read_ptr + handler->rx_pl_start + handler->rx_crc_len, len);
+	handler->rx_crc_len = avail;
+}
+
+/**
+ * Drop bytes from the start of the receive buffer and forget the state of
+ * the candidate packet there.
+ */
+static void rx_skip(PACKET_STATE_t *handler, unsigned int len) {
+	handler->rx_data_len -= len;
+	handler->rx_read_ptr += len;
+
+	if (handler->rx_read_ptr >= BUFFER_LEN) {
+		handler->rx_read_ptr -= BUFFER_LEN;
+	}
+
+	handler->rx_pl_start = 0;
+	handler->rx_crc_len = 0;
+	handler->rx_crc = 0;
+}
+
+/**
+ * Find the first byte in a buffer that can start a packet.
+ *
+ * @return
+ * The offset of the first start byte, or len if there is none.
+ */
+static unsigned int find_start_byte(const unsigned char *buffer, unsigned int len) {
+	unsigned int i = 0;
+
+	while ((i + 4) <= len) {
+		uint32_t w;
+		memcpy(&w, buffer + i, 4);
+
+		if (HAS_START_BYTE(w)) {
+			break;
+		}
+
+		i += 4;
+	}
+
+	for (;i < len;i++) {
+		if (buffer[i] == 2 ||
+				(PACKET_MAX_PL_LEN > 255 && buffer[i] == 3) ||
+				(PACKET_MAX_PL_LEN > 65535 && buffer[i] == 4)) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/**
+ * Append data to the circular receive buffer. Every byte is written to both
+ * halves of rx_buffer, so the caller must make sure that there is room for
+ * len bytes.
+ */
+static void rx_buffer_append(PACKET_STATE_t *handler, const uint8_t *data, unsigned int len) {
+	handler->rx_data_len += len;
+
+	// Single bytes are common on slow links, avoid the memcpy calls for them
+	if (len == 1) {
+		handler->rx_buffer[handler->rx_write_ptr] = data[0];
+		handler->rx_buffer[handler->rx_write_ptr + BUFFER_LEN] = data[0];
+
+		if (++handler->rx_write_ptr >= BUFFER_LEN) {
+			handler->rx_write_ptr = 0;
+		}
+
+		return;
+	}
+
+	while (len > 0) {
+		unsigned int chunk = BUFFER_LEN - handler->rx_write_ptr;
+		if (chunk > len) {
+			chunk = len;
+		}
+
+		memcpy(handler->rx_buffer + handler->rx_write_ptr, data, chunk);
+		memcpy(handler->rx_buffer + handler->rx_write_ptr + BUFFER_LEN, data, chunk);
+
+		handler->rx_write_ptr += chunk;
+		if (handler->rx_write_ptr >= BUFFER_LEN) {
+			handler->rx_write_ptr = 0;
+		}
+
+		data += chunk;
+		len -= chunk;
+	}
+}
@@ -22,6 +22,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 // Settings
 #ifndef PACKET_RX_TIMEOUT
@@ -36,12 +37,30 @@
 #define PACKET_MAX_PL_LEN		512
 #endif
 
+// Average number of bytes the CRC of incomplete packets may be calculated
+// over per received byte
+#ifndef PACKET_CRC_BUDGET_PER_BYTE
+#define PACKET_CRC_BUDGET_PER_BYTE	8
+#endif
+
+// Types
+typedef struct {
+	const unsigned char *data;
+	unsigned int len;
+} packet_segment;
+
+// Bytes packet_send_packet sends for a payload of len bytes
+#define PACKET_FRAME_LEN(len)	((len) + ((len) <= 255 ? 5 : ((len) <= 65535 ? 6 : 7)))
+
 // Functions
-void packet_init(void (*s_func)(unsigned char *data, unsigned int len),
-		void (*p_func)(unsigned char *data, unsigned int len), int handler_num);
+void packet_init(void (*s_func)(const packet_segment *segs, int seg_num, int handler_num),
+		void (*p_func)(unsigned char *data, unsigned int len, int handler_num), int handler_num);
 void packet_reset(int handler_num);
 void packet_process_byte(uint8_t rx_data, int handler_num);
+void packet_process_bytes(const uint8_t *data, size_t len, int handler_num);
 void packet_timerfunc(void);
 void packet_send_packet(unsigned char *data, unsigned int len, int handler_num);
+void packet_send_packet_multi(unsigned char *data, unsigned int len,
+		const int *handlers, int handler_cnt);
 
 #endif /* PACKET_H_ */
@@ -0,0 +1,217 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Keeps track of which packet handler each outstanding request to the VESC
+ * came from, so that the reply can be sent back to that handler only. The
+ * VESC answers a request with a packet that has the same command ID, and
+ * answers requests in the order they arrive, so the oldest entry with a
+ * matching ID is the one a reply belongs to.
+ *
+ * The functions are not reentrant. The caller is responsible for calling
+ * them from one context, or from within critical regions.
+ */
+
+#include "router.h"
+#include "datatypes.h"
+
+// Private types
+typedef struct {
+	uint8_t cmd;
+	int8_t handler_num;
+	bool bare;
+	uint16_t age;
+	uint32_t seq;
+	uint32_t generation;
+} ROUTE_t;
+
+// Private variables
+static ROUTE_t m_routes[ROUTER_ENTRIES];
+static uint32_t m_seq = 0;
+
+// Private functions
+static int get_cmd(const unsigned char *data, unsigned int len);
+static bool expects_reply(int cmd);
+
+void router_init(void) {
+	for (int i = 0;i < ROUTER_ENTRIES;i++) {
+		m_routes[i].handler_num = -1;
+	}
+}
+
+/**
+ * Record that a request is about to be forwarded to the VESC.
+ *
+ * @param data
+ * The request payload.
+ *
+ * @param len
+ * Length of the payload.
+ *
+ * @param handler_num
+ * The packet handler the request came from.
+ *
+ * @param generation
+ * Returned with the route by router_take, e.g. the cache_generation the
+ * request was sent in.
+ */
+void router_add(const unsigned char *data, unsigned int len, int handler_num, uint32_t generation) {
+	int cmd = get_cmd(data, len);
+	if (cmd < 0 || !expects_reply(cmd)) {
+		return;
+	}
+
+	// Use a free entry, or reuse the oldest one if there is none.
+	ROUTE_t *r = &m_routes[0];
+	for (int i = 0;i < ROUTER_ENTRIES;i++) {
+		if (m_routes[i].handler_num < 0) {
+			r = &m_routes[i];
+			break;
+		}
+
+		if ((int32_t)(m_routes[i].seq - r->seq) < 0) {
+			r = &m_routes[i];
+		}
+	}
+
+	r->cmd = cmd;
+	r->handler_num = handler_num;
+	r->bare = len == 1;
+	r->age = 0;
+	r->seq = m_seq++;
+	r->generation = generation;
+}
+
+/**
+ * Find out where a packet from the VESC should go, and forget the request
+ * it answers.
+ *
+ * @param data
+ * The packet payload.
+ *
+ * @param len
+ * Length of the payload.
+ *
+ * @param bare
+ * If not null, set to true if the matching request consisted of only the
+ * command ID, i.e. it had no arguments and was not forwarded over CAN.
+ *
+ * @param generation
+ * If not null, set to the generation given to router_add for the matching
+ * request.
+ *
+ * @return
+ * The handler that sent the matching request, or -1 if there is none and the
+ * packet should go to every client.
+ */
+int router_take(const unsigned char *data, unsigned int len, bool *bare, uint32_t *generation) {
+	if (bare) {
+		*bare = false;
+	}
+
+	if (len == 0 || data[0] == COMM_PRINT) {
+		return -1;
+	}
+
+	ROUTE_t *r = 0;
+	for (int i = 0;i < ROUTER_ENTRIES;i++) {
+		if (m_routes[i].handler_num >= 0 && m_routes[i].cmd == data[0]) {
+			if (!r || (int32_t)(m_routes[i].seq - r->seq) < 0) {
+				r = &m_routes[i];
+			}
+		}
+	}
+
+	if (!r) {
+		return -1;
+	}
+
+	int res = r->handler_num;
+	r->handler_num = -1;
+	if (bare) {
+		*bare = r->bare;
+	}
+	if (generation) {
+		*generation = r->generation;
+	}
+	return res;
+}
+
+/**
+ * Forget all outstanding requests from a handler, e.g. when its client has
+ * disconnected.
+ */
+void router_remove_handler(int handler_num) {
+	for (int i = 0;i < ROUTER_ENTRIES;i++) {
+		if (m_routes[i].handler_num == handler_num) {
+			m_routes[i].handler_num = -1;
+		}
+	}
+}
+
+/**
+ * Call this function every millisecond.
+ */
+void router_timerfunc(void) {
+	for (int i = 0;i < ROUTER_ENTRIES;i++) {
+		if (m_routes[i].handler_num >= 0) {
+			if (++m_routes[i].age >= ROUTER_TIMEOUT) {
+				m_routes[i].handler_num = -1;
+			}
+		}
+	}
+}
+
+/*
+ * Packets forwarded over CAN are answered with the ID of the forwarded
+ * command.
+ */
+static int get_cmd(const unsigned char *data, unsigned int len) {
+	if (len == 0) {
+		return -1;
+	}
+
+	if (data[0] == COMM_FORWARD_CAN) {
+		return len >= 3 ? data[2] : -1;
+	}
+
+	return data[0];
+}
+
+static bool expects_reply(int cmd) {
+	switch (cmd) {
+	case COMM_JUMP_TO_BOOTLOADER:
+	case COMM_SET_DUTY:
+	case COMM_SET_CURRENT:
+	case COMM_SET_CURRENT_BRAKE:
+	case COMM_SET_RPM:
+	case COMM_SET_POS:
+	case COMM_SET_HANDBRAKE:
+	case COMM_SET_DETECT:
+	case COMM_SET_SERVO_POS:
+	case COMM_TERMINAL_CMD:
+	case COMM_REBOOT:
+	case COMM_ALIVE:
+	case COMM_SET_CHUCK_DATA:
+	case COMM_JUMP_TO_BOOTLOADER_ALL_CAN:
+	case COMM_APP_DISABLE_OUTPUT:
+		return false;
+
+	default:
+		return true;
+	}
+}
@@ -0,0 +1,40 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Settings
+#ifndef ROUTER_ENTRIES
+#define ROUTER_ENTRIES			32		// Outstanding requests that can be tracked
+#endif
+
+#ifndef ROUTER_TIMEOUT
+#define ROUTER_TIMEOUT			2000	// Ticks of router_timerfunc before a request is forgotten
+#endif
+
+// Functions
+void router_init(void);
+void router_add(const unsigned char *data, unsigned int len, int handler_num, uint32_t generation);
+int router_take(const unsigned char *data, unsigned int len, bool *bare, uint32_t *generation);
+void router_remove_handler(int handler_num);
+void router_timerfunc(void);
+
+#endif /* ROUTER_H_ */
@@ -0,0 +1,507 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Telemetry aggregation.
+ *
+ * Clients subscribe to a set of COMM_GET_VALUES_SELECTIVE fields at a given
+ * period. The bridge polls the VESC on their behalf, merging all subscribers
+ * that are due at about the same time into one selective poll, and keeps the
+ * latest value of every field. Each subscriber then gets a
+ * COMM_GET_VALUES_SELECTIVE packet with exactly the fields it asked for, in
+ * the same format as if it had polled the VESC itself. The load on the UART
+ * therefore depends on the fastest subscription and the union of the fields,
+ * not on the number of clients.
+ *
+ * Selective polls that clients send themselves also update the values, and
+ * are answered right away if everything they ask for is fresh enough.
+ *
+ * Plain COMM_GET_VALUES polls are not parsed, as the layout of the reply
+ * differs between firmware versions. Instead, polls that arrive while one is
+ * already on its way to the VESC are not forwarded, and the reply to that one
+ * is sent to all of them as it is. Several clients polling at the same rate
+ * then only cost one poll on the UART.
+ *
+ * Subscribers can opt in to delta encoding with a keyframe interval. The
+ * bridge then remembers what it last sent to them and only sends a full
+ * COMM_GET_VALUES_SELECTIVE packet (a keyframe) every interval frames. The
+ * frames in between are COMM_EXT_NRF_TELEMETRY_DELTA packets:
+ *
+ * [COMM_EXT_NRF_BRIDGE][COMM_EXT_NRF_TELEMETRY_DELTA][u8 frame since keyframe][var mask of changed fields][var int delta]...
+ *
+ * with one zig-zag varint per changed field, in mask bit order. The delta is
+ * between the fields as signed big-endian numbers of their size, and adding it
+ * to the previous value wraps around the same way. A client that misses a frame
+ * notices it from the frame number and waits for the next keyframe.
+ *
+ * The functions can be called from any context. Packets are put together
+ * within short critical regions and sent outside of them.
+ */
+
+#include "telemetry.h"
+#include "packet.h"
+#include "buffer.h"
+#include "datatypes.h"
+#include "hal.h"
+
+#include <string.h>
+
+// Size of each COMM_GET_VALUES_SELECTIVE field, indexed by mask bit
+static const uint8_t m_field_size[] = {
+		2, // Temp MOSFET
+		2, // Temp motor
+		4, // Current motor
+		4, // Current in
+		4, // Id
+		4, // Iq
+		2, // Duty cycle
+		4, // ERPM
+		2, // Input voltage
+		4, // Ah
+		4, // Ah charged
+		4, // Wh
+		4, // Wh charged
+		4, // Tachometer
+		4, // Tachometer absolute
+		1, // Fault code
+		4, // PID position
+		1  // Controller ID
+};
+
+#define FIELD_NUM		(sizeof(m_field_size) / sizeof(m_field_size[0]))
+#define FIELD_MASK		((1UL << FIELD_NUM) - 1)
+#define VALUES_MAX		(FIELD_NUM * 4)
+#define FRAME_MAX		(3 + 5 + FIELD_NUM * 5)		// Longest delta, longer than a full packet
+
+// Private types
+typedef struct {
+	uint32_t mask;
+	uint32_t period;
+	uint32_t countdown;
+	bool waiting;
+	uint8_t keyframe;
+	uint8_t frames;
+	uint8_t sent[FIELD_NUM][4];
+} SUBSCRIBER_t;
+
+// Private variables
+static SUBSCRIBER_t m_subs[PACKET_HANDLERS];
+static uint8_t m_values[FIELD_NUM][4];
+static uint16_t m_value_age[FIELD_NUM];
+static uint32_t m_valid = 0;
+static int m_vesc_handler = 0;
+static uint32_t m_poll_mask = 0;
+static int m_poll_time = 0;
+static int m_values_time = 0;						// Ticks left of the COMM_GET_VALUES poll in flight
+static bool m_values_waiting[PACKET_HANDLERS];		// Waiting for the reply to that poll
+
+// Private functions
+static unsigned int values_build(uint32_t mask, uint8_t *buffer);
+static unsigned int subscriber_build(int handler_num, uint8_t *buffer);
+
+void telemetry_init(int vesc_handler_num) {
+	m_vesc_handler = vesc_handler_num;
+	memset(m_subs, 0, sizeof(m_subs));
+	memset(m_values_waiting, 0, sizeof(m_values_waiting));
+	m_valid = 0;
+	m_poll_mask = 0;
+	m_values_time = 0;
+}
+
+/**
+ * Subscribe a handler to telemetry, replacing its previous subscription.
+ *
+ * @param handler_num
+ * The handler to send the values to.
+ *
+ * @param mask
+ * COMM_GET_VALUES_SELECTIVE fields. 0 cancels the subscription.
+ *
+ * @param period
+ * Ticks of telemetry_timerfunc between updates.
+ *
+ * @param keyframe
+ * Send a full packet every keyframe updates and delta packets in between. 0
+ * or 1 to always send full packets.
+ *
+ * @return
+ * The fields that will be sent. Fields that are not known to the bridge are
+ * removed.
+ */
+uint32_t telemetry_subscribe(int handler_num, uint32_t mask, uint32_t period, uint8_t keyframe) {
+	if (handler_num < 0 || handler_num >= PACKET_HANDLERS) {
+		return 0;
+	}
+
+	if (period < TELEMETRY_MIN_PERIOD) {
+		period = TELEMETRY_MIN_PERIOD;
+	}
+
+	SUBSCRIBER_t *s = &m_subs[handler_num];
+	CRITICAL_REGION_ENTER();
+	s->mask = mask & FIELD_MASK;
+	s->period = period;
+	s->countdown = 0;
+	s->waiting = false;
+	s->keyframe = keyframe;
+	s->frames = 0;
+	CRITICAL_REGION_EXIT();
+
+	return mask & FIELD_MASK;
+}
+
+/**
+ * Forget a handler, when its client disconnects. Cancels its subscription and
+ * any COMM_GET_VALUES reply it waits for.
+ */
+void telemetry_remove_handler(int handler_num) {
+	if (handler_num < 0 || handler_num >= PACKET_HANDLERS) {
+		return;
+	}
+
+	telemetry_subscribe(handler_num, 0, 0, 0);
+
+	CRITICAL_REGION_ENTER();
+	m_values_waiting[handler_num] = false;
+	CRITICAL_REGION_EXIT();
+}
+
+/**
+ * Process a request from a client before it is forwarded to the VESC.
+ *
+ * @return
+ * true if the request was answered from fresh values, or will be answered
+ * with the reply to a COMM_GET_VALUES poll in flight, and should not be
+ * forwarded.
+ */
+bool telemetry_request(const unsigned char *data, unsigned int len, int handler_num) {
+	if (len == 1 && data[0] == COMM_GET_VALUES) {
+		bool coalesced = false;
+
+		CRITICAL_REGION_ENTER();
+		if (m_values_time > 0) {
+			m_values_waiting[handler_num] = true;
+			coalesced = true;
+		} else {
+			m_values_time = TELEMETRY_POLL_TIMEOUT;
+		}
+		CRITICAL_REGION_EXIT();
+
+		return coalesced;
+	}
+
+	if (len != 5 || data[0] != COMM_GET_VALUES_SELECTIVE) {
+		return false;
+	}
+
+	int32_t ind = 1;
+	uint32_t mask = buffer_get_uint32(data, &ind);
+
+	if (mask == 0 || (mask & ~FIELD_MASK)) {
+		return false;
+	}
+
+	uint8_t buffer[FRAME_MAX];
+	unsigned int out_len = 0;
+
+	bool fresh = false;
+
+	CRITICAL_REGION_ENTER();
+	fresh = (mask & m_valid) == mask;
+	for (unsigned int i = 0;i < FIELD_NUM && fresh;i++) {
+		if ((mask & (1UL << i)) && m_value_age[i] > TELEMETRY_FRESH) {
+			fresh = false;
+		}
+	}
+	if (fresh) {
+		out_len = values_build(mask, buffer);
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (out_len == 0) {
+		return false;
+	}
+
+	packet_send_packet(buffer, out_len, handler_num);
+	return true;
+}
+
+/**
+ * Process a packet from the VESC.
+ *
+ * @return
+ * true if the packet was the answer to a poll from the bridge and should not
+ * be passed on to the clients.
+ */
+bool telemetry_process_vesc(const unsigned char *data, unsigned int len) {
+	if (data[0] == COMM_GET_VALUES) {
+		// The client that sent the poll gets the reply as usual, the clients
+		// that were coalesced into it get a copy.
+		int handlers[PACKET_HANDLERS];
+		int handler_cnt = 0;
+
+		CRITICAL_REGION_ENTER();
+		m_values_time = 0;
+		for (int i = 0;i < PACKET_HANDLERS;i++) {
+			if (m_values_waiting[i]) {
+				m_values_waiting[i] = false;
+				handlers[handler_cnt++] = i;
+			}
+		}
+		CRITICAL_REGION_EXIT();
+
+		if (handler_cnt > 0) {
+			packet_send_packet_multi((unsigned char*)data, len, handlers, handler_cnt);
+		}
+
+		return false;
+	}
+
+	if (len < 5 || data[0] != COMM_GET_VALUES_SELECTIVE) {
+		return false;
+	}
+
+	int32_t ind = 1;
+	uint32_t mask = buffer_get_uint32(data, &ind);
+
+	if (mask & ~FIELD_MASK) {
+		// From a firmware with fields we do not know the size of
+		return false;
+	}
+
+	unsigned int expected = ind;
+	for (unsigned int i = 0;i < FIELD_NUM;i++) {
+		if (mask & (1UL << i)) {
+			expected += m_field_size[i];
+		}
+	}
+
+	if (expected != len) {
+		return false;
+	}
+
+	bool answer = false;
+
+	CRITICAL_REGION_ENTER();
+	for (unsigned int i = 0;i < FIELD_NUM;i++) {
+		if (mask & (1UL << i)) {
+			memcpy(m_values[i], data + ind, m_field_size[i]);
+			m_value_age[i] = 0;
+			ind += m_field_size[i];
+		}
+	}
+	m_valid |= mask;
+
+	answer = m_poll_mask != 0 && mask == m_poll_mask;
+	if (answer) {
+		m_poll_mask = 0;
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (!answer) {
+		return false;
+	}
+
+	// One frame at a time, sent outside of the critical region
+	for (int i = 0;i < PACKET_HANDLERS;i++) {
+		uint8_t buffer[FRAME_MAX];
+		unsigned int out_len = 0;
+		int handlers[PACKET_HANDLERS];
+		int handler_cnt = 0;
+
+		CRITICAL_REGION_ENTER();
+		SUBSCRIBER_t *s = &m_subs[i];
+		if (s->waiting && s->keyframe > 1) {
+			s->waiting = false;
+			out_len = subscriber_build(i, buffer);
+			handlers[handler_cnt++] = i;
+		} else if (s->waiting) {
+			// Everyone that wants the same fields in full gets the same frame
+			for (int j = i;j < PACKET_HANDLERS;j++) {
+				SUBSCRIBER_t *s2 = &m_subs[j];
+				if (s2->waiting && s2->keyframe <= 1 && s2->mask == s->mask) {
+					s2->waiting = false;
+					handlers[handler_cnt++] = j;
+				}
+			}
+			out_len = values_build(s->mask, buffer);
+		}
+		CRITICAL_REGION_EXIT();
+
+		if (handler_cnt > 0) {
+			packet_send_packet_multi(buffer, out_len, handlers, handler_cnt);
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Call this function every millisecond.
+ */
+void telemetry_timerfunc(void) {
+	uint32_t mask = 0;
+
+	CRITICAL_REGION_ENTER();
+	for (unsigned int i = 0;i < FIELD_NUM;i++) {
+		if (m_value_age[i] < 0xFFFF) {
+			m_value_age[i]++;
+		}
+	}
+
+	for (int i = 0;i < PACKET_HANDLERS;i++) {
+		if (m_subs[i].mask && m_subs[i].countdown > 0) {
+			m_subs[i].countdown--;
+		}
+	}
+
+	if (m_poll_mask && --m_poll_time <= 0) {
+		// Lost, the waiting subscribers go into the next poll
+		m_poll_mask = 0;
+	}
+
+	if (m_values_time > 0 && --m_values_time == 0) {
+		// Lost, the waiting clients poll again when they time out
+		memset(m_values_waiting, 0, sizeof(m_values_waiting));
+	}
+
+	bool due = false;
+	for (int i = 0;i < PACKET_HANDLERS && !m_poll_mask;i++) {
+		SUBSCRIBER_t *s = &m_subs[i];
+		if (s->mask && (s->waiting || s->countdown == 0)) {
+			due = true;
+		}
+	}
+
+	// Take everyone that is due soon along, it costs a few bytes more on
+	// the UART but saves a poll.
+	for (int i = 0;i < PACKET_HANDLERS && due;i++) {
+		SUBSCRIBER_t *s = &m_subs[i];
+		if (s->mask && (s->waiting || s->countdown <= TELEMETRY_MERGE)) {
+			s->waiting = true;
+			s->countdown = s->period;
+			mask |= s->mask;
+		}
+	}
+
+	if (mask) {
+		m_poll_mask = mask;
+		m_poll_time = TELEMETRY_POLL_TIMEOUT;
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (mask) {
+		uint8_t buffer[5];
+		int32_t ind = 0;
+		buffer[ind++] = COMM_GET_VALUES_SELECTIVE;
+		buffer_append_uint32(buffer, mask, &ind);
+		packet_send_packet(buffer, ind, m_vesc_handler);
+	}
+}
+
+/*
+ * [COMM_GET_VALUES_SELECTIVE][u32 mask][fields], call within a critical
+ * region.
+ */
+static unsigned int values_build(uint32_t mask, uint8_t *buffer) {
+	int32_t ind = 0;
+
+	buffer[ind++] = COMM_GET_VALUES_SELECTIVE;
+	buffer_append_uint32(buffer, mask, &ind);
+
+	for (unsigned int i = 0;i < FIELD_NUM;i++) {
+		if (mask & (1UL << i)) {
+			memcpy(buffer + ind, m_values[i], m_field_size[i]);
+			ind += m_field_size[i];
+		}
+	}
+
+	return ind;
+}
+
+static int32_t field_value(int field) {
+	int32_t ind = 0;
+
+	switch (m_field_size[field]) {
+	case 1: return (int8_t)m_values[field][0];
+	case 2: return buffer_get_int16(m_values[field], &ind);
+	default: return buffer_get_int32(m_values[field], &ind);
+	}
+}
+
+static int32_t sent_value(SUBSCRIBER_t *s, int field) {
+	int32_t ind = 0;
+
+	switch (m_field_size[field]) {
+	case 1: return (int8_t)s->sent[field][0];
+	case 2: return buffer_get_int16(s->sent[field], &ind);
+	default: return buffer_get_int32(s->sent[field], &ind);
+	}
+}
+
+/*
+ * The next delta or full packet for a subscriber, call within a critical
+ * region.
+ */
+static unsigned int subscriber_build(int handler_num, uint8_t *buffer) {
+	SUBSCRIBER_t *s = &m_subs[handler_num];
+
+	if (s->keyframe > 1 && s->frames > 0) {
+		int32_t ind = 0;
+		uint32_t changed = 0;
+		unsigned int full_len = 5;
+
+		for (unsigned int i = 0;i < FIELD_NUM;i++) {
+			if ((s->mask & (1UL << i))) {
+				full_len += m_field_size[i];
+				if (memcmp(s->sent[i], m_values[i], m_field_size[i]) != 0) {
+					changed |= 1UL << i;
+				}
+			}
+		}
+
+		buffer[ind++] = COMM_EXT_NRF_BRIDGE;
+		buffer[ind++] = COMM_EXT_NRF_TELEMETRY_DELTA;
+		buffer[ind++] = s->frames;
+		buffer_append_var_uint32(buffer, changed, &ind);
+
+		for (unsigned int i = 0;i < FIELD_NUM;i++) {
+			if (changed & (1UL << i)) {
+				int32_t delta = (int32_t)((uint32_t)field_value(i) - (uint32_t)sent_value(s, i));
+				buffer_append_var_int32(buffer, delta, &ind);
+			}
+		}
+
+		// Large changes can make a delta longer than a keyframe
+		if ((unsigned int)ind < full_len) {
+			for (unsigned int i = 0;i < FIELD_NUM;i++) {
+				if (changed & (1UL << i)) {
+					memcpy(s->sent[i], m_values[i], m_field_size[i]);
+				}
+			}
+
+			if (++s->frames >= s->keyframe) {
+				s->frames = 0;
+			}
+			return ind;
+		}
+	}
+
+	memcpy(s->sent, m_values, sizeof(s->sent));
+	s->frames = s->keyframe > 1 ? 1 : 0;
+	return values_build(s->mask, buffer);
+}
@@ -0,0 +1,38 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Settings
+#define TELEMETRY_MIN_PERIOD		20		// Shortest subscription period in ticks
+#define TELEMETRY_MERGE				10		// Subscribers due within this many ticks share a poll
+#define TELEMETRY_POLL_TIMEOUT		200		// Give up on a poll after this many ticks
+#define TELEMETRY_FRESH				10		// Polls from clients are answered from values this fresh
+
+// Functions
+void telemetry_init(int vesc_handler_num);
+uint32_t telemetry_subscribe(int handler_num, uint32_t mask, uint32_t period, uint8_t keyframe);
+void telemetry_remove_handler(int handler_num);
+bool telemetry_request(const unsigned char *data, unsigned int len, int handler_num);
+bool telemetry_process_vesc(const unsigned char *data, unsigned int len);
+void telemetry_timerfunc(void);
+
+#endif /* TELEMETRY_H_ */
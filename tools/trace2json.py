@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+#
+# Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+"""
+Convert the binary event trace of the firmware (see trace.c) to the Chrome
+trace event format, which can be opened in chrome://tracing or Perfetto.
+
+The input is either the raw record stream from RTT channel 1, e.g. logged
+with JLinkRTTLogger, or with --packets a capture of the serial port of a
+client that enabled the trace with COMM_EXT_NRF_TRACE.
+"""
+
+import argparse
+import json
+import os
+import re
+import struct
+import sys
+
+RECORD_LEN = 8
+
+EVENTS = [
+    'lost',
+    'heartbeat',
+    'packet_rx',
+    'packet_tx',
+    'timeslot_start',
+    'timeslot_extend',
+    'timeslot_end',
+    'timeslot_extend_fail',
+    'esb_tx_success',
+    'esb_tx_fail',
+    'ble_hvn_complete',
+    'uart_error',
+]
+
+# Thread ids in the trace
+TID_TIMESLOT = 1
+TID_ESB = 2
+TID_BLE = 3
+TID_UART = 4
+TID_TRACE = 5
+TID_HANDLER = 16
+
+
+def crc16(data):
+    crc = 0
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def enum_values(src, name):
+    """Values of the members of a typedef enum in C source."""
+    body = re.search(r'typedef enum\s*{([^}]*)}\s*' + name, src).group(1)
+    body = re.sub(r'//.*', '', body)
+    values = {}
+    value = 0
+    for member in body.split(','):
+        if not member.strip():
+            continue
+        parts = member.split('=')
+        if len(parts) > 1:
+            value = int(parts[1].strip(), 0)
+        values[parts[0].strip()] = value
+        value += 1
+    return values
+
+
+def trace_command_id():
+    """Find the first two bytes of COMM_EXT_NRF_TRACE packets in datatypes.h
+    next to this script."""
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'datatypes.h')
+    with open(path) as f:
+        src = f.read()
+    return bytes([enum_values(src, 'COMM_PACKET_ID')['COMM_EXT_NRF_BRIDGE'],
+                  enum_values(src, 'COMM_EXT_NRF_CMD')['COMM_EXT_NRF_TRACE']])
+
+
+def packets(data):
+    """Yield the payloads of the VESC packets in a byte stream."""
+    i = 0
+    while i < len(data):
+        start = data[i]
+        if start not in (2, 3, 4):
+            i += 1
+            continue
+        hlen = start
+        if i + hlen > len(data):
+            break
+        plen = int.from_bytes(data[i + 1:i + hlen], 'big')
+        end = i + hlen + plen + 3
+        if plen == 0 or end > len(data):
+            i += 1
+            continue
+        payload = data[i + hlen:i + hlen + plen]
+        crc = int.from_bytes(data[end - 3:end - 1], 'big')
+        if data[end - 1] != 3 or crc16(payload) != crc:
+            i += 1
+            continue
+        yield payload
+        i = end
+
+
+def records(stream):
+    for i in range(0, len(stream) - RECORD_LEN + 1, RECORD_LEN):
+        yield struct.unpack('>IBxH', stream[i:i + RECORD_LEN])
+
+
+def convert(stream, hz):
+    events = []
+    last = None
+    time = 0
+    in_timeslot = False
+
+    def meta(tid, name):
+        events.append({'ph': 'M', 'pid': 0, 'tid': tid, 'name': 'thread_name',
+                       'args': {'name': name}})
+
+    meta(TID_TIMESLOT, 'timeslot')
+    meta(TID_ESB, 'esb')
+    meta(TID_BLE, 'ble')
+    meta(TID_UART, 'uart')
+    meta(TID_TRACE, 'trace')
+    handlers = set()
+
+    for stamp, event, arg in records(stream):
+        # The counter wraps. Records can be slightly out of order when an
+        # interrupt records while another record is being written, so a
+        # small step back is a step back and not a wrap. The heartbeat makes
+        # sure that there is never a step of more than half the range.
+        if last is None:
+            last = stamp
+        delta = (stamp - last) & 0xFFFFFFFF
+        if delta >= 0x80000000:
+            delta -= 0x100000000
+        time += delta
+        last = stamp
+
+        name = EVENTS[event] if event < len(EVENTS) else 'event_%d' % event
+        e = {'name': name, 'pid': 0, 'ts': time * 1e6 / hz}
+
+        if name in ('packet_rx', 'packet_tx'):
+            handler = arg >> 12
+            if handler not in handlers:
+                handlers.add(handler)
+                meta(TID_HANDLER + handler, 'handler %d' % handler)
+            e.update(ph='i', s='t', tid=TID_HANDLER + handler,
+                     args={'len': arg & 0xFFF})
+        elif name == 'timeslot_start':
+            if in_timeslot:
+                events.append(dict(e, name='timeslot', ph='E', tid=TID_TIMESLOT))
+            e.update(name='timeslot', ph='B', tid=TID_TIMESLOT)
+            in_timeslot = True
+        elif name in ('timeslot_end', 'timeslot_extend_fail'):
+            if not in_timeslot:
+                continue
+            e.update(name='timeslot', ph='E', tid=TID_TIMESLOT, args={'reason': name})
+            in_timeslot = False
+        elif name == 'timeslot_extend':
+            e.update(ph='i', s='t', tid=TID_TIMESLOT)
+        elif name.startswith('esb_'):
+            e.update(ph='i', s='t', tid=TID_ESB)
+        elif name == 'ble_hvn_complete':
+            e.update(ph='i', s='t', tid=TID_BLE, args={'count': arg})
+        elif name == 'uart_error':
+            e.update(ph='i', s='t', tid=TID_UART, args={'errorsrc': arg})
+        elif name == 'lost':
+            e.update(ph='i', s='g', tid=TID_TRACE, args={'records': arg})
+        else:
+            continue
+
+        events.append(e)
+
+    return {'traceEvents': events, 'displayTimeUnit': 'ns'}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('input', help='binary capture, - for stdin')
+    parser.add_argument('output', nargs='?', default='-', help='JSON file, - for stdout')
+    parser.add_argument('--packets', action='store_true',
+                        help='the input is a stream of VESC packets')
+    parser.add_argument('--hz', type=float, default=64e6,
+                        help='timestamp rate, TRACE_CLOCK_HZ (default: %(default).0f)')
+    args = parser.parse_args()
+
+    if args.input == '-':
+        data = sys.stdin.buffer.read()
+    else:
+        with open(args.input, 'rb') as f:
+            data = f.read()
+
+    if args.packets:
+        cmd = trace_command_id()
+        # The answer to enabling the trace has one byte after the command
+        data = b''.join(p[2:] for p in packets(data)
+                        if p[:2] == cmd and (len(p) - 2) % RECORD_LEN == 0)
+
+    trace = convert(data, args.hz)
+
+    if args.output == '-':
+        json.dump(trace, sys.stdout)
+    else:
+        with open(args.output, 'w') as f:
+            json.dump(trace, f)
+
+
+if __name__ == '__main__':
+    main()
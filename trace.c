@@ -0,0 +1,171 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Binary event trace.
+ *
+ * Events are timestamped with the cycle counter and stored in a ring of
+ * TRACE_RECORDS records. Any context can record at any time: a slot is
+ * claimed with LDREX/STREX on the write index, so recording never masks
+ * interrupts and costs a few tens of cycles. When the reader falls behind,
+ * the oldest records are overwritten, and a TRACE_LOST record with the
+ * number of lost records takes their place in the output.
+ *
+ * Every slot carries the lap of the write index it was written in, with the
+ * top bit set while the writer is busy with it. The reader only takes a
+ * record when the lap is the expected one before and after copying it, so
+ * it neither reads records that are half written nor records that were
+ * overwritten while it was copying them.
+ *
+ * The output stream consists of TRACE_RECORD_LEN byte records:
+ * [u32 timestamp][u8 event][u8 reserved][u16 arg], big endian like the
+ * rest of the protocol. The timestamp wraps, a heartbeat record every
+ * TRACE_HEARTBEAT ticks makes sure that the decoder does not miss a wrap.
+ * tools/trace2json.py turns the stream into a Chrome/Perfetto trace.
+ *
+ * trace_read and trace_timerfunc are not reentrant, they should be called
+ * from one context.
+ */
+
+#ifndef TRACE_CYCLES
+#include "nrf.h"
+#define USE_DWT
+#endif
+#include "trace.h"
+#include "buffer.h"
+
+#include <string.h>
+
+// Private types
+typedef struct {
+	uint32_t time;
+	uint16_t arg;
+	uint8_t event;
+	volatile uint8_t lap;
+} RECORD_t;
+
+#define LAP_BUSY					0x80
+#define LAP(ind)					((((ind) / TRACE_RECORDS) + 1) & 0x7F)
+
+// Private variables
+static RECORD_t m_records[TRACE_RECORDS];
+static volatile uint32_t m_write = 0;
+static uint32_t m_read = 0;
+static uint32_t m_heartbeat = 0;
+
+void trace_init(void) {
+#if TRACE && defined(USE_DWT)
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+	memset(m_records, 0, sizeof(m_records));
+	m_write = 0;
+	m_read = 0;
+	m_heartbeat = 0;
+}
+
+/**
+ * Record an event. Can be called from any context.
+ *
+ * @param event
+ * The event.
+ *
+ * @param arg
+ * Event specific argument, see TRACE_EVENT_ID.
+ */
+void trace_event(TRACE_EVENT_ID event, uint16_t arg) {
+	uint32_t ind;
+	do {
+		ind = __LDREXW(&m_write);
+	} while (__STREXW(ind + 1, &m_write));
+
+	RECORD_t *r = &m_records[ind & (TRACE_RECORDS - 1)];
+	r->lap = LAP_BUSY;
+	__DMB();
+	r->time = TRACE_CYCLES();
+	r->event = event;
+	r->arg = arg;
+	__DMB();
+	r->lap = LAP(ind);
+}
+
+/**
+ * Read recorded events into the output stream format.
+ *
+ * @param data
+ * Buffer to write the records to.
+ *
+ * @param max_len
+ * Size of the buffer. Only whole records are written.
+ *
+ * @return
+ * The number of bytes written.
+ */
+unsigned int trace_read(uint8_t *data, unsigned int max_len) {
+	int32_t ind = 0;
+
+	uint32_t lost = m_write - m_read;
+	if (lost > TRACE_RECORDS) {
+		lost -= TRACE_RECORDS;
+		m_read += lost;
+
+		if (max_len < TRACE_RECORD_LEN) {
+			return 0;
+		}
+
+		buffer_append_uint32(data, TRACE_CYCLES(), &ind);
+		data[ind++] = TRACE_LOST;
+		data[ind++] = 0;
+		buffer_append_uint16(data, lost > 0xFFFF ? 0xFFFF : lost, &ind);
+	}
+
+	while ((unsigned int)ind + TRACE_RECORD_LEN <= max_len && m_read != m_write) {
+		RECORD_t *r = &m_records[m_read & (TRACE_RECORDS - 1)];
+		uint8_t lap = LAP(m_read);
+
+		if (r->lap != lap) {
+			// Still being written, or overwritten already. The latter is
+			// handled on the next call.
+			break;
+		}
+
+		__DMB();
+		uint32_t time = r->time;
+		uint8_t event = r->event;
+		uint16_t arg = r->arg;
+		__DMB();
+
+		if (r->lap != lap) {
+			break;
+		}
+
+		buffer_append_uint32(data, time, &ind);
+		data[ind++] = event;
+		data[ind++] = 0;
+		buffer_append_uint16(data, arg, &ind);
+		m_read++;
+	}
+
+	return ind;
+}
+
+void trace_timerfunc(void) {
+	if (++m_heartbeat >= TRACE_HEARTBEAT) {
+		m_heartbeat = 0;
+		trace_event(TRACE_HEARTBEAT_EVT, 0);
+	}
+}
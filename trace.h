@@ -0,0 +1,72 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Settings
+#ifndef TRACE
+#define TRACE						0		// Set to 1 to record, normally from the Makefile
+#endif
+
+#define TRACE_RECORDS				512		// Ring size in records, must be a power of two
+#define TRACE_RECORD_LEN			8		// Bytes per record in the output stream
+#define TRACE_HEARTBEAT				1000	// Ticks between heartbeat records
+#define TRACE_RTT_CHANNEL			1		// RTT up buffer the stream is written to
+#define TRACE_CLOCK_HZ				64000000	// Timestamp rate
+
+// The timestamp counter. Can be replaced to run the recording on another target.
+#ifndef TRACE_CYCLES
+#define TRACE_CYCLES()				(DWT->CYCCNT)
+#endif
+
+// Events. Do not reorder, the host decoder knows them by number.
+typedef enum {
+	TRACE_LOST = 0,					// arg: records overwritten before they were read
+	TRACE_HEARTBEAT_EVT,			// arg: 0
+	TRACE_PACKET_RX,				// arg: TRACE_PACKET_ARG
+	TRACE_PACKET_TX,				// arg: TRACE_PACKET_ARG
+	TRACE_TIMESLOT_START,			// arg: 0
+	TRACE_TIMESLOT_EXTEND,			// arg: 0
+	TRACE_TIMESLOT_END,				// arg: 0
+	TRACE_TIMESLOT_EXTEND_FAIL,		// arg: 0
+	TRACE_ESB_TX_SUCCESS,			// arg: 0
+	TRACE_ESB_TX_FAIL,				// arg: 0
+	TRACE_BLE_HVN_COMPLETE,			// arg: notifications completed
+	TRACE_UART_ERROR				// arg: UARTE ERRORSRC
+} TRACE_EVENT_ID;
+
+// Packet handler in the upper 4 bits, length in the lower 12
+#define TRACE_PACKET_ARG(handler, len)	((uint16_t)(((handler) << 12) | ((len) > 0xFFF ? 0xFFF : (len))))
+
+// Recording, compiled out unless TRACE is set
+#if TRACE
+#define TRACE_EVENT(event, arg)		trace_event(event, arg)
+#else
+#define TRACE_EVENT(event, arg)
+#endif
+
+// Functions
+void trace_init(void);
+void trace_event(TRACE_EVENT_ID event, uint16_t arg);
+unsigned int trace_read(uint8_t *data, unsigned int max_len);
+void trace_timerfunc(void);
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,646 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * UARTE transport with EasyDMA in both directions.
+ *
+ * RX runs continuously into a ring of DMA buffers. The ENDRX_STARTRX short
+ * moves on to the next buffer without CPU involvement, and the pointer for
+ * the buffer after that is set up when RXSTARTED fires. Every received byte
+ * increments a counter timer over PPI, so the main loop can find out how far
+ * the DMA has got at any time. A second timer is restarted on every byte and
+ * fires when the line has been idle for UART_DMA_IDLE_US, which together with
+ * ENDRX makes sure that the main loop wakes up when there is data to process.
+ *
+ * TX copies outgoing packets into ring buffers and sends them from the
+ * ENDTX interrupt. Every context that queues packets (main loop, SoftDevice
+ * events, timers, ESB) has its own rings, one per priority. Each ring has a
+ * single producer and the UARTE interrupt as its single consumer, so packets
+ * are queued without a critical region: the producer copies the data, then
+ * publishes the packet with one store. The UARTE interrupt is pended to
+ * pick it up.
+ *
+ * Which ring to send from is decided at packet boundaries only. The highest
+ * priority with a complete packet wins, and within a priority the packets of
+ * all contexts go out in the order of their sequence numbers. A context can
+ * take the sequence number ahead of queueing with uart_dma_reserve, e.g. in
+ * the same critical region as other state that has to be in the same order,
+ * and copy the packet outside of it. Later packets of the priority wait until
+ * the reserved one has been queued.
+ * A packet therefore never waits for more than the packet that is on the
+ * line when it is queued, regardless of how much lower priority data there
+ * is. The time each packet spent queued is recorded in a histogram per
+ * priority.
+ */
+
+#include "uart_dma.h"
+#include "nrf.h"
+#include "nrf_gpio.h"
+#include "app_util_platform.h"
+#include "app_timer.h"
+#include "isr_stats.h"
+#include "trace.h"
+
+#include <string.h>
+
+#define RX_RING_LEN					(UART_DMA_RX_BUF_NUM * UART_DMA_RX_BUF_LEN)
+
+// Private types
+typedef struct {
+	uint16_t len;
+	uint32_t time;
+	uint32_t seq;
+} TX_FRAME_t;
+
+// head, frame_head, drops and the reservation are only written by the
+// producer, tail and frame_tail only by the consumer.
+typedef struct {
+	uint8_t *buf;
+	uint32_t size;
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	TX_FRAME_t frames[UART_DMA_TX_FRAMES];
+	volatile uint32_t frame_head;
+	volatile uint32_t frame_tail;
+	volatile uint32_t drops;
+	uint32_t reserved;				// Bytes reserved by uart_dma_reserve, 0 if none
+	uint32_t reserved_seq;
+} TX_LANE_t;
+
+#define TX_LANE(b)					{.buf = b, .size = sizeof(b)}
+
+// Private variables
+static uint8_t m_rx_buf[UART_DMA_RX_BUF_NUM][UART_DMA_RX_BUF_LEN];
+static volatile uint32_t m_rx_next = 0;
+static uint32_t m_rx_read = 0;		// Byte count handed to rx_func
+static uint32_t m_rx_pos = 0;		// Where m_rx_read is in the ring
+static volatile uint32_t m_rx_errors = 0;
+static uint8_t m_tx_buf_high[UART_DMA_CTX_NUM][UART_DMA_TX_BUF_LEN_HIGH];
+static uint8_t m_tx_buf_thread[UART_DMA_TX_BUF_LEN];
+static uint8_t m_tx_buf_ble[UART_DMA_TX_BUF_LEN];
+static uint8_t m_tx_buf_small[UART_DMA_CTX_NUM - 2][UART_DMA_TX_BUF_LEN_SMALL];
+static TX_LANE_t m_tx_lanes[UART_DMA_CTX_NUM][UART_DMA_PRIO_NUM] = {
+		[UART_DMA_CTX_THREAD] = {TX_LANE(m_tx_buf_high[UART_DMA_CTX_THREAD]), TX_LANE(m_tx_buf_thread)},
+		[UART_DMA_CTX_BLE] = {TX_LANE(m_tx_buf_high[UART_DMA_CTX_BLE]), TX_LANE(m_tx_buf_ble)},
+		[UART_DMA_CTX_TIMER] = {TX_LANE(m_tx_buf_high[UART_DMA_CTX_TIMER]), TX_LANE(m_tx_buf_small[0])},
+		[UART_DMA_CTX_ESB] = {TX_LANE(m_tx_buf_high[UART_DMA_CTX_ESB]), TX_LANE(m_tx_buf_small[1])},
+		[UART_DMA_CTX_OTHER] = {TX_LANE(m_tx_buf_high[UART_DMA_CTX_OTHER]), TX_LANE(m_tx_buf_small[2])}
+};
+static uint32_t m_tx_hist[UART_DMA_PRIO_NUM][UART_DMA_HIST_BINS];
+static volatile uint32_t m_tx_seq[UART_DMA_PRIO_NUM];		// Next sequence number to take
+static uint32_t m_tx_seq_next[UART_DMA_PRIO_NUM];			// Next sequence number to send
+static uint32_t m_tx_seq_hold[UART_DMA_PRIO_NUM];			// First one held back by uart_dma_tx_pause
+static volatile uint32_t m_tx_len = 0;
+static TX_LANE_t * volatile m_tx_lane = 0;
+static volatile uint32_t m_tx_frame_left = 0;
+static volatile bool m_tx_hold = false;
+static volatile uint32_t m_baud_pending = 0;
+static void(*m_rx_func)(const uint8_t *data, size_t len) = 0;
+
+// Private functions
+static int tx_context(void);
+static uint32_t tx_seq_take(int prio);
+static bool tx_push(TX_LANE_t *lane, const packet_segment *segs, int seg_num, int prio);
+static void tx_start(void);
+
+void uart_dma_init(uint32_t rx_pin, uint32_t tx_pin, uint32_t baudrate,
+		void(*rx_func)(const uint8_t *data, size_t len)) {
+	m_rx_func = rx_func;
+	m_rx_next = 0;
+	m_rx_read = 0;
+	m_rx_pos = 0;
+	for (int i = 0;i < UART_DMA_CTX_NUM;i++) {
+		for (int j = 0;j < UART_DMA_PRIO_NUM;j++) {
+			m_tx_lanes[i][j].head = 0;
+			m_tx_lanes[i][j].tail = 0;
+			m_tx_lanes[i][j].frame_head = 0;
+			m_tx_lanes[i][j].frame_tail = 0;
+			m_tx_lanes[i][j].reserved = 0;
+		}
+	}
+	for (int i = 0;i < UART_DMA_PRIO_NUM;i++) {
+		m_tx_seq[i] = 0;
+		m_tx_seq_next[i] = 0;
+	}
+	m_tx_len = 0;
+	m_tx_frame_left = 0;
+	m_tx_hold = false;
+	m_baud_pending = 0;
+
+	nrf_gpio_pin_set(tx_pin);
+	nrf_gpio_cfg_output(tx_pin);
+	nrf_gpio_cfg_input(rx_pin, NRF_GPIO_PIN_NOPULL);
+
+	UART_DMA_UARTE->PSEL.TXD = tx_pin;
+	UART_DMA_UARTE->PSEL.RXD = rx_pin;
+	UART_DMA_UARTE->PSEL.RTS = 0xFFFFFFFF;
+	UART_DMA_UARTE->PSEL.CTS = 0xFFFFFFFF;
+	UART_DMA_UARTE->BAUDRATE = baudrate;
+	UART_DMA_UARTE->CONFIG = 0;
+
+	// Byte counter
+	UART_DMA_COUNT_TIMER->TASKS_STOP = 1;
+	UART_DMA_COUNT_TIMER->MODE = TIMER_MODE_MODE_Counter;
+	UART_DMA_COUNT_TIMER->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
+	UART_DMA_COUNT_TIMER->TASKS_CLEAR = 1;
+	UART_DMA_COUNT_TIMER->TASKS_START = 1;
+
+	// Idle timer, 1 us resolution
+	UART_DMA_IDLE_TIMER->TASKS_STOP = 1;
+	UART_DMA_IDLE_TIMER->MODE = TIMER_MODE_MODE_Timer;
+	UART_DMA_IDLE_TIMER->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
+	UART_DMA_IDLE_TIMER->PRESCALER = 4;
+	UART_DMA_IDLE_TIMER->CC[0] = UART_DMA_IDLE_US;
+	UART_DMA_IDLE_TIMER->SHORTS = TIMER_SHORTS_COMPARE0_CLEAR_Msk | TIMER_SHORTS_COMPARE0_STOP_Msk;
+	UART_DMA_IDLE_TIMER->TASKS_CLEAR = 1;
+	UART_DMA_IDLE_TIMER->EVENTS_COMPARE[0] = 0;
+	UART_DMA_IDLE_TIMER->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+
+	NRF_PPI->CH[UART_DMA_PPI_COUNT].EEP = (uint32_t)&UART_DMA_UARTE->EVENTS_RXDRDY;
+	NRF_PPI->CH[UART_DMA_PPI_COUNT].TEP = (uint32_t)&UART_DMA_COUNT_TIMER->TASKS_COUNT;
+	NRF_PPI->FORK[UART_DMA_PPI_COUNT].TEP = (uint32_t)&UART_DMA_IDLE_TIMER->TASKS_CLEAR;
+	NRF_PPI->CH[UART_DMA_PPI_IDLE_START].EEP = (uint32_t)&UART_DMA_UARTE->EVENTS_RXDRDY;
+	NRF_PPI->CH[UART_DMA_PPI_IDLE_START].TEP = (uint32_t)&UART_DMA_IDLE_TIMER->TASKS_START;
+	NRF_PPI->CHENSET = (1 << UART_DMA_PPI_COUNT) | (1 << UART_DMA_PPI_IDLE_START);
+
+	UART_DMA_UARTE->EVENTS_RXSTARTED = 0;
+	UART_DMA_UARTE->EVENTS_ENDRX = 0;
+	UART_DMA_UARTE->EVENTS_ENDTX = 0;
+	UART_DMA_UARTE->EVENTS_ERROR = 0;
+	UART_DMA_UARTE->EVENTS_RXTO = 0;
+	UART_DMA_UARTE->ERRORSRC = UART_DMA_UARTE->ERRORSRC;
+	UART_DMA_UARTE->SHORTS = UARTE_SHORTS_ENDRX_STARTRX_Msk;
+	UART_DMA_UARTE->INTENSET = UARTE_INTENSET_RXSTARTED_Msk | UARTE_INTENSET_ENDRX_Msk |
+			UARTE_INTENSET_ENDTX_Msk | UARTE_INTENSET_ERROR_Msk;
+	UART_DMA_UARTE->ENABLE = UARTE_ENABLE_ENABLE_Enabled;
+
+	NVIC_SetPriority(UART_DMA_UARTE_IRQn, APP_IRQ_PRIORITY_LOW);
+	NVIC_ClearPendingIRQ(UART_DMA_UARTE_IRQn);
+	NVIC_EnableIRQ(UART_DMA_UARTE_IRQn);
+	NVIC_SetPriority(UART_DMA_IDLE_TIMER_IRQn, APP_IRQ_PRIORITY_LOW);
+	NVIC_ClearPendingIRQ(UART_DMA_IDLE_TIMER_IRQn);
+	NVIC_EnableIRQ(UART_DMA_IDLE_TIMER_IRQn);
+
+	UART_DMA_UARTE->RXD.PTR = (uint32_t)m_rx_buf[0];
+	UART_DMA_UARTE->RXD.MAXCNT = UART_DMA_RX_BUF_LEN;
+	UART_DMA_UARTE->TASKS_STARTRX = 1;
+}
+
+void uart_dma_uninit(void) {
+	NVIC_DisableIRQ(UART_DMA_UARTE_IRQn);
+	NVIC_DisableIRQ(UART_DMA_IDLE_TIMER_IRQn);
+	NRF_PPI->CHENCLR = (1 << UART_DMA_PPI_COUNT) | (1 << UART_DMA_PPI_IDLE_START);
+
+	UART_DMA_UARTE->INTENCLR = 0xFFFFFFFF;
+	UART_DMA_UARTE->SHORTS = 0;
+
+	UART_DMA_UARTE->EVENTS_RXTO = 0;
+	UART_DMA_UARTE->TASKS_STOPRX = 1;
+	while (!UART_DMA_UARTE->EVENTS_RXTO) {}
+
+	if (m_tx_len) {
+		UART_DMA_UARTE->EVENTS_TXSTOPPED = 0;
+		UART_DMA_UARTE->TASKS_STOPTX = 1;
+		while (!UART_DMA_UARTE->EVENTS_TXSTOPPED) {}
+		m_tx_len = 0;
+		m_tx_frame_left = 0;
+	}
+
+	UART_DMA_UARTE->ENABLE = UARTE_ENABLE_ENABLE_Disabled;
+	UART_DMA_UARTE->PSEL.TXD = 0xFFFFFFFF;
+	UART_DMA_UARTE->PSEL.RXD = 0xFFFFFFFF;
+
+	UART_DMA_COUNT_TIMER->TASKS_SHUTDOWN = 1;
+	UART_DMA_IDLE_TIMER->TASKS_SHUTDOWN = 1;
+	UART_DMA_IDLE_TIMER->INTENCLR = 0xFFFFFFFF;
+}
+
+/**
+ * Hand everything the DMA has received since the last call to rx_func. This
+ * should be called from the main loop whenever it wakes up.
+ *
+ * @return
+ * false if data was lost since the last call because the RX ring overflowed.
+ * The caller should reset its decoder state in that case. Line errors are
+ * only counted, corrupted bytes are caught by the packet CRC.
+ */
+bool uart_dma_process(void) {
+	bool res = true;
+
+	UART_DMA_COUNT_TIMER->TASKS_CAPTURE[0] = 1;
+	uint32_t cnt = UART_DMA_COUNT_TIMER->CC[0];
+	uint32_t avail = cnt - m_rx_read;
+
+	// The buffer the DMA is writing to right now cannot be trusted beyond
+	// what has been counted, and the one before it has been reused if we
+	// fell more than the ring size behind.
+	if (avail > (UART_DMA_RX_BUF_NUM - 1) * UART_DMA_RX_BUF_LEN) {
+		m_rx_pos = (m_rx_pos + avail % RX_RING_LEN) % RX_RING_LEN;
+		m_rx_read = cnt;
+		avail = 0;
+		res = false;
+	}
+
+	// The ring position is advanced along with the count rather than derived
+	// from it, as RX_RING_LEN does not divide 2^32 when the buffers are 255
+	// bytes.
+	while (avail > 0) {
+		uint32_t buf = m_rx_pos / UART_DMA_RX_BUF_LEN;
+		uint32_t ofs = m_rx_pos % UART_DMA_RX_BUF_LEN;
+		uint32_t len = UART_DMA_RX_BUF_LEN - ofs;
+		if (len > avail) {
+			len = avail;
+		}
+
+		if (m_rx_func) {
+			m_rx_func(m_rx_buf[buf] + ofs, len);
+		}
+
+		m_rx_read += len;
+		m_rx_pos += len;
+		if (m_rx_pos >= RX_RING_LEN) {
+			m_rx_pos = 0;
+		}
+		avail -= len;
+	}
+
+	return res;
+}
+
+/**
+ * Reserve room and the position in the queue for the next packet that the
+ * calling context sends with prio. Packets that other contexts queue after
+ * this call are sent after it, even if they are queued before it. Every
+ * successful reservation must be followed by uart_dma_send from the same
+ * context, as the priority is stalled until then.
+ *
+ * In contexts that share a queue (UART_DMA_CTX_OTHER) nothing is reserved and
+ * the packet takes its position when it is queued.
+ *
+ * @param len
+ * Length of the packet.
+ *
+ * @param prio
+ * UART_DMA_PRIO_HIGH or UART_DMA_PRIO_NORMAL.
+ *
+ * @return
+ * false if there is no room, in which case the packet should not be sent. It
+ * is counted as dropped.
+ */
+bool uart_dma_reserve(uint32_t len, int prio) {
+	int ctx = tx_context();
+	TX_LANE_t *lane = &m_tx_lanes[ctx][prio];
+
+	if (ctx == UART_DMA_CTX_OTHER) {
+		return true;
+	}
+
+	if (lane->reserved || len == 0 || len > (lane->size - (lane->head - lane->tail)) ||
+			(lane->frame_head - lane->frame_tail) >= UART_DMA_TX_FRAMES) {
+		lane->drops++;
+		return false;
+	}
+
+	lane->reserved_seq = tx_seq_take(prio);
+	lane->reserved = len;
+	return true;
+}
+
+/**
+ * Queue a packet for transmission. Either all segments are queued or, if
+ * there is not enough room, none of them. Can be called from any context,
+ * without a critical region.
+ *
+ * @param segs
+ * The segments that make up the packet.
+ *
+ * @param seg_num
+ * Number of segments.
+ *
+ * @param prio
+ * UART_DMA_PRIO_HIGH or UART_DMA_PRIO_NORMAL.
+ *
+ * @return
+ * true if the packet was queued.
+ */
+bool uart_dma_send(const packet_segment *segs, int seg_num, int prio) {
+	int ctx = tx_context();
+	bool res = false;
+
+	if (ctx == UART_DMA_CTX_OTHER) {
+		// Possibly more than one producer
+		CRITICAL_REGION_ENTER();
+		res = tx_push(&m_tx_lanes[ctx][prio], segs, seg_num, prio);
+		CRITICAL_REGION_EXIT();
+	} else {
+		res = tx_push(&m_tx_lanes[ctx][prio], segs, seg_num, prio);
+	}
+
+	if (!res) {
+		m_tx_lanes[ctx][prio].drops++;
+	}
+
+	// Also when nothing was queued, a dropped reservation can unblock others
+	ISR_STATS_PEND(ISR_STATS_UART);
+	NVIC_SetPendingIRQ(UART_DMA_UARTE_IRQn);
+
+	return res;
+}
+
+/**
+ * Get the queueing latency histogram of a priority. Bin 0 counts packets
+ * that were sent within one RTC tick of being queued, and bin n > 0 those
+ * that waited 2^(n - 1) to 2^n - 1 ticks. The last bin also counts anything
+ * longer.
+ *
+ * @param prio
+ * UART_DMA_PRIO_HIGH or UART_DMA_PRIO_NORMAL.
+ *
+ * @return
+ * UART_DMA_HIST_BINS counters.
+ */
+const uint32_t *uart_dma_tx_hist(int prio) {
+	return m_tx_hist[prio];
+}
+
+/**
+ * Get the number of packets of a priority that were dropped because their
+ * queue was full, over all contexts.
+ *
+ * @param prio
+ * UART_DMA_PRIO_HIGH or UART_DMA_PRIO_NORMAL.
+ */
+uint32_t uart_dma_tx_drops(int prio) {
+	uint32_t res = 0;
+	for (int i = 0;i < UART_DMA_CTX_NUM;i++) {
+		res += m_tx_lanes[i][prio].drops;
+	}
+	return res;
+}
+
+/**
+ * Hold back data queued from now on. Everything queued or reserved before
+ * the call is still sent. Queued data is kept until transmission is resumed.
+ *
+ * @param pause
+ * true to pause, false to resume.
+ */
+void uart_dma_tx_pause(bool pause) {
+	CRITICAL_REGION_ENTER();
+	for (int i = 0;i < UART_DMA_PRIO_NUM;i++) {
+		m_tx_seq_hold[i] = m_tx_seq[i];
+	}
+	m_tx_hold = pause;
+	if (!pause) {
+		tx_start();
+	}
+	CRITICAL_REGION_EXIT();
+}
+
+/**
+ * Change the baud rate without restarting the peripheral, so that nothing
+ * in the RX ring or the TX queue is lost. If a transfer is in progress the
+ * new rate is applied once it has completed.
+ *
+ * @param baudrate
+ * The BAUDRATE register value.
+ */
+void uart_dma_set_baudrate(uint32_t baudrate) {
+	CRITICAL_REGION_ENTER();
+	if (m_tx_len) {
+		m_baud_pending = baudrate;
+	} else {
+		UART_DMA_UARTE->BAUDRATE = baudrate;
+	}
+	CRITICAL_REGION_EXIT();
+}
+
+uint32_t uart_dma_rx_errors(void) {
+	return m_rx_errors;
+}
+
+static int tx_context(void) {
+	uint32_t ipsr = __get_IPSR();
+
+	if (ipsr == 0) {
+		return UART_DMA_CTX_THREAD;
+	}
+
+	// Exception numbers of external interrupts start at 16
+	switch ((int)ipsr - 16) {
+	case UART_DMA_CTX_BLE_IRQn: return UART_DMA_CTX_BLE;
+	case UART_DMA_CTX_TIMER_IRQn: return UART_DMA_CTX_TIMER;
+	case UART_DMA_CTX_ESB_IRQn: return UART_DMA_CTX_ESB;
+	default: return UART_DMA_CTX_OTHER;
+	}
+}
+
+/*
+ * Queue order over all lanes of a priority, taken atomically as every context
+ * can preempt another one here.
+ */
+static uint32_t tx_seq_take(int prio) {
+	uint32_t seq;
+	do {
+		seq = __LDREXW(&m_tx_seq[prio]);
+	} while (__STREXW(seq + 1, &m_tx_seq[prio]));
+	return seq;
+}
+
+/*
+ * Only to be called by the producer of the lane. A packet that does not fit
+ * in its reservation is dropped, and an empty frame takes its place so that
+ * the packets behind it are not stalled.
+ */
+static bool tx_push(TX_LANE_t *lane, const packet_segment *segs, int seg_num, int prio) {
+	uint32_t len = 0;
+	for (int i = 0;i < seg_num;i++) {
+		len += segs[i].len;
+	}
+
+	uint32_t head = lane->head;
+	uint32_t reserved = lane->reserved;
+	bool fits = len > 0 && len <= (lane->size - (head - lane->tail)) &&
+			(lane->frame_head - lane->frame_tail) < UART_DMA_TX_FRAMES;
+
+	if (reserved) {
+		lane->reserved = 0;
+		if (len > reserved) {
+			fits = false;
+		}
+	} else if (!fits) {
+		return false;
+	}
+
+	if (!fits) {
+		len = 0;
+		seg_num = 0;
+	}
+
+	for (int i = 0;i < seg_num;i++) {
+		const unsigned char *data = segs[i].data;
+		unsigned int left = segs[i].len;
+
+		while (left > 0) {
+			uint32_t ind = head & (lane->size - 1);
+			uint32_t n = lane->size - ind;
+			if (n > left) {
+				n = left;
+			}
+			memcpy(lane->buf + ind, data, n);
+			head += n;
+			data += n;
+			left -= n;
+		}
+	}
+
+	TX_FRAME_t *f = &lane->frames[lane->frame_head % UART_DMA_TX_FRAMES];
+	f->len = len;
+	f->time = app_timer_cnt_get();
+	f->seq = reserved ? lane->reserved_seq : tx_seq_take(prio);
+
+	// The data and the frame have to be in memory before the consumer can
+	// see the new frame_head.
+	__DMB();
+	lane->head = head;
+	lane->frame_head++;
+
+	return fits;
+}
+
+/*
+ * Must be called with the UARTE interrupt masked.
+ */
+static void tx_start(void) {
+	if (m_tx_len) {
+		return;
+	}
+
+	// Between packets, pick the next packet of the highest priority that has
+	// one. Empty frames of dropped reservations are skipped.
+	while (m_tx_frame_left == 0) {
+		TX_LANE_t *lane = 0;
+		TX_FRAME_t *f = 0;
+		int prio = 0;
+
+		for (int i = 0;i < UART_DMA_PRIO_NUM && !lane;i++) {
+			uint32_t seq = m_tx_seq_next[i];
+			if (m_tx_hold && (int32_t)(seq - m_tx_seq_hold[i]) >= 0) {
+				continue;
+			}
+
+			// Only one lane can have it. If none has, it is reserved but not
+			// queued yet.
+			for (int j = 0;j < UART_DMA_CTX_NUM;j++) {
+				TX_LANE_t *l = &m_tx_lanes[j][i];
+				if (l->frame_tail != l->frame_head &&
+						l->frames[l->frame_tail % UART_DMA_TX_FRAMES].seq == seq) {
+					lane = l;
+					f = &l->frames[l->frame_tail % UART_DMA_TX_FRAMES];
+					prio = i;
+					break;
+				}
+			}
+		}
+
+		if (!lane) {
+			return;
+		}
+
+		// The frame can be reused as soon as frame_tail moves on
+		uint32_t len = f->len;
+		uint32_t time = f->time;
+		lane->frame_tail++;
+		m_tx_seq_next[prio]++;
+
+		if (len == 0) {
+			continue;
+		}
+
+		uint32_t ticks = app_timer_cnt_diff_compute(app_timer_cnt_get(), time);
+		int bin = 0;
+		while (ticks && bin < (UART_DMA_HIST_BINS - 1)) {
+			ticks >>= 1;
+			bin++;
+		}
+		m_tx_hist[prio][bin]++;
+
+		m_tx_frame_left = len;
+		m_tx_lane = lane;
+	}
+
+	TX_LANE_t *lane = m_tx_lane;
+	uint32_t ind = lane->tail & (lane->size - 1);
+	uint32_t n = lane->size - ind;
+	if (n > m_tx_frame_left) {
+		n = m_tx_frame_left;
+	}
+	if (n > UART_DMA_MAXCNT) {
+		n = UART_DMA_MAXCNT;
+	}
+
+	m_tx_len = n;
+	UART_DMA_UARTE->TXD.PTR = (uint32_t)(lane->buf + ind);
+	UART_DMA_UARTE->TXD.MAXCNT = n;
+	UART_DMA_UARTE->EVENTS_ENDTX = 0;
+	UART_DMA_UARTE->TASKS_STARTTX = 1;
+}
+
+void UART_DMA_UARTE_IRQHandler(void) {
+	ISR_STATS_ENTER(ISR_STATS_UART);
+
+	if (UART_DMA_UARTE->EVENTS_RXSTARTED) {
+		UART_DMA_UARTE->EVENTS_RXSTARTED = 0;
+		// The current buffer is latched, point the DMA at the one after it
+		m_rx_next = (m_rx_next + 1) % UART_DMA_RX_BUF_NUM;
+		UART_DMA_UARTE->RXD.PTR = (uint32_t)m_rx_buf[m_rx_next];
+	}
+
+	if (UART_DMA_UARTE->EVENTS_ENDRX) {
+		// Only used to wake up the main loop
+		UART_DMA_UARTE->EVENTS_ENDRX = 0;
+	}
+
+	if (UART_DMA_UARTE->EVENTS_ERROR) {
+		UART_DMA_UARTE->EVENTS_ERROR = 0;
+		TRACE_EVENT(TRACE_UART_ERROR, UART_DMA_UARTE->ERRORSRC);
+		UART_DMA_UARTE->ERRORSRC = UART_DMA_UARTE->ERRORSRC;
+		m_rx_errors++;
+	}
+
+	if (UART_DMA_UARTE->EVENTS_ENDTX) {
+		UART_DMA_UARTE->EVENTS_ENDTX = 0;
+		m_tx_lane->tail += m_tx_len;
+		m_tx_frame_left -= m_tx_len;
+		m_tx_len = 0;
+
+		if (m_baud_pending) {
+			UART_DMA_UARTE->BAUDRATE = m_baud_pending;
+			m_baud_pending = 0;
+		}
+	}
+
+	// Also pended by uart_dma_send when a packet was queued
+	tx_start();
+
+	ISR_STATS_EXIT(ISR_STATS_UART);
+}
+
+void UART_DMA_IDLE_TIMER_IRQHandler(void) {
+	// Only used to wake up the main loop
+	UART_DMA_IDLE_TIMER->EVENTS_COMPARE[0] = 0;
+}
@@ -0,0 +1,95 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef UART_DMA_H_
+#define UART_DMA_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "packet.h"
+
+// Settings
+#ifdef NRF52840_XXAA
+#define UART_DMA_RX_BUF_LEN			256		// Size of each RX DMA buffer
+#define UART_DMA_RX_BUF_NUM			16		// Number of RX DMA buffers in the ring
+#define UART_DMA_TX_BUF_LEN			2048	// Normal priority TX buffer of the main loop and BLE, must be a power of two
+#define UART_DMA_MAXCNT				0xFFFF	// Largest EasyDMA transfer
+#else
+#define UART_DMA_RX_BUF_LEN			255
+#define UART_DMA_RX_BUF_NUM			8
+#define UART_DMA_TX_BUF_LEN			2048
+#define UART_DMA_MAXCNT				0xFF
+#endif
+
+// Normal priority TX buffer of the other contexts, must be a power of two. Only
+// for short packets, firmware writes are sent from the main loop and BLE.
+#define UART_DMA_TX_BUF_LEN_SMALL	512
+#define UART_DMA_TX_BUF_LEN_HIGH	256		// High priority TX buffer of every context, must be a power of two
+#define UART_DMA_TX_FRAMES			16		// Packets that can be queued per context and priority
+#define UART_DMA_HIST_BINS			16		// Queueing latency histogram bins
+
+#ifndef UART_DMA_IDLE_US
+#define UART_DMA_IDLE_US			200		// Line idle time after which received data is handed over
+#endif
+
+// Hardware resources. TIMER0 belongs to the SoftDevice, TIMER2/TIMER3 and
+// PPI channels 7 - 13 to nrf_esb.
+#define UART_DMA_UARTE				NRF_UARTE0
+#define UART_DMA_UARTE_IRQn			UARTE0_UART0_IRQn
+#define UART_DMA_UARTE_IRQHandler	UARTE0_UART0_IRQHandler
+#define UART_DMA_COUNT_TIMER		NRF_TIMER1
+#define UART_DMA_IDLE_TIMER			NRF_TIMER4
+#define UART_DMA_IDLE_TIMER_IRQn	TIMER4_IRQn
+#define UART_DMA_IDLE_TIMER_IRQHandler	TIMER4_IRQHandler
+#define UART_DMA_PPI_COUNT			0		// RXDRDY -> count byte, restart idle timer
+#define UART_DMA_PPI_IDLE_START		1		// RXDRDY -> start idle timer
+
+// Contexts that queue packets. Every context has its own TX queues, so that
+// queueing does not need a critical region. They are told apart by the
+// active interrupt. Contexts that are not listed here share one queue that
+// is filled within a critical region.
+#define UART_DMA_CTX_THREAD			0		// Main loop
+#define UART_DMA_CTX_BLE			1		// SoftDevice events
+#define UART_DMA_CTX_TIMER			2		// app_timer timeouts
+#define UART_DMA_CTX_ESB			3		// ESB packets, see esb_timeslot.c
+#define UART_DMA_CTX_OTHER			4
+#define UART_DMA_CTX_NUM			5
+#define UART_DMA_CTX_BLE_IRQn		SWI2_EGU2_IRQn
+#define UART_DMA_CTX_TIMER_IRQn		RTC1_IRQn
+#define UART_DMA_CTX_ESB_IRQn		WDT_IRQn
+
+// TX priorities
+#define UART_DMA_PRIO_HIGH			0
+#define UART_DMA_PRIO_NORMAL		1
+#define UART_DMA_PRIO_NUM			2
+
+// Functions
+void uart_dma_init(uint32_t rx_pin, uint32_t tx_pin, uint32_t baudrate,
+		void(*rx_func)(const uint8_t *data, size_t len));
+void uart_dma_uninit(void);
+bool uart_dma_process(void);
+bool uart_dma_reserve(uint32_t len, int prio);
+bool uart_dma_send(const packet_segment *segs, int seg_num, int prio);
+const uint32_t *uart_dma_tx_hist(int prio);
+uint32_t uart_dma_tx_drops(int prio);
+void uart_dma_tx_pause(bool pause);
+void uart_dma_set_baudrate(uint32_t baudrate);
+uint32_t uart_dma_rx_errors(void);
+
+#endif /* UART_DMA_H_ */
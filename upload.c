@@ -0,0 +1,612 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Pipelined firmware upload.
+ *
+ * VESC Tool sends COMM_WRITE_NEW_APP_DATA one chunk at a time and waits for
+ * the result before sending the next one, so over BLE most of the upload time
+ * is spent on round trips. Here every chunk is acknowledged to the client as
+ * soon as it has been buffered, and up to UPLOAD_WINDOW chunks are kept in
+ * flight to the VESC. The VESC answers each write with its offset, which is
+ * used to match the results. Writes that time out are sent again from the
+ * main loop, and once a write has failed every following chunk is answered
+ * with a failure so that VESC Tool aborts the upload.
+ *
+ * There is one more buffer than the window. When the last one is taken the
+ * acknowledgement is held back until a write has completed, which stalls the
+ * client for as long as the VESC is behind.
+ *
+ * Other packets from the client that arrive while writes are pending, such as
+ * the final COMM_JUMP_TO_BOOTLOADER or the erase for the next attempt, are
+ * held back until all writes have completed. Then they are forwarded in the
+ * order they arrived, with their routes, as if they had just come in. If the
+ * upload has failed they are dropped instead, until an erase starts a new
+ * upload, as are packets that do not fit in UPLOAD_HELD_LEN. The client gets
+ * [COMM_EXT_NRF_BRIDGE][COMM_EXT_NRF_UPLOAD_DROPPED][u8 command] for every
+ * dropped packet.
+ *
+ * The functions can be called from any context but the timer, which only
+ * runs upload_timerfunc. The state is kept within short critical regions,
+ * and the chunks are copied and sent outside of them. One context at a time
+ * sends the writes, oldest first, and one the held back packets.
+ */
+
+#include "upload.h"
+#include "packet.h"
+#include "buffer.h"
+#include "datatypes.h"
+#include "hal.h"
+
+#include <string.h>
+
+// Private types
+typedef enum {
+	SLOT_FREE = 0,
+	SLOT_FILLING,
+	SLOT_QUEUED,
+	SLOT_IN_FLIGHT
+} SLOT_STATE;
+
+typedef struct {
+	SLOT_STATE state;
+	uint32_t seq;
+	uint32_t offset;
+	uint16_t len;
+	uint16_t age;
+	uint8_t retries;
+	bool send;			// Due to be sent, see slots_send
+	uint8_t data[PACKET_MAX_PL_LEN];
+} UPLOAD_SLOT_t;
+
+typedef struct {
+	bool valid;
+	uint8_t cmd;
+	bool ok;
+	uint32_t offset;
+} UPLOAD_RESULT_t;
+
+#define SLOT_NUM		(UPLOAD_WINDOW + 1)
+#define HELD_HDR		4		// [ready][handler][len hi][len lo]
+
+// Private variables
+static UPLOAD_SLOT_t m_slots[SLOT_NUM];
+static uint32_t m_seq = 0;
+static int m_vesc_handler = 0;
+static void (*m_forward_func)(unsigned char *data, unsigned int len, int handler_num) = 0;
+static int m_client_handler = 0;
+static bool m_failed = false;
+static int m_erase_time = 0;
+static int m_idle_time = UPLOAD_IDLE_TIMEOUT;
+static int m_ack_slot = -1;
+static int m_send_slot = -1;				// Slot that slots_send is sending
+static uint8_t m_held[UPLOAD_HELD_LEN];		// HELD_HDR and the data per packet
+static unsigned int m_held_len = 0;
+static unsigned int m_held_pos = 0;			// Next packet to flush
+static bool m_held_flush = false;			// All writes are done, flush the held packets
+static bool m_held_busy = false;			// A context is flushing
+
+// Private functions
+static bool is_write(uint8_t cmd);
+static bool is_erase(uint8_t cmd);
+static void erase_start(void);
+static int slots_used(void);
+static void send_result(uint8_t cmd, bool ok, uint32_t offset);
+static void send_dropped(uint8_t cmd, int handler_num);
+static void result_send(const UPLOAD_RESULT_t *res);
+static void slot_done(UPLOAD_SLOT_t *s, bool ok, UPLOAD_RESULT_t *res);
+static void pump(void);
+static UPLOAD_SLOT_t *send_next(void);
+static void slots_send(void);
+static uint8_t *held_next(bool *forward);
+static void held_flush(void);
+
+/**
+ * @param vesc_handler_num
+ * Packet handler of the VESC, the writes are sent to it.
+ *
+ * @param forward_func
+ * Forwards a held back packet to the VESC and records its route, like
+ * packets that are not held back.
+ */
+void upload_init(int vesc_handler_num,
+		void (*forward_func)(unsigned char *data, unsigned int len, int handler_num)) {
+	m_vesc_handler = vesc_handler_num;
+	m_forward_func = forward_func;
+	memset(m_slots, 0, sizeof(m_slots));
+	m_send_slot = -1;
+	m_held_len = 0;
+	m_held_pos = 0;
+	m_held_flush = false;
+	m_held_busy = false;
+}
+
+/**
+ * Process a packet from a client before it is forwarded to the VESC.
+ *
+ * @return
+ * true if the packet was taken care of and should not be forwarded.
+ */
+bool upload_process_client(unsigned char *data, unsigned int len, int handler_num) {
+	if (len == 0) {
+		return false;
+	}
+
+	uint8_t cmd = data[0];
+
+	if (is_write(cmd) && len >= 5 && len <= PACKET_MAX_PL_LEN) {
+		int32_t ind = 1;
+		uint32_t offset = buffer_get_uint32(data, &ind);
+		UPLOAD_SLOT_t *s = 0;
+		bool duplicate = false;
+		bool failed = false;
+
+		CRITICAL_REGION_ENTER();
+		m_idle_time = 0;
+		m_client_handler = handler_num;
+		failed = m_failed;
+
+		for (int i = 0;i < SLOT_NUM && !failed;i++) {
+			UPLOAD_SLOT_t *c = &m_slots[i];
+
+			// A resend from a client that timed out while waiting for a
+			// held back acknowledgement.
+			if (c->state != SLOT_FREE && c->offset == offset && c->data[0] == cmd) {
+				duplicate = true;
+			}
+
+			if (!s && c->state == SLOT_FREE && i != m_send_slot) {
+				s = c;
+			}
+		}
+
+		if (s && !failed && !duplicate) {
+			s->state = SLOT_FILLING;
+			s->offset = offset;
+			s->data[0] = cmd;
+		}
+		CRITICAL_REGION_EXIT();
+
+		if (duplicate) {
+			return true;
+		}
+
+		if (failed || !s) {
+			// Failed before, or the client did not wait for the
+			// acknowledgement
+			send_result(cmd, false, offset);
+			return true;
+		}
+
+		memcpy(s->data, data, len);
+
+		UPLOAD_RESULT_t res = {0};
+
+		CRITICAL_REGION_ENTER();
+		if (m_failed) {
+			// Failed while the chunk was copied
+			s->state = SLOT_FREE;
+			res = (UPLOAD_RESULT_t){true, cmd, false, offset};
+		} else {
+			s->len = len;
+			s->seq = m_seq++;
+			s->age = 0;
+			s->retries = 0;
+			s->send = false;
+			s->state = SLOT_QUEUED;
+
+			if (slots_used() < SLOT_NUM) {
+				res = (UPLOAD_RESULT_t){true, cmd, true, offset};
+			} else {
+				m_ack_slot = s - m_slots;
+			}
+
+			pump();
+		}
+		CRITICAL_REGION_EXIT();
+
+		result_send(&res);
+		slots_send();
+		return true;
+	}
+
+	// The place in the queue is taken first, the copy is made outside of the
+	// critical region and held_flush stops at it until it is ready.
+	bool hold = false;
+	int pos = -1;
+
+	CRITICAL_REGION_ENTER();
+	if (slots_used() > 0 || m_held_len > 0) {
+		// Forwarding a packet that does not fit would reorder it with the
+		// held ones, so it is dropped.
+		hold = true;
+		if (m_held_len + len + HELD_HDR <= UPLOAD_HELD_LEN) {
+			pos = m_held_len;
+			m_held[pos] = false;
+			m_held[pos + 1] = handler_num;
+			m_held[pos + 2] = len >> 8;
+			m_held[pos + 3] = len;
+			m_held_len += len + HELD_HDR;
+		}
+	} else if (is_erase(cmd)) {
+		// Start of a new upload. The erase itself is forwarded as usual.
+		erase_start();
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (pos >= 0) {
+		memcpy(m_held + pos + HELD_HDR, data, len);
+
+		CRITICAL_REGION_ENTER();
+		m_held[pos] = true;
+		CRITICAL_REGION_EXIT();
+
+		held_flush();
+	} else if (hold) {
+		send_dropped(cmd, handler_num);
+	}
+
+	return hold;
+}
+
+/**
+ * Process a packet from the VESC.
+ *
+ * @return
+ * true if the packet was a write result for the pipeline and should not be
+ * passed on to the clients.
+ */
+bool upload_process_vesc(unsigned char *data, unsigned int len) {
+	if (len < 2) {
+		return false;
+	}
+
+	uint8_t cmd = data[0];
+
+	if (is_erase(cmd)) {
+		CRITICAL_REGION_ENTER();
+		m_erase_time = 0;
+		m_idle_time = 0;
+		CRITICAL_REGION_EXIT();
+		return false;
+	}
+
+	if (!is_write(cmd)) {
+		return false;
+	}
+
+	// Older firmwares do not send the offset back, in that case the oldest
+	// write is the one that completed.
+	bool has_offset = len >= 6;
+	uint32_t offset = 0;
+	if (has_offset) {
+		int32_t ind = 2;
+		offset = buffer_get_uint32(data, &ind);
+	}
+
+	UPLOAD_SLOT_t *s = 0;
+	UPLOAD_RESULT_t res = {0};
+
+	CRITICAL_REGION_ENTER();
+	for (int i = 0;i < SLOT_NUM;i++) {
+		UPLOAD_SLOT_t *c = &m_slots[i];
+		if (c->state == SLOT_IN_FLIGHT && c->data[0] == cmd &&
+				(!has_offset || c->offset == offset)) {
+			if (!s || (int32_t)(c->seq - s->seq) < 0) {
+				s = c;
+			}
+		}
+	}
+
+	if (s) {
+		m_idle_time = 0;
+		slot_done(s, data[1], &res);
+	}
+	CRITICAL_REGION_EXIT();
+
+	if (!s) {
+		return false;
+	}
+
+	result_send(&res);
+	slots_send();
+	held_flush();
+	return true;
+}
+
+/**
+ * @return
+ * true while an upload is in progress. Other traffic to the VESC, such as from
+ * the ESB remote, should be held back meanwhile.
+ */
+bool upload_active(void) {
+	return m_erase_time > 0 || slots_used() > 0 || m_held_len > 0 ||
+			m_idle_time < UPLOAD_IDLE_TIMEOUT;
+}
+
+/**
+ * Call this function every millisecond.
+ */
+void upload_timerfunc(void) {
+	UPLOAD_RESULT_t res = {0};
+
+	CRITICAL_REGION_ENTER();
+	if (m_erase_time > 0) {
+		m_erase_time--;
+	}
+
+	if (m_idle_time < UPLOAD_IDLE_TIMEOUT) {
+		m_idle_time++;
+	}
+
+	for (int i = 0;i < SLOT_NUM;i++) {
+		UPLOAD_SLOT_t *s = &m_slots[i];
+		if (s->state == SLOT_IN_FLIGHT && ++s->age >= UPLOAD_WRITE_TIMEOUT) {
+			if (s->retries < UPLOAD_WRITE_RETRIES) {
+				s->retries++;
+				s->age = 0;
+				s->send = true;
+			} else {
+				slot_done(s, false, &res);
+			}
+		}
+	}
+	CRITICAL_REGION_EXIT();
+
+	result_send(&res);
+}
+
+/**
+ * Send the writes that have timed out again and the held back packets once
+ * the writes are done. Call this function from the main loop, where there is
+ * room to queue full writes for the VESC. Writes are up to PACKET_MAX_PL_LEN
+ * long, more than the UART queues of the timer context can hold.
+ */
+void upload_process(void) {
+	slots_send();
+	held_flush();
+}
+
+static bool is_write(uint8_t cmd) {
+	return cmd == COMM_WRITE_NEW_APP_DATA || cmd == COMM_WRITE_NEW_APP_DATA_ALL_CAN;
+}
+
+static bool is_erase(uint8_t cmd) {
+	return cmd == COMM_ERASE_NEW_APP || cmd == COMM_ERASE_NEW_APP_ALL_CAN;
+}
+
+/*
+ * Call within a critical region, when an erase is forwarded.
+ */
+static void erase_start(void) {
+	m_failed = false;
+	m_erase_time = UPLOAD_ERASE_TIMEOUT;
+	m_idle_time = 0;
+}
+
+static int slots_used(void) {
+	int res = 0;
+	for (int i = 0;i < SLOT_NUM;i++) {
+		if (m_slots[i].state != SLOT_FREE) {
+			res++;
+		}
+	}
+	return res;
+}
+
+static void send_result(uint8_t cmd, bool ok, uint32_t offset) {
+	uint8_t buffer[6];
+	int32_t ind = 0;
+	buffer[ind++] = cmd;
+	buffer[ind++] = ok;
+	buffer_append_uint32(buffer, offset, &ind);
+	packet_send_packet(buffer, ind, m_client_handler);
+}
+
+static void send_dropped(uint8_t cmd, int handler_num) {
+	uint8_t buffer[3];
+	int32_t ind = 0;
+	buffer[ind++] = COMM_EXT_NRF_BRIDGE;
+	buffer[ind++] = COMM_EXT_NRF_UPLOAD_DROPPED;
+	buffer[ind++] = cmd;
+	packet_send_packet(buffer, ind, handler_num);
+}
+
+static void result_send(const UPLOAD_RESULT_t *res) {
+	if (res->valid) {
+		send_result(res->cmd, res->ok, res->offset);
+	}
+}
+
+/*
+ * Call within a critical region. A held back acknowledgement that is due is
+ * put in res, to be sent after the region.
+ */
+static void slot_done(UPLOAD_SLOT_t *s, bool ok, UPLOAD_RESULT_t *res) {
+	s->state = SLOT_FREE;
+
+	if (!ok) {
+		m_failed = true;
+	}
+
+	if (m_ack_slot >= 0) {
+		UPLOAD_SLOT_t *a = &m_slots[m_ack_slot];
+		*res = (UPLOAD_RESULT_t){true, a->data[0], !m_failed, a->offset};
+		m_ack_slot = -1;
+	}
+
+	pump();
+
+	if (slots_used() == 0 && m_held_len > 0) {
+		m_held_flush = true;
+	}
+}
+
+/*
+ * Start queued writes, oldest first, while there is room in the window. Call
+ * within a critical region, the writes are sent by slots_send.
+ */
+static void pump(void) {
+	// No point in writing more once a write has failed
+	if (m_failed) {
+		for (int i = 0;i < SLOT_NUM;i++) {
+			if (m_slots[i].state == SLOT_QUEUED) {
+				m_slots[i].state = SLOT_FREE;
+			}
+		}
+	}
+
+	for (;;) {
+		int in_flight = 0;
+		UPLOAD_SLOT_t *next = 0;
+
+		for (int i = 0;i < SLOT_NUM;i++) {
+			UPLOAD_SLOT_t *s = &m_slots[i];
+			if (s->state == SLOT_IN_FLIGHT) {
+				in_flight++;
+			} else if (s->state == SLOT_QUEUED) {
+				if (!next || (int32_t)(s->seq - next->seq) < 0) {
+					next = s;
+				}
+			}
+		}
+
+		if (!next || in_flight >= UPLOAD_WINDOW) {
+			break;
+		}
+
+		next->state = SLOT_IN_FLIGHT;
+		next->age = 0;
+		next->send = true;
+	}
+}
+
+/*
+ * Call within a critical region. Takes the oldest write that is due to be
+ * sent for the calling context, or returns 0 and lets others send.
+ */
+static UPLOAD_SLOT_t *send_next(void) {
+	UPLOAD_SLOT_t *next = 0;
+
+	for (int i = 0;i < SLOT_NUM;i++) {
+		UPLOAD_SLOT_t *s = &m_slots[i];
+		if (s->state == SLOT_IN_FLIGHT && s->send &&
+				(!next || (int32_t)(s->seq - next->seq) < 0)) {
+			next = s;
+		}
+	}
+
+	if (next) {
+		next->send = false;
+		m_send_slot = next - m_slots;
+	} else {
+		m_send_slot = -1;
+	}
+
+	return next;
+}
+
+/*
+ * Send the writes that are due, oldest first. Older firmwares answer without
+ * the offset, so the writes must not be reordered by two contexts sending at
+ * the same time. The slot that is being sent is not reused meanwhile.
+ */
+static void slots_send(void) {
+	UPLOAD_SLOT_t *s = 0;
+
+	CRITICAL_REGION_ENTER();
+	if (m_send_slot < 0) {
+		s = send_next();
+	}
+	CRITICAL_REGION_EXIT();
+
+	while (s) {
+		packet_send_packet(s->data, s->len, m_vesc_handler);
+
+		CRITICAL_REGION_ENTER();
+		s = send_next();
+		CRITICAL_REGION_EXIT();
+	}
+}
+
+/*
+ * Call within a critical region. Takes the next held back packet, or returns
+ * 0 when there is none for now. forward is set to false if the upload has
+ * failed and the packet is to be dropped. An erase is always forwarded and
+ * starts a new upload. The held packets stay in place until the last one has
+ * been handled, so that later packets from the clients are held behind them.
+ */
+static uint8_t *held_next(bool *forward) {
+	m_held_busy = false;
+
+	if (!m_held_flush) {
+		return 0;
+	}
+
+	if (m_held_pos < m_held_len) {
+		uint8_t *entry = m_held + m_held_pos;
+		if (!entry[0]) {
+			// Still being copied, upload_process_client flushes after that
+			return 0;
+		}
+
+		m_held_pos += ((unsigned int)entry[2] << 8 | entry[3]) + HELD_HDR;
+
+		if (is_erase(entry[HELD_HDR])) {
+			erase_start();
+		}
+
+		*forward = !m_failed;
+		m_held_busy = true;
+		return entry;
+	}
+
+	m_held_len = 0;
+	m_held_pos = 0;
+	m_held_flush = false;
+	return 0;
+}
+
+/*
+ * Forward the held back packets, oldest first, or drop them if the upload
+ * has failed. Only one context flushes at a time.
+ */
+static void held_flush(void) {
+	uint8_t *entry = 0;
+	bool forward = false;
+
+	CRITICAL_REGION_ENTER();
+	if (!m_held_busy) {
+		entry = held_next(&forward);
+	}
+	CRITICAL_REGION_EXIT();
+
+	while (entry) {
+		int handler_num = entry[1];
+		unsigned int len = (unsigned int)entry[2] << 8 | entry[3];
+
+		if (!forward) {
+			send_dropped(entry[HELD_HDR], handler_num);
+		} else if (m_forward_func) {
+			m_forward_func(entry + HELD_HDR, len, handler_num);
+		}
+
+		CRITICAL_REGION_ENTER();
+		entry = held_next(&forward);
+		CRITICAL_REGION_EXIT();
+	}
+}
@@ -0,0 +1,44 @@
+/*
+	Copyright 2019 Benjamin Vedder	benjamin@vedder.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef UPLOAD_H_
+#define UPLOAD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Settings
+#ifndef UPLOAD_WINDOW
+#define UPLOAD_WINDOW				3		// Writes in flight to the VESC
+#endif
+
+#define UPLOAD_WRITE_TIMEOUT		1000	// Ticks before a write is sent again
+#define UPLOAD_WRITE_RETRIES		2		// Resends before the upload fails
+#define UPLOAD_ERASE_TIMEOUT		20000	// Longest time an erase may take
+#define UPLOAD_IDLE_TIMEOUT			500		// Upload is over after this long without traffic
+#define UPLOAD_HELD_LEN				1024	// Bytes of client packets held back during writes, 4 per packet more than their length
+
+// Functions
+void upload_init(int vesc_handler_num,
+		void (*forward_func)(unsigned char *data, unsigned int len, int handler_num));
+bool upload_process_client(unsigned char *data, unsigned int len, int handler_num);
+bool upload_process_vesc(unsigned char *data, unsigned int len);
+bool upload_active(void);
+void upload_timerfunc(void);
+void upload_process(void);
+
+#endif /* UPLOAD_H_ */